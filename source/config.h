@@ -330,8 +330,16 @@ constexpr int MAX_PLY_NUM = 246;
 
 // 学習のためにOpenBLASを使う
 // "../openblas/lib/libopenblas.dll.a"をlibとして追加すること。
+// defineしない場合は、内蔵の行列演算(eval/nnue/trainer/trainer_gemm.h)を用いる。
 //#define USE_BLAS
 
+// 学習時に入力特徴量変換器の重み行列を16bitの浮動小数で保持する。
+// 学習用の重み行列のメモリ使用量とメモリ帯域が半分になる。計算はfloatで行う。
+// BF16はbfloat16、FP16はIEEE 754の半精度浮動小数。
+// FP16の方が精度は高いが、F16C命令が使えないと(-mf16cを指定していない場合など)変換が遅くなる。
+//#define NNUE_TRAINER_BF16_WEIGHTS
+//#define NNUE_TRAINER_FP16_WEIGHTS
+
 // KP256を用いる場合これをdefineする。
 // ※　これをdefineしていなければNNUE標準のhalfKP256になる。
 // #define EVAL_NNUE_KP256
@@ -6,11 +6,13 @@
 
 #include <random>
 #include <fstream>
+#include <thread>
 
 #include "../../learn/learn.h"
 #include "../../learn/learning_tools.h"
 
 #include "../../position.h"
+#include "../../thread.h"
 #include "../../usi.h"
 #include "../../misc.h"
 
@@ -32,11 +34,28 @@ namespace NNUE {
 
 namespace {
 
-// 学習データ
-std::vector<Example> examples;
-
-// examplesの排他制御をするMutex
-std::mutex examples_mutex;
+// 探索スレッドごとの学習データと、特徴量を求めるための作業領域
+// AddExample()とUpdateParameters()は呼び出し側で同時に呼ばれないようにしているので、
+// 各スレッドはロックを取らずに自分のバッファに追加する。
+struct ThreadExamples {
+  ExampleBatch examples;
+  std::vector<TrainingFeature> training_features;
+  std::vector<TrainingFeature> unique_features[2];
+};
+std::vector<ThreadExamples> thread_examples;
+
+// ミニバッチに満たずに次回の更新に持ち越す学習データ
+ExampleBatch examples;
+ExampleBatch next_examples;
+
+// ミニバッチ
+// 領域を使い回すため、数はnum_batchesで管理する。
+std::vector<ExampleBatch> batches;
+std::size_t num_batches;
+
+// 裏で勾配の計算とパラメーターの更新を行うスレッド
+// 更新が終わったパラメーターは、次のUpdateParameters()などで量子化して評価関数に反映する。
+std::thread update_thread;
 
 // ミニバッチのサンプル数
 u64 batch_size;
@@ -68,6 +87,73 @@ void SendMessages(std::vector<Message> messages) {
   }
 }
 
+// 裏で行っているパラメーターの更新の完了を待ち、評価関数に反映する
+void FinishPendingUpdate() {
+  if (!update_thread.joinable()) {
+    return;
+  }
+  update_thread.join();
+  SendMessages({{"quantize_parameters"}});
+}
+
+// 局面から学習用特徴量を求めて、学習データに追加する
+void AppendExample(const Position& pos, const Learner::PackedSfenValue& psv,
+                   int sign, double weight, ThreadExamples* thread_example) {
+  Features::IndexList active_indices[2];
+  for (const auto trigger : kRefreshTriggers) {
+    RawFeatures::AppendActiveIndices(pos, trigger, active_indices);
+  }
+  if (pos.side_to_move() != BLACK) {
+    active_indices[0].swap(active_indices[1]);
+  }
+  for (const auto color : COLOR) {
+    auto& training_features = thread_example->training_features;
+    training_features.clear();
+    for (const auto base_index : active_indices[color]) {
+      static_assert(Features::Factorizer<RawFeatures>::GetDimensions() <
+                    (1 << TrainingFeature::kIndexBits), "");
+      Features::Factorizer<RawFeatures>::AppendTrainingFeatures(
+          base_index, &training_features);
+    }
+    std::sort(training_features.begin(), training_features.end());
+
+    auto& unique_features = thread_example->unique_features[color];
+    unique_features.clear();
+    for (const auto& feature : training_features) {
+      if (!unique_features.empty() &&
+          feature.GetIndex() == unique_features.back().GetIndex()) {
+        unique_features.back() += feature;
+      } else {
+        unique_features.push_back(feature);
+      }
+    }
+  }
+
+  thread_example->examples.Add(psv, sign, weight,
+                               thread_example->unique_features);
+}
+
+// ミニバッチごとに勾配を計算してパラメーターを更新する
+void TrainBatches(LearnFloatType learning_rate) {
+  std::vector<LearnFloatType> gradients;
+  for (std::size_t i = 0; i < num_batches; ++i) {
+    const auto& batch = batches[i];
+    const auto network_output = trainer->Propagate(batch);
+
+    gradients.resize(batch.size());
+    for (std::size_t b = 0; b < batch.size(); ++b) {
+      const auto sign = batch.GetSign(b);
+      const auto shallow = static_cast<Value>(Round<std::int32_t>(
+          sign * network_output[b] * kPonanzaConstant));
+      const auto& psv = batch.GetPsv(b);
+      const double gradient = sign * Learner::calc_grad(shallow, psv);
+      gradients[b] = static_cast<LearnFloatType>(gradient * batch.GetWeight(b));
+    }
+
+    trainer->Backpropagate(gradients.data(), learning_rate);
+  }
+}
+
 }  // namespace
 
 // L2正規化パラメーターを返す
@@ -90,6 +176,9 @@ void InitializeTraining(double eta1, u64 eta1_epoch,
     trainer->Initialize(rng);
   }
 
+  thread_examples.clear();
+  thread_examples.resize(Threads.size());
+
   global_learning_rate_scale = 1.0;
   l2_regularization_parameter = l2_regularization;
   EvalLearningTools::Weight::init_eta(eta1, eta2, eta3, eta1_epoch, eta2_epoch);
@@ -123,6 +212,8 @@ void SetOptions(const std::string& options) {
 
 // 学習用評価関数パラメータをファイルから読み直す
 void RestoreParameters(const std::string& dir_name) {
+  FinishPendingUpdate();
+
   const std::string file_name = Path::Combine(dir_name, NNUE::kFileName);
   std::ifstream stream(file_name, std::ios::binary);
   bool result = ReadParameters(stream);
@@ -134,82 +225,147 @@ void RestoreParameters(const std::string& dir_name) {
 // 学習データを1サンプル追加する
 void AddExample(Position& pos, Color rootColor,
                 const Learner::PackedSfenValue& psv, double weight) {
-  Example example;
-  if (rootColor == pos.side_to_move()) {
-    example.sign = 1;
-  } else {
-    example.sign = -1;
-  }
-  example.psv = psv;
-  example.weight = weight;
-
-  Features::IndexList active_indices[2];
-  for (const auto trigger : kRefreshTriggers) {
-    RawFeatures::AppendActiveIndices(pos, trigger, active_indices);
-  }
-  if (pos.side_to_move() != BLACK) {
-    active_indices[0].swap(active_indices[1]);
-  }
-  for (const auto color : COLOR) {
-    std::vector<TrainingFeature> training_features;
-    for (const auto base_index : active_indices[color]) {
-      static_assert(Features::Factorizer<RawFeatures>::GetDimensions() <
-                    (1 << TrainingFeature::kIndexBits), "");
-      Features::Factorizer<RawFeatures>::AppendTrainingFeatures(
-          base_index, &training_features);
-    }
-    std::sort(training_features.begin(), training_features.end());
-
-    auto& unique_features = example.training_features[color];
-    for (const auto& feature : training_features) {
-      if (!unique_features.empty() &&
-          feature.GetIndex() == unique_features.back().GetIndex()) {
-        unique_features.back() += feature;
-      } else {
-        unique_features.push_back(feature);
-      }
-    }
-  }
-
-  std::lock_guard<std::mutex> lock(examples_mutex);
-  examples.push_back(std::move(example));
+  const auto thread_id = pos.this_thread()->thread_id();
+  ASSERT_LV3(thread_id < thread_examples.size());
+  const int sign = rootColor == pos.side_to_move() ? 1 : -1;
+  AppendExample(pos, psv, sign, weight, &thread_examples[thread_id]);
 }
 
 // 評価関数パラメーターを更新する
 void UpdateParameters(u64 epoch) {
   ASSERT_LV3(batch_size > 0);
 
+  // 前回の更新を評価関数に反映してから、次の更新を始める。
+  FinishPendingUpdate();
+
   EvalLearningTools::Weight::calc_eta(epoch);
   const auto learning_rate = static_cast<LearnFloatType>(
       get_eta() / batch_size);
 
-  std::lock_guard<std::mutex> lock(examples_mutex);
-  std::shuffle(examples.begin(), examples.end(), rng);
-  while (examples.size() >= batch_size) {
-    std::vector<Example> batch(examples.end() - batch_size, examples.end());
-    examples.resize(examples.size() - batch_size);
-
-    const auto network_output = trainer->Propagate(batch);
-
-    std::vector<LearnFloatType> gradients(batch.size());
-    for (std::size_t b = 0; b < batch.size(); ++b) {
-      const auto shallow = static_cast<Value>(Round<std::int32_t>(
-          batch[b].sign * network_output[b] * kPonanzaConstant));
-      const auto& psv = batch[b].psv;
-      const double gradient = batch[b].sign * Learner::calc_grad(shallow, psv);
-      gradients[b] = static_cast<LearnFloatType>(gradient * batch[b].weight);
+  // 各スレッドが集めた学習データを回収し、シャッフルしてミニバッチに詰め直す。
+  // 回収後は、勾配の計算と並行して探索スレッドが次の学習データを集められる。
+  // 並べ替えはサンプルの番号に対して行い、特徴量は詰め直すときに1回だけコピーする。
+  std::vector<const ExampleBatch*> sources = {&examples};
+  for (const auto& thread_example : thread_examples) {
+    sources.push_back(&thread_example.examples);
+  }
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> indices;
+  for (std::uint32_t i = 0; i < sources.size(); ++i) {
+    for (std::uint32_t j = 0; j < sources[i]->size(); ++j) {
+      indices.emplace_back(i, j);
     }
+  }
+  std::shuffle(indices.begin(), indices.end(), rng);
 
-    trainer->Backpropagate(gradients.data(), learning_rate);
+  num_batches = indices.size() / batch_size;
+  if (batches.size() < num_batches) {
+    batches.resize(num_batches);
   }
-  SendMessages({{"quantize_parameters"}});
+  auto index = indices.begin();
+  for (std::size_t i = 0; i < num_batches; ++i) {
+    batches[i].clear();
+    for (u64 b = 0; b < batch_size; ++b, ++index) {
+      batches[i].Append(*sources[index->first], index->second);
+    }
+  }
+  next_examples.clear();
+  for (; index != indices.end(); ++index) {
+    next_examples.Append(*sources[index->first], index->second);
+  }
+  std::swap(examples, next_examples);
+  for (auto& thread_example : thread_examples) {
+    thread_example.examples.clear();
+  }
+  if (num_batches == 0) {
+    return;
+  }
+
+  update_thread = std::thread(TrainBatches, learning_rate);
+}
+
+// 裏で行っているパラメーターの更新を完了させ、評価関数に反映する
+void FinishUpdateParameters() {
+  FinishPendingUpdate();
 }
 
 // 学習に問題が生じていないかチェックする
 void CheckHealth() {
+  FinishPendingUpdate();
   SendMessages({{"check_health"}});
 }
 
+#if defined(ENABLE_TEST_CMD)
+// 入力特徴量変換器の学習の速度を計測する
+void BenchmarkTraining(Position& pos, std::istream& stream) {
+  std::uint64_t batch_size = 10000;
+  std::uint64_t num_batches = 20;
+  double l2_regularization = 0.0;
+  stream >> batch_size >> num_batches >> l2_regularization;
+
+  // ランダムプレイヤーで生成した局面をミニバッチにする
+  const int kMaxPly = 256;
+  std::vector<StateInfo> states(kMaxPly + 1);
+  PRNG prng(20201016);
+  ThreadExamples thread_example;
+  pos.set_hirate(&states[0], Threads.main());
+  int ply = 0;
+  for (std::uint64_t i = 0; i < batch_size; ++i) {
+    MoveList<LEGAL_ALL> move_list(pos);
+    if (move_list.size() == 0 || ply == kMaxPly) {
+      pos.set_hirate(&states[0], Threads.main());
+      ply = 0;
+    } else {
+      pos.do_move(move_list.begin()[prng.rand(move_list.size())],
+                  states[++ply]);
+    }
+    AppendExample(pos, Learner::PackedSfenValue(), 1, 1.0, &thread_example);
+  }
+  pos.set_hirate(&states[0], Threads.main());
+  const auto& batch = thread_example.examples;
+
+  // 出力側から来る勾配は乱数で代用する
+  std::vector<LearnFloatType> gradients(
+      FeatureTransformer::kOutputDimensions * batch.size());
+  for (auto& gradient : gradients) {
+    gradient = static_cast<LearnFloatType>(
+        (prng.rand(2001) - 1000.0) / 1000000.0);
+  }
+
+  std::cout << "feature transformer training benchmark: batch_size = "
+            << batch_size << ", num_batches = " << num_batches
+            << ", l2_regularization = " << l2_regularization << std::endl;
+
+  // 評価関数の量子化されたパラメーターは書き換えない
+  const auto saved_l2_regularization = l2_regularization_parameter;
+  l2_regularization_parameter = l2_regularization;
+  const auto bench_trainer =
+      Trainer<FeatureTransformer>::Create(feature_transformer.get());
+  TimePoint propagate_time = 0;
+  TimePoint backpropagate_time = 0;
+  for (std::uint64_t i = 0; i < num_batches; ++i) {
+    auto start = now();
+    bench_trainer->Propagate(batch);
+    propagate_time += now() - start;
+
+    start = now();
+    bench_trainer->Backpropagate(gradients.data(), 1.0);
+    backpropagate_time += now() - start;
+  }
+  l2_regularization_parameter = saved_l2_regularization;
+
+  const auto rate = [&](TimePoint time) {
+    return 1000.0 * batch_size * num_batches / std::max<TimePoint>(1, time);
+  };
+  std::cout << "propagate     : " << rate(propagate_time)
+            << " samples/second" << std::endl;
+  std::cout << "backpropagate : " << rate(backpropagate_time)
+            << " samples/second" << std::endl;
+  std::cout << "total         : "
+            << rate(propagate_time + backpropagate_time)
+            << " samples/second" << std::endl;
+}
+#endif
+
 }  // namespace NNUE
 
 // 評価関数パラメーターをファイルに保存する
@@ -222,6 +378,8 @@ void save_eval(std::string dir_name) {
   // また、EvalSaveDirまでのフォルダは掘ってあるものとする。
   Directory::CreateFolder(eval_dir);
 
+  NNUE::FinishUpdateParameters();
+
   if (Options["SkipLoadingEval"] && NNUE::trainer) {
     NNUE::SendMessages({{"clear_unobserved_feature_weights"}});
   }
@@ -34,15 +34,27 @@ void SetOptions(const std::string& options);
 void RestoreParameters(const std::string& dir_name);
 
 // 学習データを1サンプル追加する
+// 探索スレッドごとのバッファに追加するので、UpdateParameters()と同時に呼び出してはならない。
 void AddExample(Position& pos, Color rootColor,
                 const Learner::PackedSfenValue& psv, double weight);
 
 // 評価関数パラメータを更新する
+// 前回の呼び出しで始めた更新を評価関数に反映し、新たに集まった学習データによる更新を裏で始める。
+// 評価関数を書き換えるので、評価関数を使っているスレッドがない状態で呼び出すこと。
 void UpdateParameters(u64 epoch);
 
+// 裏で行っているパラメーターの更新を完了させ、評価関数に反映する
+// UpdateParameters()と同じく、評価関数を使っているスレッドがない状態で呼び出すこと。
+void FinishUpdateParameters();
+
 // 学習に問題が生じていないかチェックする
 void CheckHealth();
 
+#if defined(ENABLE_TEST_CMD)
+// 入力特徴量変換器の学習の速度を計測する
+void BenchmarkTraining(Position& pos, std::istream& stream);
+#endif
+
 }  // namespace NNUE
 
 }  // namespace Eval
@@ -6,6 +6,7 @@
 
 #include "../../extra/all.h"
 #include "evaluate_nnue.h"
+#include "evaluate_nnue_learner.h"
 #include "nnue_test_command.h"
 
 #include <set>
@@ -184,10 +185,18 @@ void TestCommand(Position& pos, std::istream& stream) {
     TestFeatures(pos);
   } else if (sub_command == "info") {
     PrintInfo(stream);
+#if defined(EVAL_LEARN)
+  } else if (sub_command == "train_bench") {
+    BenchmarkTraining(pos, stream);
+#endif
   } else {
     std::cout << "usage:" << std::endl;
     std::cout << " test nn test_features" << std::endl;
     std::cout << " test nn info [path/to/" << kFileName << "...]" << std::endl;
+#if defined(EVAL_LEARN)
+    std::cout << " test nn train_bench [batch_size] [num_batches] [l2]"
+              << std::endl;
+#endif
   }
 }
 
@@ -10,7 +10,9 @@
 #include "../nnue_common.h"
 #include "../features/index_list.h"
 
+#include <cmath>
 #include <sstream>
+#include <vector>
 #if defined(USE_BLAS)
 static_assert(std::is_same<LearnFloatType, float>::value, "");
 #include <cblas.h>
@@ -62,12 +64,83 @@ class TrainingFeature {
   StorageType index_and_count_;
 };
 
-// 学習データ1サンプルを表す構造体
-struct Example {
-  std::vector<TrainingFeature> training_features[2];
-  Learner::PackedSfenValue psv;
-  int sign;
-  double weight;
+// 学習データのサンプルを並べたもの
+// サンプルごとにメモリを確保しないよう、全サンプルの特徴量を1本の配列に詰めて持つ。
+// clear()しても確保済みのメモリは解放しないので、使い回すとメモリ確保が起きなくなる。
+class ExampleBatch {
+ public:
+  // 1サンプルの片方の手番から見た特徴量の並び
+  class FeatureRange {
+   public:
+    FeatureRange(const TrainingFeature* begin, const TrainingFeature* end) :
+        begin_(begin), end_(end) {}
+    const TrainingFeature* begin() const { return begin_; }
+    const TrainingFeature* end() const { return end_; }
+
+   private:
+    const TrainingFeature* begin_;
+    const TrainingFeature* end_;
+  };
+
+  std::size_t size() const { return psvs_.size(); }
+  bool empty() const { return psvs_.empty(); }
+
+  void clear() {
+    features_.clear();
+    offsets_.assign(1, 0);
+    psvs_.clear();
+    signs_.clear();
+    weights_.clear();
+  }
+
+  // サンプルを1つ追加する
+  // features[c]には手番cから見た特徴量を、インデックスの昇順に重複なく並べておく。
+  void Add(const Learner::PackedSfenValue& psv, int sign, double weight,
+           const std::vector<TrainingFeature> (&features)[2]) {
+    for (const auto& color_features : features) {
+      features_.insert(features_.end(),
+                       color_features.begin(), color_features.end());
+      offsets_.push_back(static_cast<std::uint32_t>(features_.size()));
+    }
+    psvs_.push_back(psv);
+    signs_.push_back(static_cast<std::int8_t>(sign));
+    weights_.push_back(weight);
+  }
+
+  // 別のExampleBatchのサンプルを1つ末尾にコピーする
+  void Append(const ExampleBatch& other, std::size_t index) {
+    const auto first = other.offsets_[2 * index];
+    const auto middle = other.offsets_[2 * index + 1];
+    const auto last = other.offsets_[2 * index + 2];
+    const auto offset = static_cast<std::uint32_t>(features_.size());
+    features_.insert(features_.end(), other.features_.begin() + first,
+                     other.features_.begin() + last);
+    offsets_.push_back(offset + (middle - first));
+    offsets_.push_back(offset + (last - first));
+    psvs_.push_back(other.psvs_[index]);
+    signs_.push_back(other.signs_[index]);
+    weights_.push_back(other.weights_[index]);
+  }
+
+  FeatureRange GetFeatures(std::size_t index, IndexType color) const {
+    const auto* features = features_.data();
+    return FeatureRange(features + offsets_[2 * index + color],
+                        features + offsets_[2 * index + color + 1]);
+  }
+  const Learner::PackedSfenValue& GetPsv(std::size_t index) const {
+    return psvs_[index];
+  }
+  int GetSign(std::size_t index) const { return signs_[index]; }
+  double GetWeight(std::size_t index) const { return weights_[index]; }
+
+ private:
+  // 全サンプルの特徴量
+  std::vector<TrainingFeature> features_;
+  // サンプルbの手番cの特徴量はfeatures_[offsets_[2b+c]]からfeatures_[offsets_[2b+c+1]]の手前まで
+  std::vector<std::uint32_t> offsets_ = std::vector<std::uint32_t>(1, 0);
+  std::vector<Learner::PackedSfenValue> psvs_;
+  std::vector<std::int8_t> signs_;
+  std::vector<double> weights_;
 };
 
 // ハイパーパラメータの設定などに使用するメッセージ
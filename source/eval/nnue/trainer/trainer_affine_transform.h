@@ -10,6 +10,7 @@
 #include "../../../learn/learn.h"
 #include "../layers/affine_transform.h"
 #include "trainer.h"
+#include "trainer_gemm.h"
 
 #include <random>
 
@@ -79,7 +80,7 @@ class Trainer<Layers::AffineTransform<PreviousLayer, OutputDimensions>> {
   }
 
   // 順伝播
-  const LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  const LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (output_.size() < kOutputDimensions * batch.size()) {
       output_.resize(kOutputDimensions * batch.size());
       gradients_.resize(kInputDimensions * batch.size());
@@ -97,18 +98,8 @@ class Trainer<Layers::AffineTransform<PreviousLayer, OutputDimensions>> {
                 batch_input_, kInputDimensions,
                 1.0, &output_[0], kOutputDimensions);
 #else
-    for (IndexType b = 0; b < batch_size_; ++b) {
-      const IndexType input_batch_offset = kInputDimensions * b;
-      const IndexType output_batch_offset = kOutputDimensions * b;
-      for (IndexType i = 0; i < kOutputDimensions; ++i) {
-        double sum = biases_[i];
-        for (IndexType j = 0; j < kInputDimensions; ++j) {
-          const IndexType index = kInputDimensions * i + j;
-          sum += weights_[index] * batch_input_[input_batch_offset + j];
-        }
-        output_[output_batch_offset + i] = static_cast<LearnFloatType>(sum);
-      }
-    }
+    Gemm::AffineForward<kOutputDimensions, kInputDimensions>(
+        batch_size_, weights_, biases_, batch_input_, &output_[0]);
 #endif
     return output_.data();
   }
@@ -157,54 +148,22 @@ class Trainer<Layers::AffineTransform<PreviousLayer, OutputDimensions>> {
     }
 #else
     // backpropagate
-    for (IndexType b = 0; b < batch_size_; ++b) {
-      const IndexType input_batch_offset = kInputDimensions * b;
-      const IndexType output_batch_offset = kOutputDimensions * b;
-      for (IndexType j = 0; j < kInputDimensions; ++j) {
-        double sum = 0.0;
-        for (IndexType i = 0; i < kOutputDimensions; ++i) {
-          const IndexType index = kInputDimensions * i + j;
-          sum += weights_[index] * gradients[output_batch_offset + i];
-        }
-        gradients_[input_batch_offset + j] = static_cast<LearnFloatType>(sum);
-      }
-    }
+    Gemm::AffineBackwardInput<kOutputDimensions, kInputDimensions>(
+        batch_size_, weights_, gradients, &gradients_[0]);
     // update
-    for (IndexType i = 0; i < kOutputDimensions; ++i) {
-      biases_diff_[i] *= momentum_;
-    }
-    for (IndexType i = 0; i < kOutputDimensions * kInputDimensions; ++i) {
-      weights_diff_[i] *= momentum_;
-    }
-    for (IndexType b = 0; b < batch_size_; ++b) {
-      const IndexType input_batch_offset = kInputDimensions * b;
-      const IndexType output_batch_offset = kOutputDimensions * b;
-      for (IndexType i = 0; i < kOutputDimensions; ++i) {
-        biases_diff_[i] += gradients[output_batch_offset + i];
-      }
-      for (IndexType i = 0; i < kOutputDimensions; ++i) {
-        for (IndexType j = 0; j < kInputDimensions; ++j) {
-          const IndexType index = kInputDimensions * i + j;
-          weights_diff_[index] += gradients[output_batch_offset + i] *
-              batch_input_[input_batch_offset + j];
-        }
-      }
-    }
-    for (IndexType i = 0; i < kOutputDimensions; ++i) {
-      biases_[i] -= local_learning_rate * biases_diff_[i];
-    }
-    for (IndexType i = 0; i < kOutputDimensions * kInputDimensions; ++i) {
-      weights_[i] -= local_learning_rate * weights_diff_[i];
-    }
+    Gemm::AffineBackwardWeights<kOutputDimensions, kInputDimensions>(
+        batch_size_, gradients, batch_input_, momentum_,
+        weights_diff_, biases_diff_);
+    Gemm::Axpy(kOutputDimensions, -local_learning_rate,
+               biases_diff_, biases_);
+    Gemm::Axpy(kOutputDimensions * kInputDimensions, -local_learning_rate,
+               weights_diff_, weights_);
 
     // L2正規化
     if (l2_regularization_parameter != 1.0) {
-        for (IndexType i = 0; i < kOutputDimensions; ++i) {
-            biases_[i] *= l2_regularization_parameter;
-        }
-        for (IndexType i = 0; i < kOutputDimensions * kInputDimensions; ++i) {
-            weights_[i] *= l2_regularization_parameter;
-        }
+        Gemm::Scale(kOutputDimensions, l2_regularization_parameter, biases_);
+        Gemm::Scale(kOutputDimensions * kInputDimensions,
+                    l2_regularization_parameter, weights_);
     }
 #endif
     previous_layer_trainer_->Backpropagate(gradients_.data(), learning_rate);
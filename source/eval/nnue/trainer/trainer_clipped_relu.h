@@ -45,7 +45,7 @@ public:
   }
 
   // 順伝播
-  const LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  const LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (output_.size() < kOutputDimensions * batch.size()) {
       output_.resize(kOutputDimensions * batch.size());
       gradients_.resize(kInputDimensions * batch.size());
@@ -10,6 +10,8 @@
 #include "../../../learn/learn.h"
 #include "../nnue_feature_transformer.h"
 #include "trainer.h"
+#include "trainer_gemm.h"
+#include "trainer_half_float.h"
 #include "features/factorizer_feature_set.h"
 
 #include <array>
@@ -70,49 +72,56 @@ class Trainer<FeatureTransformer> {
   // パラメータを乱数で初期化する
   template <typename RNG>
   void Initialize(RNG& rng) {
-    std::fill(std::begin(weights_), std::end(weights_), +kZero);
+    std::fill(std::begin(weights_), std::end(weights_), kZeroWeight);
     const double kSigma = 0.1 / std::sqrt(RawFeatures::kMaxActiveDimensions);
     auto distribution = std::normal_distribution<double>(0.0, kSigma);
     for (IndexType i = 0; i < kHalfDimensions * RawFeatures::kDimensions; ++i) {
       const auto weight = static_cast<LearnFloatType>(distribution(rng));
-      weights_[i] = weight;
+      weights_[i] = FloatToWeight<LearnWeightType>(weight);
     }
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
       biases_[i] = static_cast<LearnFloatType>(0.5);
     }
+    ResetL2Regularization();
     QuantizeParameters();
   }
 
   // 順伝播
-  const LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  const LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (output_.size() < kOutputDimensions * batch.size()) {
       output_.resize(kOutputDimensions * batch.size());
       gradients_.resize(kOutputDimensions * batch.size());
     }
     batch_ = &batch;
+    // 遅らせていたL2正規化を、このミニバッチで使う行に適用しておく
+    if (l2_regularization_log_ != 0.0) {
+#pragma omp parallel
+      ForEachOwnedFeature([&](IndexType, IndexType,
+                              const TrainingFeature& feature) {
+        ApplyL2Regularization(feature.GetIndex());
+      });
+    }
     // affine transform
 #pragma omp parallel for
     for (IndexType b = 0; b < batch.size(); ++b) {
       const IndexType batch_offset = kOutputDimensions * b;
       for (IndexType c = 0; c < 2; ++c) {
         const IndexType output_offset = batch_offset + kHalfDimensions * c;
-#if defined(USE_BLAS)
+#if defined(USE_BLAS) && !defined(NNUE_TRAINER_HALF_FLOAT_WEIGHTS)
         cblas_scopy(kHalfDimensions, biases_, 1, &output_[output_offset], 1);
-        for (const auto& feature : batch[b].training_features[c]) {
+        for (const auto& feature : batch.GetFeatures(b, c)) {
           const IndexType weights_offset = kHalfDimensions * feature.GetIndex();
           cblas_saxpy(kHalfDimensions, (float)feature.GetCount(),
                       &weights_[weights_offset], 1, &output_[output_offset], 1);
         }
 #else
-        for (IndexType i = 0; i < kHalfDimensions; ++i) {
-          output_[output_offset + i] = biases_[i];
-        }
-        for (const auto& feature : batch[b].training_features[c]) {
+        std::copy(std::begin(biases_), std::end(biases_),
+                  &output_[output_offset]);
+        for (const auto& feature : batch.GetFeatures(b, c)) {
           const IndexType weights_offset = kHalfDimensions * feature.GetIndex();
-          for (IndexType i = 0; i < kHalfDimensions; ++i) {
-            output_[output_offset + i] +=
-                feature.GetCount() * weights_[weights_offset + i];
-          }
+          Gemm::Axpy(kHalfDimensions,
+                     static_cast<LearnFloatType>(feature.GetCount()),
+                     &weights_[weights_offset], &output_[output_offset]);
         }
 #endif
       }
@@ -154,8 +163,11 @@ class Trainer<FeatureTransformer> {
     // L2正規化を行う
     // 実際に掛ける値は、1.0 - l2_regularization_parameterに
     // 学習率の変化を考慮して重みを調整したもの。
-    auto l2_regularization_parameter = static_cast<LearnFloatType>(
-        std::pow(1.0 - GetL2RegularizationParameter(), local_learning_rate));
+    // 重み行列は、掛ける値の対数を積算しておき、行を使うときにまとめて掛ける。
+    const double l2_regularization_log = local_learning_rate *
+        std::log(1.0 - GetL2RegularizationParameter());
+    const auto l2_regularization_parameter = static_cast<LearnFloatType>(
+        std::exp(l2_regularization_log));
 
 #if defined(USE_BLAS)
     cblas_sscal(kHalfDimensions, momentum_, biases_diff_, 1);
@@ -169,83 +181,50 @@ class Trainer<FeatureTransformer> {
     }
     cblas_saxpy(kHalfDimensions, -local_learning_rate,
                 biases_diff_, 1, biases_, 1);
-#pragma omp parallel
-    {
-#if defined(_OPENMP)
-      const IndexType num_threads = omp_get_num_threads();
-      const IndexType thread_index = omp_get_thread_num();
-#endif
-      for (IndexType b = 0; b < batch_->size(); ++b) {
-        const IndexType batch_offset = kOutputDimensions * b;
-        for (IndexType c = 0; c < 2; ++c) {
-          const IndexType output_offset = batch_offset + kHalfDimensions * c;
-          for (const auto& feature : (*batch_)[b].training_features[c]) {
-#if defined(_OPENMP)
-            if (feature.GetIndex() % num_threads != thread_index) continue;
-#endif
-            const IndexType weights_offset =
-                kHalfDimensions * feature.GetIndex();
-            const auto scale = static_cast<LearnFloatType>(
-                effective_learning_rate / feature.GetCount());
-            cblas_saxpy(kHalfDimensions, -scale,
-                        &gradients_[output_offset], 1,
-                        &weights_[weights_offset], 1);
-          }
-        }
-      }
-    }
-
-    // L2正規化を行う
-    if (l2_regularization_parameter != 1.0) {
-        cblas_sscal(kHalfDimensions, l2_regularization_parameter, biases_, 1);
-        cblas_sscal(kHalfDimensions * kInputDimensions,
-                    l2_regularization_parameter, weights_, 1);
-    }
 #else
-    for (IndexType i = 0; i < kHalfDimensions; ++i) {
-      biases_diff_[i] *= momentum_;
-    }
+    Gemm::Scale(kHalfDimensions, momentum_, biases_diff_);
     for (IndexType b = 0; b < batch_->size(); ++b) {
       const IndexType batch_offset = kOutputDimensions * b;
       for (IndexType c = 0; c < 2; ++c) {
         const IndexType output_offset = batch_offset + kHalfDimensions * c;
-        for (IndexType i = 0; i < kHalfDimensions; ++i) {
-          biases_diff_[i] += gradients_[output_offset + i];
-        }
-      }
-    }
-    for (IndexType i = 0; i < kHalfDimensions; ++i) {
-      biases_[i] -= local_learning_rate * biases_diff_[i];
-    }
-    for (IndexType b = 0; b < batch_->size(); ++b) {
-      const IndexType batch_offset = kOutputDimensions * b;
-      for (IndexType c = 0; c < 2; ++c) {
-        const IndexType output_offset = batch_offset + kHalfDimensions * c;
-        for (const auto& feature : (*batch_)[b].training_features[c]) {
-          const IndexType weights_offset = kHalfDimensions * feature.GetIndex();
-          const auto scale = static_cast<LearnFloatType>(
-              effective_learning_rate / feature.GetCount());
-          for (IndexType i = 0; i < kHalfDimensions; ++i) {
-            weights_[weights_offset + i] -=
-                scale * gradients_[output_offset + i];
-          }
-        }
+        Gemm::Axpy(kHalfDimensions, static_cast<LearnFloatType>(1.0),
+                   &gradients_[output_offset], biases_diff_);
       }
     }
+    Gemm::Axpy(kHalfDimensions, -local_learning_rate,
+               biases_diff_, biases_);
+#endif
+
+    // 重み行列は、ミニバッチに出現した特徴量に対応する行のみを更新する。
+#pragma omp parallel
+    ForEachOwnedFeature([&](IndexType b, IndexType c,
+                            const TrainingFeature& feature) {
+      const IndexType output_offset =
+          kOutputDimensions * b + kHalfDimensions * c;
+      const IndexType weights_offset = kHalfDimensions * feature.GetIndex();
+      const auto scale = static_cast<LearnFloatType>(
+          effective_learning_rate / feature.GetCount());
+#if defined(USE_BLAS) && !defined(NNUE_TRAINER_HALF_FLOAT_WEIGHTS)
+      cblas_saxpy(kHalfDimensions, -scale,
+                  &gradients_[output_offset], 1,
+                  &weights_[weights_offset], 1);
+#else
+      Gemm::Axpy(kHalfDimensions, -scale,
+                 &gradients_[output_offset], &weights_[weights_offset]);
+#endif
+    });
 
     // L2正規化を行う
     if (l2_regularization_parameter != 1.0) {
-        for (IndexType i = 0; i < kHalfDimensions; ++i) {
-            biases_[i] *= l2_regularization_parameter;
-        }
-        for (IndexType i = 0; i < kHalfDimensions * kInputDimensions; ++i) {
-            weights_[i] *= l2_regularization_parameter;
-        }
+      for (IndexType i = 0; i < kHalfDimensions; ++i) {
+        biases_[i] *= l2_regularization_parameter;
+      }
+      l2_regularization_log_ += l2_regularization_log;
     }
-#endif
+
     for (IndexType b = 0; b < batch_->size(); ++b) {
       for (IndexType c = 0; c < 2; ++c) {
-        for (const auto& feature : (*batch_)[b].training_features[c]) {
+        for (const auto& feature : batch_->GetFeatures(b, c)) {
           observed_features.set(feature.GetIndex());
         }
       }
@@ -260,6 +239,7 @@ class Trainer<FeatureTransformer> {
       biases_(),
       weights_(),
       biases_diff_(),
+      row_l2_regularization_logs_(kInputDimensions),
       momentum_(0.0),
       learning_rate_scale_(1.0) {
     min_pre_activation_ = std::numeric_limits<LearnFloatType>::max();
@@ -273,6 +253,10 @@ class Trainer<FeatureTransformer> {
 
   // 重みの飽和とパラメータの整数化
   void QuantizeParameters() {
+#pragma omp parallel for
+    for (IndexType j = 0; j < kInputDimensions; ++j) {
+      ApplyL2Regularization(j);
+    }
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
       target_layer_->biases_[i] =
           Round<typename LayerType::BiasType>(biases_[i] * kBiasScale);
@@ -286,7 +270,8 @@ class Trainer<FeatureTransformer> {
       for (IndexType i = 0; i < kHalfDimensions; ++i) {
         double sum = 0.0;
         for (const auto& feature : training_features) {
-          sum += weights_[kHalfDimensions * feature.GetIndex() + i];
+          sum += WeightToFloat(
+              weights_[kHalfDimensions * feature.GetIndex() + i]);
         }
         target_layer_->weights_[kHalfDimensions * j + i] =
             Round<typename LayerType::WeightType>(sum * kWeightScale);
@@ -300,12 +285,53 @@ class Trainer<FeatureTransformer> {
       biases_[i] = static_cast<LearnFloatType>(
           target_layer_->biases_[i] / kBiasScale);
     }
-    std::fill(std::begin(weights_), std::end(weights_), +kZero);
+    std::fill(std::begin(weights_), std::end(weights_), kZeroWeight);
     for (IndexType i = 0; i < kHalfDimensions * RawFeatures::kDimensions; ++i) {
-      weights_[i] = static_cast<LearnFloatType>(
-          target_layer_->weights_[i] / kWeightScale);
+      weights_[i] = FloatToWeight<LearnWeightType>(static_cast<LearnFloatType>(
+          target_layer_->weights_[i] / kWeightScale));
     }
     std::fill(std::begin(biases_diff_), std::end(biases_diff_), +kZero);
+    ResetL2Regularization();
+  }
+
+  // ミニバッチに出現した特徴量のうち、このスレッドが担当する行のものについてfunctionを呼び出す
+  // 重み行列の行を番号でスレッドに割り振るので、同じ行を複数のスレッドが書き換えることはない。
+  // サンプルの順に処理するので、同じサンプルの勾配はキャッシュに載ったまま使われる。
+  template <typename Function>
+  void ForEachOwnedFeature(Function function) const {
+#if defined(_OPENMP)
+    const IndexType num_threads = omp_get_num_threads();
+    const IndexType thread_index = omp_get_thread_num();
+#endif
+    for (IndexType b = 0; b < batch_->size(); ++b) {
+      for (IndexType c = 0; c < 2; ++c) {
+        for (const auto& feature : batch_->GetFeatures(b, c)) {
+#if defined(_OPENMP)
+          if (feature.GetIndex() % num_threads != thread_index) continue;
+#endif
+          function(b, c, feature);
+        }
+      }
+    }
+  }
+
+  // 重み行列の行に、まだ掛けていないL2正規化の係数を掛ける
+  void ApplyL2Regularization(IndexType row) {
+    auto& row_log = row_l2_regularization_logs_[row];
+    if (row_log == l2_regularization_log_) {
+      return;
+    }
+    const auto scale = static_cast<LearnFloatType>(
+        std::exp(l2_regularization_log_ - row_log));
+    Gemm::Scale(kHalfDimensions, scale, &weights_[kHalfDimensions * row]);
+    row_log = l2_regularization_log_;
+  }
+
+  // 重み行列に掛けるべきL2正規化の係数がない状態にする
+  void ResetL2Regularization() {
+    l2_regularization_log_ = 0.0;
+    std::fill(row_l2_regularization_logs_.begin(),
+              row_l2_regularization_logs_.end(), 0.0);
   }
 
   // 学習データに出現していない特徴量に対応する重みを0にする
@@ -313,7 +339,8 @@ class Trainer<FeatureTransformer> {
     for (IndexType i = 0; i < kInputDimensions; ++i) {
       if (!observed_features.test(i)) {
         std::fill(std::begin(weights_) + kHalfDimensions * i,
-                  std::begin(weights_) + kHalfDimensions * (i + 1), +kZero);
+                  std::begin(weights_) + kHalfDimensions * (i + 1),
+                  kZeroWeight);
       }
     }
     QuantizeParameters();
@@ -362,21 +389,29 @@ class Trainer<FeatureTransformer> {
   static constexpr LearnFloatType kZero = static_cast<LearnFloatType>(0.0);
   static constexpr LearnFloatType kOne = static_cast<LearnFloatType>(1.0);
 
+  // 重みの0
+  static constexpr LearnWeightType kZeroWeight = LearnWeightType();
+
   // ミニバッチ
-  const std::vector<Example>* batch_;
+  const ExampleBatch* batch_;
 
   // 学習対象の層
   LayerType* const target_layer_;
 
   // パラメータ
+  // 重み行列はNNUE_TRAINER_BF16_WEIGHTSなどをdefineすると16bitの浮動小数で保持する。
   alignas(kCacheLineSize) LearnFloatType biases_[kHalfDimensions];
   alignas(kCacheLineSize)
-      LearnFloatType weights_[kHalfDimensions * kInputDimensions];
+      LearnWeightType weights_[kHalfDimensions * kInputDimensions];
 
   // パラメータの更新で用いるバッファ
   LearnFloatType biases_diff_[kHalfDimensions];
   std::vector<LearnFloatType> gradients_;
 
+  // 重み行列に掛けるべきL2正規化の係数の対数の積算値と、各行に掛け終えた値
+  double l2_regularization_log_;
+  std::vector<double> row_l2_regularization_logs_;
+
   // 順伝播用バッファ
   std::vector<LearnFloatType> output_;
 
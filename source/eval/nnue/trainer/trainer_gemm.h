@@ -0,0 +1,441 @@
+﻿// NNUE評価関数の学習で用いる行列演算
+// BLASを使わない場合に、アフィン変換層の小さな行列積や入力特徴量変換器の行の更新をこれで計算する。
+// 行列の大きさはコンパイル時に決まるので、それに合わせてレジスタに載る大きさの区画に分けて計算する。
+
+#ifndef _NNUE_TRAINER_GEMM_H_
+#define _NNUE_TRAINER_GEMM_H_
+
+#include "../../../config.h"
+
+#if defined(EVAL_LEARN) && defined(EVAL_NNUE)
+
+#include "../nnue_common.h"
+#include "trainer_half_float.h"
+
+#include <algorithm>
+#include <type_traits>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+namespace Eval {
+
+namespace NNUE {
+
+namespace Gemm {
+
+// float用のSIMD演算
+// AVX-512/AVX2が使えない場合や、float以外の型ではスカラー演算を用いる。
+#if defined(USE_AVX2)
+struct SimdFloat256 {
+  using Vector = __m256;
+  static constexpr IndexType kWidth = 8;
+  static Vector Zero() { return _mm256_setzero_ps(); }
+  static Vector Set1(float value) { return _mm256_set1_ps(value); }
+  static Vector Load(const float* p) { return _mm256_loadu_ps(p); }
+  static void Store(float* p, Vector v) { _mm256_storeu_ps(p, v); }
+  static Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+  static Vector Mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+  static Vector MulAdd(Vector a, Vector b, Vector c) {
+    // AVX2が使えてもFMAが使えるとは限らない(-march=corei7-avxなど)
+#if defined(__FMA__) || defined(_MSC_VER)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+  }
+  static float Sum(Vector v) {
+    const __m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(v),
+                                     _mm256_extractf128_ps(v, 1));
+    const __m128 sum64 = _mm_add_ps(sum128, _mm_movehl_ps(sum128, sum128));
+    return _mm_cvtss_f32(_mm_add_ss(sum64, _mm_movehdup_ps(sum64)));
+  }
+};
+#endif
+
+#if defined(USE_AVX512)
+struct SimdFloat512 {
+  using Vector = __m512;
+  static constexpr IndexType kWidth = 16;
+  static Vector Zero() { return _mm512_setzero_ps(); }
+  static Vector Set1(float value) { return _mm512_set1_ps(value); }
+  static Vector Load(const float* p) { return _mm512_loadu_ps(p); }
+  static void Store(float* p, Vector v) { _mm512_storeu_ps(p, v); }
+  static Vector Add(Vector a, Vector b) { return _mm512_add_ps(a, b); }
+  static Vector Mul(Vector a, Vector b) { return _mm512_mul_ps(a, b); }
+  static Vector MulAdd(Vector a, Vector b, Vector c) {
+    return _mm512_fmadd_ps(a, b, c);
+  }
+  static float Sum(Vector v) { return _mm512_reduce_add_ps(v); }
+};
+#endif
+
+// 型TのSIMD演算
+template <typename T>
+struct Simd {
+  using Vector = T;
+  static constexpr IndexType kWidth = 1;
+  static Vector Zero() { return T(); }
+  static Vector Set1(T value) { return value; }
+  static Vector Load(const T* p) { return *p; }
+  static void Store(T* p, Vector v) { *p = v; }
+  static Vector Add(Vector a, Vector b) { return a + b; }
+  static Vector Mul(Vector a, Vector b) { return a * b; }
+  static Vector MulAdd(Vector a, Vector b, Vector c) { return a * b + c; }
+  static T Sum(Vector v) { return v; }
+};
+
+#if defined(USE_AVX512)
+template <>
+struct Simd<float> : SimdFloat512 {};
+#elif defined(USE_AVX2)
+template <>
+struct Simd<float> : SimdFloat256 {};
+#endif
+
+// 並列化したループの1スレッドあたりのサンプル数の目安
+constexpr IndexType kSamplesPerTask = 64;
+
+// y[b][i] = bias[i] + Σj w[i][j] * x[b][j]
+// wはkOutputs行kInputs列の行優先、x, yはサンプルごとに並べたもの。
+template <IndexType kOutputs, IndexType kInputs, typename T>
+void AffineForward(IndexType batch_size, const T* w, const T* bias,
+                   const T* x, T* y) {
+  using S = Simd<T>;
+  constexpr IndexType kVectorEnd = kInputs - kInputs % S::kWidth;
+  // 4サンプルずつ、重みを1回読むごとに4サンプル分の積和を計算する
+  constexpr IndexType kBlock = 4;
+  const IndexType num_blocks = (batch_size + kBlock - 1) / kBlock;
+#pragma omp parallel for schedule(static) if (batch_size >= 2 * kSamplesPerTask)
+  for (IndexType block = 0; block < num_blocks; ++block) {
+    const IndexType b0 = block * kBlock;
+    const IndexType rows = std::min(kBlock, batch_size - b0);
+    const T* xs[kBlock];
+    for (IndexType r = 0; r < kBlock; ++r) {
+      xs[r] = &x[kInputs * (b0 + std::min(r, rows - 1))];
+    }
+    T results[kBlock][kOutputs];
+    for (IndexType i = 0; i < kOutputs; ++i) {
+      const T* wi = &w[kInputs * i];
+      typename S::Vector sum[kBlock];
+      for (IndexType r = 0; r < kBlock; ++r) {
+        sum[r] = S::Zero();
+      }
+      for (IndexType j = 0; j < kVectorEnd; j += S::kWidth) {
+        const auto wv = S::Load(&wi[j]);
+        for (IndexType r = 0; r < kBlock; ++r) {
+          sum[r] = S::MulAdd(wv, S::Load(&xs[r][j]), sum[r]);
+        }
+      }
+      for (IndexType r = 0; r < kBlock; ++r) {
+        T result = bias[i] + S::Sum(sum[r]);
+        for (IndexType j = kVectorEnd; j < kInputs; ++j) {
+          result += wi[j] * xs[r][j];
+        }
+        results[r][i] = result;
+      }
+    }
+    for (IndexType r = 0; r < rows; ++r) {
+      std::copy(results[r], results[r] + kOutputs,
+                &y[kOutputs * (b0 + r)]);
+    }
+  }
+}
+
+// kSamples個のサンプルの、入力のj0要素目からkNumVectors本のベクトル分について
+// gx[b][j] = Σi w[i][j] * g[b][i] を計算する
+template <IndexType kOutputs, IndexType kInputs, IndexType kSamples,
+          IndexType kNumVectors, typename T>
+void AffineBackwardInputBlock(const T* w, const T* g, IndexType j0, T* gx) {
+  using S = Simd<T>;
+  typename S::Vector sum[kSamples][kNumVectors];
+  for (IndexType s = 0; s < kSamples; ++s) {
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      sum[s][v] = S::Zero();
+    }
+  }
+  for (IndexType i = 0; i < kOutputs; ++i) {
+    const T* wi = &w[kInputs * i + j0];
+    typename S::Vector wv[kNumVectors];
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      wv[v] = S::Load(&wi[S::kWidth * v]);
+    }
+    for (IndexType s = 0; s < kSamples; ++s) {
+      const auto gv = S::Set1(g[kOutputs * s + i]);
+      for (IndexType v = 0; v < kNumVectors; ++v) {
+        sum[s][v] = S::MulAdd(gv, wv[v], sum[s][v]);
+      }
+    }
+  }
+  for (IndexType s = 0; s < kSamples; ++s) {
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      S::Store(&gx[kInputs * s + j0 + S::kWidth * v], sum[s][v]);
+    }
+  }
+}
+
+// kSamples個のサンプルについてgx[b][j] = Σi w[i][j] * g[b][i]を計算する
+template <IndexType kOutputs, IndexType kInputs, IndexType kSamples,
+          typename T>
+void AffineBackwardInputSamples(const T* w, const T* g, T* gx) {
+  using S = Simd<T>;
+  // 入力をkChunk要素ずつに区切り、区切りごとの積和をレジスタに置いたまま出力について足し込む
+  constexpr IndexType kNumVectors = std::max<IndexType>(
+      1, std::min<IndexType>(8 / kSamples, kInputs / S::kWidth));
+  constexpr IndexType kChunk = kNumVectors * S::kWidth;
+  constexpr IndexType kChunkEnd = kInputs - kInputs % kChunk;
+  constexpr IndexType kVectorEnd = kInputs - kInputs % S::kWidth;
+  for (IndexType j0 = 0; j0 < kChunkEnd; j0 += kChunk) {
+    AffineBackwardInputBlock<kOutputs, kInputs, kSamples, kNumVectors>(
+        w, g, j0, gx);
+  }
+  for (IndexType j0 = kChunkEnd; j0 < kVectorEnd; j0 += S::kWidth) {
+    AffineBackwardInputBlock<kOutputs, kInputs, kSamples, 1>(w, g, j0, gx);
+  }
+  for (IndexType s = 0; s < kSamples; ++s) {
+    for (IndexType j = kVectorEnd; j < kInputs; ++j) {
+      T sum = T();
+      for (IndexType i = 0; i < kOutputs; ++i) {
+        sum += w[kInputs * i + j] * g[kOutputs * s + i];
+      }
+      gx[kInputs * s + j] = sum;
+    }
+  }
+}
+
+// gx[b][j] = Σi w[i][j] * g[b][i]
+template <IndexType kOutputs, IndexType kInputs, typename T>
+void AffineBackwardInput(IndexType batch_size, const T* w, const T* g,
+                         T* gx) {
+  // 2サンプルずつ、重みを1回読むごとに2サンプル分の積和を計算する
+  constexpr IndexType kBlock = 2;
+  const IndexType num_blocks = batch_size / kBlock;
+#pragma omp parallel for schedule(static) if (batch_size >= 2 * kSamplesPerTask)
+  for (IndexType block = 0; block < num_blocks; ++block) {
+    const IndexType b = kBlock * block;
+    AffineBackwardInputSamples<kOutputs, kInputs, kBlock>(
+        w, &g[kOutputs * b], &gx[kInputs * b]);
+  }
+  for (IndexType b = kBlock * num_blocks; b < batch_size; ++b) {
+    AffineBackwardInputSamples<kOutputs, kInputs, 1>(
+        w, &g[kOutputs * b], &gx[kInputs * b]);
+  }
+}
+
+// 重み行列の(kRows行, kColumns列)の区画について
+// dw[i][j] = beta * dw[i][j] + Σ(b_begin<=b<b_end) g[b][i] * x[b][j] を計算する
+template <IndexType kOutputs, IndexType kInputs, IndexType kRows,
+          IndexType kColumns, typename T>
+void AffineBackwardWeightsBlock(IndexType b_begin, IndexType b_end,
+                                const T* g, const T* x, T beta,
+                                IndexType i0, IndexType j0, T* dw) {
+  using S = Simd<T>;
+  constexpr IndexType kNumVectors = kColumns / S::kWidth;
+  static_assert(kColumns % S::kWidth == 0, "");
+  typename S::Vector sum[kRows][kNumVectors];
+  for (IndexType r = 0; r < kRows; ++r) {
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      sum[r][v] = S::Zero();
+    }
+  }
+  for (IndexType b = b_begin; b < b_end; ++b) {
+    typename S::Vector xv[kNumVectors];
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      xv[v] = S::Load(&x[kInputs * b + j0 + S::kWidth * v]);
+    }
+    for (IndexType r = 0; r < kRows; ++r) {
+      const auto gv = S::Set1(g[kOutputs * b + i0 + r]);
+      for (IndexType v = 0; v < kNumVectors; ++v) {
+        sum[r][v] = S::MulAdd(gv, xv[v], sum[r][v]);
+      }
+    }
+  }
+  const auto beta_vector = S::Set1(beta);
+  for (IndexType r = 0; r < kRows; ++r) {
+    T* dwi = &dw[kInputs * (i0 + r) + j0];
+    for (IndexType v = 0; v < kNumVectors; ++v) {
+      T* p = &dwi[S::kWidth * v];
+      S::Store(p, S::MulAdd(beta_vector, S::Load(p), sum[r][v]));
+    }
+  }
+}
+
+// dw[i][j] = beta * dw[i][j] + Σb g[b][i] * x[b][j]
+// db[i] = beta * db[i] + Σb g[b][i]
+template <IndexType kOutputs, IndexType kInputs, typename T>
+void AffineBackwardWeights(IndexType batch_size, const T* g, const T* x,
+                           T beta, T* dw, T* db) {
+  using S = Simd<T>;
+  // 重み行列をkRows行, kColumns列の区画に分け、区画ごとにスレッドに割り振る
+  constexpr IndexType kRows = std::min<IndexType>(4, kOutputs);
+  constexpr IndexType kColumns = std::min<IndexType>(
+      2 * S::kWidth, kInputs - kInputs % S::kWidth);
+  constexpr IndexType kRowEnd = kOutputs - kOutputs % kRows;
+  constexpr IndexType kColumnEnd =
+      kColumns == 0 ? 0 : kInputs - kInputs % kColumns;
+  constexpr IndexType kNumRowBlocks = kRowEnd / kRows;
+  constexpr IndexType kNumColumnBlocks =
+      kColumns == 0 ? 0 : kColumnEnd / kColumns;
+  constexpr IndexType kNumBlocks = kNumRowBlocks * kNumColumnBlocks;
+  if constexpr (kNumBlocks > 0) {
+    // サンプルをkSamplesPerChunk個ずつに区切り、区切りごとに全区画を処理することで、
+    // 入力をキャッシュに載せたまま使い回す。
+    // 各スレッドが担当する区画は区切りによらず同じなので、区切りごとに同期する必要はない。
+    constexpr IndexType kSamplesPerChunk = 32;
+#pragma omp parallel if (batch_size >= 2 * kSamplesPerTask)
+    for (IndexType b0 = 0; b0 < batch_size; b0 += kSamplesPerChunk) {
+      const IndexType b1 = std::min(batch_size, b0 + kSamplesPerChunk);
+      const T chunk_beta = b0 == 0 ? beta : static_cast<T>(1.0);
+#pragma omp for schedule(static) nowait
+      for (IndexType block = 0; block < kNumBlocks; ++block) {
+        // 同じ列の区画が続けて処理されるようにする
+        const IndexType i0 = kRows * (block % kNumRowBlocks);
+        const IndexType j0 = kColumns * (block / kNumRowBlocks);
+        AffineBackwardWeightsBlock<kOutputs, kInputs, kRows, kColumns>(
+            b0, b1, g, x, chunk_beta, i0, j0, dw);
+      }
+    }
+  }
+
+  // 区画に収まらなかった端の部分
+  for (IndexType i = 0; i < kOutputs; ++i) {
+    const IndexType j_begin = i < kRowEnd ? kColumnEnd : 0;
+    for (IndexType j = j_begin; j < kInputs; ++j) {
+      T sum = T();
+      for (IndexType b = 0; b < batch_size; ++b) {
+        sum += g[kOutputs * b + i] * x[kInputs * b + j];
+      }
+      dw[kInputs * i + j] = beta * dw[kInputs * i + j] + sum;
+    }
+  }
+
+  for (IndexType i = 0; i < kOutputs; ++i) {
+    db[i] *= beta;
+  }
+  for (IndexType b = 0; b < batch_size; ++b) {
+    for (IndexType i = 0; i < kOutputs; ++i) {
+      db[i] += g[kOutputs * b + i];
+    }
+  }
+}
+
+// y += alpha * x
+template <typename T>
+void Axpy(IndexType size, T alpha, const T* x, T* y) {
+  using S = Simd<T>;
+  const IndexType vector_end = size - size % S::kWidth;
+  const auto alpha_vector = S::Set1(alpha);
+  for (IndexType i = 0; i < vector_end; i += S::kWidth) {
+    S::Store(&y[i], S::MulAdd(alpha_vector, S::Load(&x[i]), S::Load(&y[i])));
+  }
+  for (IndexType i = vector_end; i < size; ++i) {
+    y[i] += alpha * x[i];
+  }
+}
+
+// x *= alpha
+template <typename T>
+void Scale(IndexType size, T alpha, T* x) {
+  using S = Simd<T>;
+  const IndexType vector_end = size - size % S::kWidth;
+  const auto alpha_vector = S::Set1(alpha);
+  for (IndexType i = 0; i < vector_end; i += S::kWidth) {
+    S::Store(&x[i], S::Mul(alpha_vector, S::Load(&x[i])));
+  }
+  for (IndexType i = vector_end; i < size; ++i) {
+    x[i] *= alpha;
+  }
+}
+
+// y += alpha * x (xは16bitの浮動小数)
+template <typename T, typename W,
+          std::enable_if_t<IsHalfFloat<W>::value, int> = 0>
+void Axpy(IndexType size, T alpha, const W* x, T* y) {
+  PrefetchRow(x, size);
+  IndexType i = 0;
+#if defined(USE_AVX2)
+  if constexpr (std::is_same<T, float>::value && W::kVectorized) {
+    using S = SimdFloat256;
+    const auto alpha_vector = S::Set1(alpha);
+    for (; i + 2 * S::kWidth <= size; i += 2 * S::kWidth) {
+      __m256 lo, hi;
+      LoadHalfFloat16(&x[i], &lo, &hi);
+      S::Store(&y[i], S::MulAdd(alpha_vector, lo, S::Load(&y[i])));
+      S::Store(&y[i + S::kWidth],
+               S::MulAdd(alpha_vector, hi, S::Load(&y[i + S::kWidth])));
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    y[i] += alpha * WeightToFloat(x[i]);
+  }
+}
+
+// y += alpha * x (yは16bitの浮動小数。確率的に丸める)
+template <typename T, typename W,
+          std::enable_if_t<IsHalfFloat<W>::value, int> = 0>
+void Axpy(IndexType size, T alpha, const T* x, W* y) {
+  PrefetchRow(y, size);
+  auto& noise = RoundingNoise::Get();
+  IndexType i = 0;
+#if defined(USE_AVX2)
+  if constexpr (std::is_same<T, float>::value && W::kVectorized) {
+    using S = SimdFloat256;
+    const auto alpha_vector = S::Set1(alpha);
+    auto counters = noise.LoadCounters();
+    for (; i + 2 * S::kWidth <= size; i += 2 * S::kWidth) {
+      __m256 lo, hi;
+      LoadHalfFloat16(&y[i], &lo, &hi);
+      StoreHalfFloat16(
+          &y[i], S::MulAdd(alpha_vector, S::Load(&x[i]), lo),
+          S::MulAdd(alpha_vector, S::Load(&x[i + S::kWidth]), hi),
+          RoundingNoise::Next(&counters));
+    }
+    noise.StoreCounters(counters);
+  }
+#endif
+  for (; i < size; ++i) {
+    y[i] = W::FromFloat(
+        static_cast<float>(WeightToFloat(y[i]) + alpha * x[i]),
+        noise.Next(W::kDroppedBits));
+  }
+}
+
+// x *= alpha (xは16bitの浮動小数。確率的に丸める)
+template <typename T, typename W,
+          std::enable_if_t<IsHalfFloat<W>::value, int> = 0>
+void Scale(IndexType size, T alpha, W* x) {
+  PrefetchRow(x, size);
+  auto& noise = RoundingNoise::Get();
+  IndexType i = 0;
+#if defined(USE_AVX2)
+  if constexpr (std::is_same<T, float>::value && W::kVectorized) {
+    using S = SimdFloat256;
+    const auto alpha_vector = S::Set1(alpha);
+    auto counters = noise.LoadCounters();
+    for (; i + 2 * S::kWidth <= size; i += 2 * S::kWidth) {
+      __m256 lo, hi;
+      LoadHalfFloat16(&x[i], &lo, &hi);
+      StoreHalfFloat16(&x[i], S::Mul(alpha_vector, lo),
+                       S::Mul(alpha_vector, hi),
+                       RoundingNoise::Next(&counters));
+    }
+    noise.StoreCounters(counters);
+  }
+#endif
+  for (; i < size; ++i) {
+    x[i] = W::FromFloat(static_cast<float>(alpha * WeightToFloat(x[i])),
+                        noise.Next(W::kDroppedBits));
+  }
+}
+
+}  // namespace Gemm
+
+}  // namespace NNUE
+
+}  // namespace Eval
+
+#endif  // defined(EVAL_LEARN) && defined(EVAL_NNUE)
+
+#endif
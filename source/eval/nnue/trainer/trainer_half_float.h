@@ -0,0 +1,286 @@
+﻿// NNUE評価関数の学習で重み行列を保持する16bitの浮動小数
+// 計算はfloatで行い、書き戻すときに確率的に丸めることで、丸め誤差より小さい更新が失われないようにする。
+
+#ifndef _NNUE_TRAINER_HALF_FLOAT_H_
+#define _NNUE_TRAINER_HALF_FLOAT_H_
+
+#include "../../../config.h"
+
+#if defined(EVAL_LEARN) && defined(EVAL_NNUE)
+
+#include "../../../learn/learn.h"
+#include "../nnue_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(NNUE_TRAINER_BF16_WEIGHTS) || defined(NNUE_TRAINER_FP16_WEIGHTS)
+#define NNUE_TRAINER_HALF_FLOAT_WEIGHTS
+#endif
+
+namespace Eval {
+
+namespace NNUE {
+
+// bfloat16 (floatの上位16bit)
+// 指数部がfloatと同じなので値の範囲を気にする必要がなく、変換も速い。
+struct BFloat16 {
+  // floatから変換するときに切り捨てる下位ビットの数
+  static constexpr int kDroppedBits = 16;
+
+  // AVX2で8個まとめて変換できるか
+#if defined(USE_AVX2)
+  static constexpr bool kVectorized = true;
+#else
+  static constexpr bool kVectorized = false;
+#endif
+
+  // floatに変換する
+  float ToFloat() const {
+    const std::uint32_t n = static_cast<std::uint32_t>(bits) << 16;
+    float f;
+    std::memcpy(&f, &n, sizeof(f));
+    return f;
+  }
+
+  // floatから変換する
+  // noiseは切り捨てる下位kDroppedBitsビットに足してから切り捨てる値
+  static BFloat16 FromFloat(float value, std::uint32_t noise) {
+    std::uint32_t n;
+    std::memcpy(&n, &value, sizeof(n));
+    BFloat16 result;
+    result.bits = static_cast<std::uint16_t>((n + noise) >> 16);
+    return result;
+  }
+
+  std::uint16_t bits;
+};
+
+// IEEE 754の半精度浮動小数
+// 仮数部がbfloat16より3bit長いが、絶対値が6.1e-5未満では精度が落ち、65504を超える値は表せない。
+// 重みは絶対値がkMaxWeightMagnitude以下に抑えられているので、後者は問題にならない。
+struct Float16 {
+  static constexpr int kDroppedBits = 13;
+
+  // F16C命令が使えないと変換が遅くなる(-mf16cを指定していない場合など)
+#if defined(USE_AVX2) && defined(__F16C__)
+  static constexpr bool kVectorized = true;
+#else
+  static constexpr bool kVectorized = false;
+#endif
+
+  float ToFloat() const {
+    const std::uint32_t sign = static_cast<std::uint32_t>(bits & 0x8000) << 16;
+    const std::uint32_t exponent = (bits >> 10) & 0x1f;
+    const std::uint32_t fraction = bits & 0x3ff;
+    if (exponent == 0) {
+      // ゼロと非正規化数
+      const float magnitude = fraction * (1.0f / (1 << 24));
+      return sign ? -magnitude : magnitude;
+    }
+    std::uint32_t n;
+    if (exponent == 0x1f) {
+      // 無限大とNaN
+      n = sign | 0x7f800000 | (fraction << 13);
+    } else {
+      n = sign | ((exponent - 15 + 127) << 23) | (fraction << 13);
+    }
+    float f;
+    std::memcpy(&f, &n, sizeof(f));
+    return f;
+  }
+
+  // 非正規化数になる範囲では、noiseより多くのビットを切り捨てるので0に近い方へ偏る。
+  // F16C命令で0方向に丸めた場合と同じ結果になる。
+  static Float16 FromFloat(float value, std::uint32_t noise) {
+    std::uint32_t n;
+    std::memcpy(&n, &value, sizeof(n));
+    const std::uint16_t sign = (n >> 16) & 0x8000;
+    const std::uint32_t magnitude = (n & 0x7fffffff) + noise;
+    const int exponent = static_cast<int>(magnitude >> 23) - 127 + 15;
+    std::uint16_t bits;
+    if (exponent >= 0x1f) {
+      // 表せる最大の値に飽和させる
+      bits = 0x7bff;
+    } else if (exponent >= 1) {
+      bits = static_cast<std::uint16_t>(
+          (exponent << 10) | ((magnitude >> 13) & 0x3ff));
+    } else if (exponent >= -10) {
+      const std::uint32_t fraction = (magnitude & 0x7fffff) | 0x800000;
+      bits = static_cast<std::uint16_t>(fraction >> (14 - exponent));
+    } else {
+      bits = 0;
+    }
+    Float16 result;
+    result.bits = sign | bits;
+    return result;
+  }
+
+  std::uint16_t bits;
+};
+
+// 16bitの浮動小数か
+template <typename T>
+struct IsHalfFloat : std::false_type {};
+template <>
+struct IsHalfFloat<BFloat16> : std::true_type {};
+template <>
+struct IsHalfFloat<Float16> : std::true_type {};
+
+// 入力特徴量変換器の重み行列を保持する型
+#if defined(NNUE_TRAINER_BF16_WEIGHTS)
+using LearnWeightType = BFloat16;
+#elif defined(NNUE_TRAINER_FP16_WEIGHTS)
+using LearnWeightType = Float16;
+#else
+using LearnWeightType = LearnFloatType;
+#endif
+
+// 重みをLearnFloatTypeに変換する
+inline LearnFloatType WeightToFloat(LearnFloatType weight) { return weight; }
+template <typename WeightType,
+          std::enable_if_t<IsHalfFloat<WeightType>::value, int> = 0>
+LearnFloatType WeightToFloat(WeightType weight) {
+  return static_cast<LearnFloatType>(weight.ToFloat());
+}
+
+// LearnFloatTypeを重みに変換する
+// 確率的には丸めず、最も近い値にする。
+template <typename WeightType>
+WeightType FloatToWeight(LearnFloatType value) {
+  if constexpr (IsHalfFloat<WeightType>::value) {
+    return WeightType::FromFloat(static_cast<float>(value),
+                                 1u << (WeightType::kDroppedBits - 1));
+  } else {
+    return static_cast<WeightType>(value);
+  }
+}
+
+// 確率的丸めに用いる乱数
+// スレッドごとのカウンタをハッシュ関数で乱数にする。
+// 前の乱数に依存せずに計算できるので、AVX2で8個まとめて生成しても待ちが生じない。
+class RoundingNoise {
+ public:
+  // 呼び出したスレッドの乱数
+  static RoundingNoise& Get() {
+    thread_local RoundingNoise noise;
+    return noise;
+  }
+
+  // 下位bitsビットの乱数を返す
+  std::uint32_t Next(int bits) {
+    return Hash(counter_++) >> (32 - bits);
+  }
+
+#if defined(USE_AVX2)
+  // 8個まとめて生成するためのカウンタ
+  // 読み書きは呼び出し側で行い、ループの間レジスタに置いたままにする。
+  __m256i LoadCounters() const {
+    return _mm256_add_epi32(_mm256_set1_epi32(counter_),
+                            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  }
+  void StoreCounters(__m256i counters) {
+    counter_ = static_cast<std::uint32_t>(_mm256_cvtsi256_si32(counters));
+  }
+
+  // 32bitの乱数を8個まとめて返す
+  // 丸めに使うには十分なので、Hash()の乗算を1回に減らして速くしている。
+  static __m256i Next(__m256i* counters) {
+    __m256i x = *counters;
+    *counters = _mm256_add_epi32(x, _mm256_set1_epi32(8));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    return x;
+  }
+#endif
+
+ private:
+  // スレッドごとに離れた位置からカウンタを始める
+  RoundingNoise() {
+    static std::atomic<std::uint32_t> num_instances(0);
+    counter_ = Hash(++num_instances) * 0x10000;
+  }
+
+  // 32bitの整数のハッシュ関数(lowbias32)
+  static std::uint32_t Hash(std::uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
+
+  std::uint32_t counter_;
+};
+
+#if defined(USE_AVX2)
+// 16bitの浮動小数16個の読み書き
+// 32bitの乱数noiseの上位ビットを前半8個、下位ビットを後半8個を丸めるのに使う。
+inline void LoadHalfFloat16(const BFloat16* p, __m256* lo, __m256* hi) {
+  const __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  *lo = _mm256_castsi256_ps(_mm256_slli_epi32(
+      _mm256_cvtepu16_epi32(_mm256_castsi256_si128(bits)), 16));
+  *hi = _mm256_castsi256_ps(_mm256_slli_epi32(
+      _mm256_cvtepu16_epi32(_mm256_extracti128_si256(bits, 1)), 16));
+}
+inline void StoreHalfFloat16(BFloat16* p, __m256 lo, __m256 hi,
+                             __m256i noise) {
+  const __m256i lo_bits = _mm256_srli_epi32(_mm256_add_epi32(
+      _mm256_castps_si256(lo), _mm256_srli_epi32(noise, 16)), 16);
+  const __m256i hi_bits = _mm256_srli_epi32(_mm256_add_epi32(
+      _mm256_castps_si256(hi),
+      _mm256_and_si256(noise, _mm256_set1_epi32(0xffff))), 16);
+  // packusは128bitごとに詰めるので、64bit単位で並べ替える
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p),
+                      _mm256_permute4x64_epi64(
+                          _mm256_packus_epi32(lo_bits, hi_bits), 0b11011000));
+}
+
+#if defined(__F16C__)
+inline void LoadHalfFloat16(const Float16* p, __m256* lo, __m256* hi) {
+  const __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  *lo = _mm256_cvtph_ps(_mm256_castsi256_si128(bits));
+  *hi = _mm256_cvtph_ps(_mm256_extracti128_si256(bits, 1));
+}
+inline void StoreHalfFloat16(Float16* p, __m256 lo, __m256 hi,
+                             __m256i noise) {
+  const __m256 lo_value = _mm256_castsi256_ps(_mm256_add_epi32(
+      _mm256_castps_si256(lo), _mm256_srli_epi32(noise, 32 - 13)));
+  const __m256 hi_value = _mm256_castsi256_ps(_mm256_add_epi32(
+      _mm256_castps_si256(hi),
+      _mm256_and_si256(noise, _mm256_set1_epi32((1 << 13) - 1))));
+  constexpr int kRounding = _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC;
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(p),
+                      _mm256_set_m128i(_mm256_cvtps_ph(hi_value, kRounding),
+                                       _mm256_cvtps_ph(lo_value, kRounding)));
+}
+#endif
+#endif
+
+// 配列の読み書きに先立って、キャッシュに読み込んでおく
+// 1行のキャッシュミスを並行して待つようにする。
+template <typename T>
+void PrefetchRow(const T* p, IndexType size) {
+#if defined(USE_SSE2) && !defined(NO_PREFETCH)
+  const char* begin = reinterpret_cast<const char*>(p);
+  const char* end = reinterpret_cast<const char*>(p + size);
+  for (const char* line = begin; line < end; line += kCacheLineSize) {
+    _mm_prefetch(line, _MM_HINT_T0);
+  }
+#else
+  (void)p;
+  (void)size;
+#endif
+}
+
+}  // namespace NNUE
+
+}  // namespace Eval
+
+#endif  // defined(EVAL_LEARN) && defined(EVAL_NNUE)
+
+#endif
@@ -57,7 +57,7 @@ class SharedInputTrainer {
   }
 
   // 順伝播
-  const LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  const LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (gradients_.size() < kInputDimensions * batch.size()) {
       gradients_.resize(kInputDimensions * batch.size());
     }
@@ -179,7 +179,7 @@ class Trainer<Layers::InputSlice<OutputDimensions, Offset>> {
   }
 
   // 順伝播
-  const LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  const LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (output_.size() < kOutputDimensions * batch.size()) {
       output_.resize(kOutputDimensions * batch.size());
       gradients_.resize(kInputDimensions * batch.size());
@@ -49,7 +49,7 @@ class Trainer<Layers::Sum<FirstPreviousLayer, RemainingPreviousLayers...>> :
   }
 
   // 順伝播
-  /*const*/ LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  /*const*/ LearnFloatType* Propagate(const ExampleBatch& batch) {
     batch_size_ = static_cast<IndexType>(batch.size());
     auto output = Tail::Propagate(batch);
     const auto head_output = previous_layer_trainer_->Propagate(batch);
@@ -129,7 +129,7 @@ class Trainer<Layers::Sum<PreviousLayer>> {
   }
 
   // 順伝播
-  /*const*/ LearnFloatType* Propagate(const std::vector<Example>& batch) {
+  /*const*/ LearnFloatType* Propagate(const ExampleBatch& batch) {
     if (output_.size() < kOutputDimensions * batch.size()) {
       output_.resize(kOutputDimensions * batch.size());
     }
@@ -10,6 +10,7 @@
 #include <sstream>
 #include <unordered_set>
 #include <iomanip>		// std::setprecision()
+#include <cstring>		// std::memcmp()
 
 using namespace std;
 using std::cout;
@@ -159,6 +160,8 @@ namespace Book
 		bool book_sort = token == "sort";
 		// 定跡の変換
 		bool convert_from_apery = token == "convert_from_apery";
+		// バイナリ定跡への変換
+		bool convert_to_binary = token == "convert_to_binary";
 		
 		// 評価関数を読み込まないとPositionのset()が出来ないのでis_ready()の呼び出しが必要。
 		// ただし、このときに定跡ファイルを読み込まれると読み込みに時間がかかって嫌なので一時的にno_bookに変更しておく。
@@ -694,6 +697,16 @@ namespace Book
 
 			book.write_book(book_dst);
 		}
+		else if (convert_to_binary) {
+			MemoryBook book;
+			string book_src, book_dst;
+			is >> book_src >> book_dst;
+			cout << "convert book from " << book_src << " , write binary book to " << book_dst << endl;
+			if (book.read_book(book_src).is_not_ok())
+				return;
+
+			book.write_binary_book(book_dst);
+		}
 		else {
 			cout << "usage" << endl;
 			cout << "> makebook from_sfen book.sfen book.db moves 24" << endl;
@@ -701,6 +714,7 @@ namespace Book
 			cout << "> makebook merge book_src1.db book_src2.db book_merged.db" << endl;
 			cout << "> makebook sort book_src.db book_sorted.db" << endl;
 			cout << "> makebook convert_from_apery book_src.bin book_converted.db" << endl;
+			cout << "> makebook convert_to_binary book_src.db book_binary.db" << endl;
 			cout << "> makebook build_tree book2019.db user_book1.db" << endl;
 		}
 	}
@@ -714,11 +728,155 @@ namespace Book
 	static std::unique_ptr<AperyBook> apery_book;
 	static const constexpr char* kAperyBookName = "book.bin";
 
+	// ファイル先頭がkBinaryBookMagicであるか。(バイナリ定跡であるか)
+	static bool is_binary_book(const std::string& filename)
+	{
+		char magic[sizeof(BinaryBookHeader::magic)] = {};
+		ifstream ifs(filename, ios::in | ios::binary);
+		ifs.read(magic, sizeof(magic));
+		return !ifs.fail() && std::memcmp(magic, kBinaryBookMagic, sizeof(magic)) == 0;
+	}
+
 	std::string MemoryBook::trim(std::string input)
 	{
 		return Options["IgnoreBookPly"] ? StringExtension::trim_number(input) : StringExtension::trim(input);
 	}
 
+	// 採択回数でsortして、採択確率を計算する。
+	static void calc_book_prob(PosMoveList& move_list)
+	{
+		std::stable_sort(move_list.begin(), move_list.end());
+
+		// 出現率の正規化
+		u64 num_sum = 0;
+		for (auto& it : move_list)
+			num_sum += it.num;
+		num_sum = std::max(num_sum, UINT64_C(1)); // ゼロ除算対策
+		for (auto& it : move_list)
+			it.prob = float(it.num) / num_sum;
+	}
+
+	// 定跡ファイル(テキスト)の中で、offset以降で最初に"sfen "で始まる行の先頭の位置を返す。
+	// 見つからなければsizeを返す。read_book()でファイルをchunkに分割するときに用いる。
+	static u64 find_book_chunk_boundary(const char* data, u64 size, u64 offset)
+	{
+		for (u64 i = offset; i + 5 <= size; ++i)
+		{
+			if (std::memcmp(data + i, "sfen ", 5) != 0)
+				continue;
+
+			if (i == 0 || data[i - 1] == '\n' || data[i - 1] == '\r')
+				return i;
+		}
+		return size;
+	}
+
+	// 定跡ファイル(テキスト)の[begin,end)の範囲を読み込んでbookに格納する。
+	// ・範囲は"sfen "で始まる行の先頭で区切られていること。
+	// ・read_book()から並列に呼び出されるので、Options["IgnoreBookPly"]の値は引数で受け取る。
+	// ・read_bytesには読み込みの済んだバイト数を加算していく。(進捗表示用)
+	static void read_book_chunk(const char* begin, const char* end, bool ignoreBookPly, BookType& book, std::atomic<u64>& read_bytes)
+	{
+		string sfen;
+		// 現在読み込み中の局面の指し手。指し手が一つもないうちはnullptr。
+		PosMoveListPtr move_list;
+
+		// 手数違いの重複エントリーは、手数の一番若いほうだけをMemoryBook::write_book()で書き出すようにしたので、
+		// ここではケアしない。
+
+		auto calc_prob = [&] {
+			// ひとつ前のsfen文字列に対応するものが終わったということなので採択確率を計算して、かつ、採択回数でsortしておく
+			// (sortはされてるはずだが他のソフトで生成した定跡DBではそうとも限らないので)。
+			if (move_list)
+				calc_book_prob(*move_list);
+		};
+
+		const u64 kReportBytes = 64 * 1024 * 1024;
+		const char* last_report = begin;
+
+		std::string line;
+		for (const char* p = begin; p < end; )
+		{
+			// 一行切り出す。"\r","\n","\r\n"をすべて1つの改行コードとみなす。(TextFileReaderと同じ)
+			const char* line_end = p;
+			while (line_end < end && *line_end != '\n' && *line_end != '\r')
+				++line_end;
+			line.assign(p, line_end);
+
+			p = line_end;
+			if (p < end && *p == '\r')
+				++p;
+			if (p < end && *p == '\n')
+				++p;
+
+			if ((u64)(p - last_report) >= kReportBytes)
+			{
+				read_bytes += (u64)(p - last_report);
+				last_report = p;
+			}
+
+			// 末尾のスペース、タブを除去する。空行はskip。
+			while (line.size() > 0 && (line.back() == ' ' || line.back() == '\t'))
+				line.pop_back();
+			if (line.size() == 0)
+				continue;
+
+			// バージョン識別文字列(とりあえず読み飛ばす)
+			if (line[0] == '#')
+				continue;
+
+			// コメント行(とりあえず読み飛ばす)
+			if (line.length() >= 2 && line.compare(0, 2, "//") == 0)
+				continue;
+
+			// "sfen "で始まる行は局面のデータであり、sfen文字列が格納されている。
+			if (line.length() >= 5 && line.compare(0, 5, "sfen ") == 0)
+			{
+				calc_prob();
+
+				// 5文字目から末尾までをくり抜く。
+				// 末尾のゴミは除去されているので、Options["IgnoreBookPly"] == trueのときは、手数(数字)を除去。
+				sfen = line.substr(5);
+				if (ignoreBookPly)
+					StringExtension::trim_number_inplace(sfen); // 末尾の数字除去
+
+				move_list = nullptr;
+				continue;
+			}
+
+			// 局面が始まる前の指し手は無視する。
+			if (sfen.size() == 0)
+				continue;
+
+			// value以降は、元データに欠落してるかもですよ。
+			// istringstream、げろげろ遅いので、自前でparseする。
+			LineScanner scanner(line);
+			string bestMove = scanner.get_text();
+			string nextMove = scanner.get_text();
+			int value = (int)scanner.get_number(0);
+			int depth = (int)scanner.get_number(0);
+			uint64_t num = (uint64_t)scanner.get_number(1);
+
+			// 起動時なので変換に要するオーバーヘッドは最小化したいので合法かのチェックはしない。
+			Move16 best = (bestMove == "none" || bestMove == "resign") ? Move16(MOVE_NONE) : USI::to_move16(bestMove);
+			Move16 next = (nextMove == "none" || nextMove == "resign") ? Move16(MOVE_NONE) : USI::to_move16(nextMove);
+
+			// 局面の最初の指し手のときだけbookを引く。
+			if (!move_list)
+			{
+				auto& ptr = book[sfen];
+				if (!ptr)
+					ptr = PosMoveListPtr(new PosMoveList);
+				move_list = ptr;
+			}
+			insert_book_pos(move_list, BookPos(best, next, value, depth, num));
+		}
+		// ファイルが終わるときにも最後の局面に対するcalc_probが必要。
+		calc_prob();
+
+		read_bytes += (u64)(end - last_report);
+	}
+
 	// 定跡ファイルの読み込み(book.db)など。
 	Tools::Result MemoryBook::read_book(const std::string& filename, bool on_the_fly_)
 	{
@@ -740,6 +898,7 @@ namespace Book
 
 		// 別のファイルを開こうとしているので前回メモリに丸読みした定跡をクリアしておかないといけない。
 		book_body.clear();
+		binary_book.Close();
 		this->on_the_fly = false;
 		this->ignoreBookPly = ignore_book_ply_;
 
@@ -763,6 +922,22 @@ namespace Book
 		else {
 			// やねうら王定跡データベースを読み込む
 
+			// バイナリ定跡であれば、メモリにmapするだけで読み込んだことにする。
+			// (on_the_flyであるかどうかは関係ない)
+			if (is_binary_book(filename))
+			{
+				auto result = read_binary_book(filename);
+				if (result.is_not_ok())
+				{
+					sync_cout << "info string Error! : can't read binary book : " + filename << sync_endl;
+					return result;
+				}
+
+				this->book_name = filename;
+				this->pure_book_name = pure_filename;
+				return Tools::Result::Ok();
+			}
+
 			// ファイルだけオープンして読み込んだことにする。
 			if (on_the_fly_)
 			{
@@ -785,160 +960,117 @@ namespace Book
 
 			sync_cout << "info string read book file : " << filename << sync_endl;
 
-			TextFileReader reader;
-			// ReadLine()の時に行の末尾のスペース、タブを自動トリム。空行は自動スキップ。
-			reader.SetTrim(true);
-			reader.SkipEmptyLine(true);
+			// ファイルをメモリにmapして、"sfen "で始まる行の先頭で区切ったchunkごとにスレッドを割り当てて並列に読み込む。
+			// 空のファイルなどmapできなかった場合は、メモリに丸読みしたものを同じように読み込む。
+			MemoryMappedFile mapped_file;
+			std::vector<char> buffer;
+			const char* data;
+			u64 size;
 
-			auto result = reader.Open(filename);
-			if (result.is_not_ok())
+			auto result = mapped_file.Open(filename, true);
+			if (result.code == Tools::ResultCode::FileOpenError)
 			{
 				sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
-				//      exit(EXIT_FAILURE);
 				return result; // 読み込み失敗
 			}
 
-			string sfen;
-
-			// 手数違いの重複エントリーは、手数の一番若いほうだけをMemoryBook::write_book()で書き出すようにしたので、
-			// 以下のコードは不要(のはず)
-#if 0
-			// 一つ前のsfen文字列と、同一sfenエントリー内の手数の最小値
-			string last_sfen;
-			int last_sfen_ply = 0;
-			bool ignore_book_ply = Options["IgnoreBookPly"];
-#endif
-
-			auto calc_prob = [&] {
-				// 空のsfen文字列(既存のエントリーすなわち重複エントリー)であるならこの計算を行わない。
-				if (sfen.size()==0)
-					return;
-
-				auto& move_list = *book_body[sfen];
-				std::stable_sort(move_list.begin(), move_list.end());
+			if (result.is_ok())
+			{
+				data = (const char*)mapped_file.data();
+				size = mapped_file.size();
+			}
+			else {
+				// 空のファイルでもnullptrが返らないように1バイト余分に確保しておく。
+				result = FileOperator::ReadFileToMemory(filename, [&](u64 file_size) {
+					buffer.resize((size_t)file_size + 1);
+					return (void*)buffer.data();
+				});
+				if (result.is_not_ok())
+				{
+					sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
+					return result; // 読み込み失敗
+				}
+				data = buffer.data();
+				size = buffer.size() - 1;
+			}
 
-				// 出現率の正規化
+			// 小さなファイルはスレッドを立てるほうが遅いので、1スレッドあたり最低でもkMinChunkSizeは読ませる。
+			const u64 kMinChunkSize = 1024 * 1024;
+			const size_t thread_num = (size_t)std::max(UINT64_C(1), std::min((u64)(size_t)Options["Threads"], size / kMinChunkSize));
 
-				u64 num_sum = 0;
-				for (auto& it : move_list)
-					num_sum += it.num;
-				num_sum = std::max(num_sum, UINT64_C(1)); // ゼロ除算対策
-				for (auto& it : move_list)
-					it.prob = float(it.num) / num_sum;
-				num_sum = 0;
-			};
+			// chunkの境界。chunk[i]は[boundaries[i], boundaries[i + 1])の範囲。
+			std::vector<u64> boundaries;
+			boundaries.push_back(0);
+			for (size_t i = 1; i < thread_num; ++i)
+				boundaries.push_back(std::max(boundaries.back(), find_book_chunk_boundary(data, size, size * i / thread_num)));
+			boundaries.push_back(size);
 
 			// 定跡に登録されている手数を無視するのか？
 			// (これがtrueならばsfenから手数を除去しておく)
 			bool ignoreBookPly = Options["IgnoreBookPly"];
 
-			std::string line;
-			while(reader.ReadLine(line).is_ok())
-			{
-
-				// バージョン識別文字列(とりあえず読み飛ばす)
-				if (line.length() >= 1 && line[0] == '#')
-					continue;
-
-				// コメント行(とりあえず読み飛ばす)
-				if (line.length() >= 2 && line.substr(0, 2) == "//")
-					continue;
-
-				// "sfen "で始まる行は局面のデータであり、sfen文字列が格納されている。
-				if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
-				{
-					// ひとつ前のsfen文字列に対応するものが終わったということなので採択確率を計算して、かつ、採択回数でsortしておく
-					// (sortはされてるはずだが他のソフトで生成した定跡DBではそうとも限らないので)。
-					calc_prob();
-
-					// 5文字目から末尾までをくり抜く。
-					// 末尾のゴミは除去されているはずなので、Options["IgnoreBookPly"] == trueのときは、手数(数字)を除去。
-
-					sfen = line.substr(5); // 新しいsfen文字列を"sfen "を除去して格納
-					if (ignoreBookPly)
-						StringExtension::trim_number_inplace(sfen); // 末尾の数字除去
-
-#if 0
-					if (ignore_book_ply)
-					{
-						int ply = StringExtension::to_int(StringExtension::mid(line, sfen.length() + 5), 0);
+			std::vector<BookType> books(thread_num);
+			std::atomic<u64> read_bytes(0);
+			std::atomic<size_t> finished_thread_num(0);
+			std::vector<std::thread> threads;
+			TimePoint start_time = now();
 
-						// Options["IgnoreBookPly"] == trueのときに手数違いの重複エントリーがある場合がある。
-						// すでに見つけたentryなら、このentryに対して一切の操作を行わない。
-						// 若い手数のほうの局面情報を優先すべき。
-						// ※　定跡DBはsfen文字列順にソートされているので、手数違いのエントリーは連続していると仮定できる。
+			for (size_t idx = 0; idx < thread_num; ++idx)
+			{
+				threads.push_back(std::thread([&, idx]() {
 
-						if (last_sfen != sfen)
-							last_sfen_ply = INT_MAX;
-						else if (last_sfen_ply < ply)
-							sfen = "";
+					// NUMA環境では、bindThisThread()を呼び出しておいたほうが速くなるらしい。
+					if (thread_num > 8)
+						WinProcGroup::bindThisThread(idx);
 
-						last_sfen_ply = std::min(last_sfen_ply,ply); // 同一sfenエントリーのなかでの最小値にする
-						last_sfen = sfen;
-					}
-#endif
+					read_book_chunk(data + boundaries[idx], data + boundaries[idx + 1], ignoreBookPly, books[idx], read_bytes);
+					++finished_thread_num;
+				}));
+			}
 
-					continue;
-				}
+			// 読み込みが終わるまで、一定時間ごとに進捗を出力する。
+			TimePoint last_report_time = start_time;
+			while (finished_thread_num < thread_num)
+			{
+				Tools::sleep(100);
 
-				// Options["IgnoreBookPly"]==true絡みでskipするエントリーであるかの判定
-				if (sfen.size() == 0)
+				if (now() - last_report_time < 10 * 1000)
 					continue;
 
-				Move16 best, next;
-
-				string bestMove, nextMove;
-				int value = 0;
-				int depth = 0;
-				uint64_t num = 1;
-
-				//istringstream is(line);
-				// value以降は、元データに欠落してるかもですよ。
-				//is >> bestMove >> nextMove >> value >> depth >> num;
-
-				// → istringstream、げろげろ遅いので、自前でparseする。
-
-				LineScanner scanner(line);
-				bestMove = scanner.get_text();
-				nextMove = scanner.get_text();
-				value = (int)scanner.get_number(value);
-				depth = (int)scanner.get_number(depth);
-				num = (uint64_t)scanner.get_number(num);
-
-#if 0
-				// 思考した指し手に対しては指し手の出現頻度のところを強制的にエンジンバージョンを100倍したものに変更する。
-				// この#ifを有効にして、makebook mergeコマンドを叩いて、別のファイルに書き出すなどするときに便利。
-				num = int(atof(ENGINE_VERSION) * 100);
-#endif
-
-				// 起動時なので変換に要するオーバーヘッドは最小化したいので合法かのチェックはしない。
-				if (bestMove == "none" || bestMove == "resign")
-					best = MOVE_NONE;
-				else
-					best = USI::to_move16(bestMove);
-
-				if (nextMove == "none" || nextMove == "resign")
-					next = MOVE_NONE;
-				else
-					next = USI::to_move16(nextMove);
-
-				BookPos bp(best , next, value, depth, num);
-				insert(sfen, bp);
-
-				// このinsert()、この関数の40%ぐらいの時間を消費している。
-				// 他の部分をせっかく高速化したのに…。
+				last_report_time = now();
+				sync_cout << "info string read book : " << read_bytes / (1024 * 1024) << " / " << size / (1024 * 1024) << " [MB] , "
+					<< read_bytes / (1024 * 1024) * 1000 / std::max(TimePoint(1), now() - start_time) << " [MB/s]" << sync_endl;
+			}
 
-				// これ、ファイルから読み込んだ文字列のまま保存しておき、
-				// アクセスするときに解凍するほうが良かったか…。
+			for (std::thread& th : threads)
+				th.join();
 
-				// unorderedmapなのでこれ以上どうしようもないな…。
+			// 各スレッドで読み込んだものをbook_bodyに統合する。
+			// unordered_map::merge()はnodeをつなぎ替えるだけなので、sfen文字列やPosMoveListのコピーは発生しない。
+			size_t total_position_num = 0;
+			for (const auto& book : books)
+				total_position_num += book.size();
 
-				// テキストそのまま持っておいて、メモリ上で二分探索する実装のほうが良かったか。
-				// (定跡がsfen文字列でソート済みであることが保証されているなら。保証されてないんだけども。)
+			book_body = std::move(books[0]);
+			book_body.reserve(total_position_num);
+			for (size_t idx = 1; idx < thread_num; ++idx)
+			{
+				book_body.merge(books[idx]);
 
+				// merge()で移動されずに残ったのは、他のchunkにも現れた局面。(定跡DBが連結されているなど)
+				// このときは指し手を一つずつ追加して、採択確率を計算し直す。
+				for (auto& entry : books[idx])
+				{
+					auto& move_list = book_body[entry.first];
+					for (const auto& bp : *entry.second)
+						insert_book_pos(move_list, bp);
+					calc_book_prob(*move_list);
+				}
 			}
-			// ファイルが終わるときにも最後の局面に対するcalc_probが必要。
-			calc_prob();
+
+			TimePoint elapsed = std::max(TimePoint(1), now() - start_time);
+			sync_cout << "info string read book : " << book_body.size() << " positions , " << elapsed << " [ms] , "
+				<< size / (1024 * 1024) * 1000 / elapsed << " [MB/s]" << sync_endl;
 		}
 
 		// 読み込んだファイル名を保存しておく。二度目のread_book()はskipする。
@@ -1073,6 +1205,169 @@ namespace Book
 		return Tools::Result::Ok();
 	}
 
+	// バイナリ定跡の書き出し
+	Tools::Result MemoryBook::write_binary_book(const std::string& filename) const
+	{
+		cout << endl << "write " + filename;
+
+		// 局面のhash keyと手数、その局面の指し手
+		struct Entry
+		{
+			u64 key;
+			int ply;
+			const PosMoveList* move_list;
+		};
+		vector<Entry> entries;
+		entries.reserve(book_body.size());
+
+		// 進捗の出力
+		u64 counter = 0;
+		auto output_progress = [&]()
+		{
+			if ((counter % 1000) == 0)
+			{
+				if ((counter % 80000) == 0) // 80文字ごとに改行
+					cout << endl;
+				cout << ".";
+			}
+			counter++;
+		};
+
+		{
+			Position pos;
+			for (auto& it : book_body)
+			{
+				// 指し手のない空っぽのentryは書き出さないように。
+				if (it.second->size() == 0)
+					continue;
+
+				output_progress();
+
+				StateInfo si;
+				pos.set(it.first, &si, Threads.main());
+				entries.push_back({ pos.key(), pos.game_ply(), it.second.get() });
+			}
+		}
+
+		// hash keyで並び替える。同じ局面であれば手数の若いほうが先頭に来るようにしておき、
+		// 手数違いの重複局面はそれ以外を除去する。(write_book()と同じ)
+		std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+			return lhs.key != rhs.key ? lhs.key < rhs.key : lhs.ply < rhs.ply;
+		});
+		entries.erase(std::unique(entries.begin(), entries.end(),
+			[](const Entry& lhs, const Entry& rhs) { return lhs.key == rhs.key; }), entries.end());
+
+		vector<BinaryBookPosition> positions;
+		vector<BinaryBookMove> moves;
+		positions.reserve(entries.size());
+
+		for (auto& e : entries)
+		{
+			output_progress();
+
+			// 採択回数でソートしておく。
+			PosMoveList move_list = *e.move_list;
+			std::stable_sort(move_list.begin(), move_list.end());
+
+			if (moves.size() + move_list.size() > UINT32_MAX || move_list.size() > UINT16_MAX)
+			{
+				cout << endl << "Error! : too many moves for binary book." << endl;
+				return Tools::Result(Tools::ResultCode::SomeError);
+			}
+
+			positions.push_back({ e.key, (u32)moves.size(), (u16)move_list.size(), (u16)std::clamp(e.ply, 0, (int)UINT16_MAX) });
+
+			for (auto& bp : move_list)
+				moves.push_back({ bp.bestMove.to_u16(), bp.nextMove.to_u16(), (s32)bp.value, (s32)bp.depth,
+					(u32)std::min(bp.num, (uint64_t)UINT32_MAX) });
+		}
+
+		BinaryBookHeader header = {};
+		std::strncpy(header.magic, kBinaryBookMagic, sizeof(header.magic));
+		header.num_positions = positions.size();
+		header.num_moves = moves.size();
+
+		fstream fs(filename, ios::out | ios::binary);
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		fs.write((const char*)&header, sizeof(header));
+		fs.write((const char*)positions.data(), positions.size() * sizeof(BinaryBookPosition));
+		fs.write((const char*)moves.data(), moves.size() * sizeof(BinaryBookMove));
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileWriteError);
+
+		fs.close();
+
+		cout << endl << "positions = " << positions.size() << " , moves = " << moves.size() << endl;
+		cout << "done!" << endl;
+
+		return Tools::Result::Ok();
+	}
+
+	// バイナリ定跡をmapする。
+	Tools::Result MemoryBook::read_binary_book(const std::string& filename)
+	{
+		auto result = binary_book.Open(filename);
+		if (result.is_not_ok())
+			return result;
+
+		// ファイルが途中で切れていないかをヘッダーの値から確認しておく。
+		auto header = (const BinaryBookHeader*)binary_book.data();
+		if (binary_book.size() < sizeof(BinaryBookHeader)
+			|| binary_book.size() != sizeof(BinaryBookHeader)
+				+ header->num_positions * sizeof(BinaryBookPosition)
+				+ header->num_moves * sizeof(BinaryBookMove))
+		{
+			binary_book.Close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		sync_cout << "info string map binary book : " << filename
+			<< " , positions = " << header->num_positions << " , moves = " << header->num_moves << sync_endl;
+
+		return Tools::Result::Ok();
+	}
+
+	// バイナリ定跡からposの局面を探す。
+	PosMoveListPtr MemoryBook::find_binary_book(const Position& pos) const
+	{
+		auto header = (const BinaryBookHeader*)binary_book.data();
+		auto positions = (const BinaryBookPosition*)(header + 1);
+		auto moves = (const BinaryBookMove*)(positions + header->num_positions);
+
+		// hash keyで二分探索
+		const u64 key = pos.key();
+		auto positions_end = positions + header->num_positions;
+		auto it = std::lower_bound(positions, positions_end, key,
+			[](const BinaryBookPosition& p, u64 k) { return p.key < k; });
+
+		if (it == positions_end || it->key != key)
+			return PosMoveListPtr();
+
+		// IgnoreBookPly == falseのときは手数まで一致しないといけない。
+		if (!ignoreBookPly && it->ply != pos.game_ply())
+			return PosMoveListPtr();
+
+		PosMoveListPtr pml_entry(new PosMoveList());
+		pml_entry->reserve(it->move_count);
+
+		// 書き出すときに採択回数でソートしてあるので、ここでは出現率を計算するだけで良い。
+		u64 num_sum = 0;
+		for (u32 i = 0; i < it->move_count; ++i)
+		{
+			auto& m = moves[it->move_index + i];
+			pml_entry->emplace_back(Move16(m.best_move), Move16(m.next_move), m.value, m.depth, m.num);
+			num_sum += m.num;
+		}
+
+		num_sum = std::max(num_sum, UINT64_C(1)); // ゼロ除算対策
+		for (auto& bp : *pml_entry)
+			bp.prob = float(bp.num) / num_sum;
+
+		return pml_entry;
+	}
+
 	// book_body.find()のwrapper。book_body.find()ではなく、こちらのfindを呼び出して用いること。
 	// sfen : sfen文字列(末尾にplyまで書かれているものとする)
 	BookType::iterator MemoryBook::find(const std::string& sfen)
@@ -1146,6 +1441,10 @@ namespace Book
 		else {
 			// やねうら王定跡データベースを用いて指し手を選択する
 
+			// バイナリ定跡をmapしてあるなら、そちらを二分探索する。(sfen()を呼び出す必要もない)
+			if (binary_book.is_open())
+				return find_binary_book(pos);
+
 			// 定跡がないならこのまま返る。(sfen()を呼び出すコストの節約)
 			if (!on_the_fly && book_body.size() == 0)
 				return PosMoveListPtr();
@@ -61,6 +61,49 @@ namespace Book
 	// (その局面ですでに同じbestMoveの指し手が登録されている場合は上書き動作となる)
 	static void insert_book_pos(PosMoveListPtr ptr, const BookPos& bp);
 
+	// --------------------------------------------------------------------------
+	//     バイナリ定跡
+	// --------------------------------------------------------------------------
+
+	// やねうら王形式の定跡(.db)を"makebook convert_to_binary"で変換したもの。
+	// ・ファイルの先頭にBinaryBookHeader、続いて局面のhash key(Position::key())で昇順にソートされたBinaryBookPositionの配列、
+	// 　最後にBinaryBookMoveの配列が並ぶ。
+	// ・read_book()はファイルをメモリにmapするだけで、find()のときにhash keyで二分探索する。
+	// 　起動時にparseしないので巨大な定跡でも読み込みが一瞬で終わり、ページキャッシュは同じ定跡を用いるプロセス間で共有される。
+	// ・Position::key()は手数を含まないので、IgnoreBookPly == falseのときはBinaryBookPosition::plyと手数を比較する。
+	// ・hash keyが64bitなので、異なる局面のkeyが衝突する可能性はゼロではない。(Aperyの定跡と同じ割り切り)
+
+	// ファイル先頭の識別文字列
+	static constexpr const char* kBinaryBookMagic = "YANEURAOU-BIN01";
+
+	struct BinaryBookHeader
+	{
+		char magic[16];    // kBinaryBookMagic(終端の'\0'を含む)
+		u64 num_positions; // BinaryBookPositionの数
+		u64 num_moves;     // BinaryBookMoveの数
+	};
+
+	struct BinaryBookPosition
+	{
+		u64 key;        // Position::key()
+		u32 move_index; // この局面の指し手のBinaryBookMove配列上での開始位置
+		u16 move_count; // この局面の指し手の数
+		u16 ply;        // 定跡DB上の手数(手数違いの重複局面は一番若い手数のみを書き出す)
+	};
+
+	struct BinaryBookMove
+	{
+		u16 best_move; // Move16
+		u16 next_move; // Move16
+		s32 value;
+		s32 depth;
+		u32 num;       // 採択回数(u32に収まらない分は飽和させる)
+	};
+
+	static_assert(sizeof(BinaryBookHeader) == 32, "");
+	static_assert(sizeof(BinaryBookPosition) == 16, "");
+	static_assert(sizeof(BinaryBookMove) == 16, "");
+
 	// メモリ上にある定跡ファイル
 	// ・sfen文字列をkeyとして、局面の指し手へ変換するのが主な役割。(このとき重複した指し手は除外するものとする)
 	// ・on the flyが指定されているときは実際はメモリ上にはないがこれを透過的に扱う。
@@ -77,6 +120,8 @@ namespace Book
 		// ・やねうら王の定跡ファイルは、on_the_flyが指定されているとメモリに丸読みしない。
 		//      Options["BookOnTheFly"]がtrueのときはon the flyで読み込むのでそれ用。
 		// 　　定跡作成時などはこれをtrueにしてはいけない。(メモリに読み込まれないため)
+		// ・バイナリ定跡(ファイル先頭がkBinaryBookMagic)は、on_the_flyの値によらずメモリにmapするだけ。
+		// 　get_body()には何も読み込まれないので、定跡の編集には使えない。
 		// ・同じファイルを二度目は読み込み動作をskipする。
 		// ・filenameはpathとして"book/"を補完しないので生のpathを指定する。
 		Tools::Result read_book(const std::string& filename, bool on_the_fly = false);
@@ -88,6 +133,12 @@ namespace Book
 		// また、事前にis_ready()は呼び出されているものとする。
 		Tools::Result write_book(const std::string& filename /*, bool sort = false*/) const;
 
+		// メモリ上の定跡をバイナリ定跡として書き出す。
+		// ・バイナリ定跡のフォーマットについては、BinaryBookHeaderのところのコメントを見ること。
+		// ・write_book()と同じく、手数違いの重複局面は手数の一番若いものだけを書き出す。
+		// ・write_book()と同じく、事前にis_ready()は呼び出されているものとする。
+		Tools::Result write_binary_book(const std::string& filename) const;
+
 		// Aperyの定跡ファイルを読み込む
 		// ・この関数はread_bookの下請けとして存在する。外部から直接呼び出すのは定跡のコンバートの時ぐらい。
 		Tools::Result read_apery_book(const std::string& filename);
@@ -148,6 +199,16 @@ namespace Book
 		// 上のon_the_fly == trueのときに、開いている定跡ファイルのファイルハンドル
 		std::fstream fs;
 
+		// バイナリ定跡を読み込んだときに、そのファイルをmapしたもの。
+		// これがopenされているときは、find()はbook_bodyではなくこちらを調べる。
+		MemoryMappedFile binary_book;
+
+		// read_book()の下請け。バイナリ定跡をmapして、ヘッダーとファイルサイズに矛盾がないかを調べる。
+		Tools::Result read_binary_book(const std::string& filename);
+
+		// find(const Position&)の下請け。mapしてあるバイナリ定跡から局面を二分探索する。
+		PosMoveListPtr find_binary_book(const Position& pos) const;
+
 		// read_book()のときに読み込んだbookの名前
 		// ・on_the_fly == trueのときは、読み込む予定のファイルの名前。
 		// ・二度目のread_book()の呼び出しのときにすでに読み込んである(or ファイルをopenしてある)かどうかの
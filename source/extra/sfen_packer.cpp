@@ -51,25 +51,56 @@ struct BitStream
     return b;
   }
 
-  // nビットのデータを書き出す
+  // nビットのデータを書き出す(n <= 8)
   // データはdの下位から順に書き出されるものとする。
-  void write_n_bit(int d, int n)
+  // 1bitずつではなく、またがる2byteにまとめて書き出す。
+  FORCE_INLINE void write_n_bit(int d, int n)
   {
-    for (int i = 0; i < n; ++i)
-      write_one_bit(d & (1 << i));
+    ASSERT_LV3(n <= 8);
+
+    int index = bit_cursor / 8;
+    int v = (d & ((1 << n) - 1)) << (bit_cursor & 7);
+    data[index] |= (u8)v;
+    if ((bit_cursor & 7) + n > 8)
+      data[index + 1] |= (u8)(v >> 8);
+
+    bit_cursor += n;
   }
 
-  // nビットのデータを読み込む
+  // nビットのデータを読み込む(n <= 8)
   // write_n_bit()の逆変換。
-  int read_n_bit(int n)
+  FORCE_INLINE int read_n_bit(int n)
   {
-    int result = 0;
-    for (int i = 0; i < n; ++i)
-      result |= read_one_bit() ? (1 << i) : 0;
+    int result = peek_8bit() & ((1 << n) - 1);
+    bit_cursor += n;
 
     return result;
   }
 
+  // カーソル位置から8bitを、カーソルを進めずに取り出す。
+  // ハフマン符号の復号表を引くのに用いる。データの末尾を超えたbitは0とする。
+  FORCE_INLINE int peek_8bit() const
+  {
+    int index = bit_cursor / 8;
+    int w;
+    if (index + 1 < DATA_SIZE)
+    {
+      u16 w16;
+      std::memcpy(&w16, data + index, sizeof(w16));
+      w = w16;
+    }
+    else
+      w = index < DATA_SIZE ? data[index] : 0;
+
+    return (w >> (bit_cursor & 7)) & 0xff;
+  }
+
+  // カーソルをnビット進める。
+  FORCE_INLINE void skip_n_bit(int n) { bit_cursor += n; }
+
+  // データのバイト数。PackedSfenのサイズ。
+  static constexpr int DATA_SIZE = 32;
+
 private:
   // 次に読み書きすべきbit位置。
   int bit_cursor;
@@ -130,6 +161,61 @@ HuffmanedPiece huffman_table[] =
   {0x0f,5}, // GOLD
 };
 
+// ハフマン符号の復号表
+// 盤上の駒は 符号(最大6bit) + 成りフラグ1bit + 先後フラグ1bit で最大8bit、
+// 手駒は 符号(最大5bit) + 成りフラグ1bit + 先後フラグ1bit で最大7bitなので、
+// ストリームの先頭8bitを添字として、駒とフラグを含めたbit数を一度に引ける。
+// 符号は接頭語符号として完全なので、256通りの全てに対応する駒がある。
+struct HuffmanDecodeTable
+{
+  struct Entry
+  {
+    Piece piece;
+    int bits;
+  };
+
+  Entry board[256];
+  Entry hand[256];
+
+  HuffmanDecodeTable()
+  {
+    // 下位bitsビットがcodeと一致する全ての添字にentryを設定する。
+    auto fill = [](Entry* table, int code, int bits, Piece piece) {
+      for (int i = 0; i < 256; ++i)
+        if ((i & ((1 << bits) - 1)) == code)
+          table[i] = { piece , bits };
+    };
+
+    fill(board, huffman_table[NO_PIECE_TYPE].code, huffman_table[NO_PIECE_TYPE].bits, NO_PIECE);
+
+    for (PieceType pr = PAWN; pr < KING; ++pr)
+    {
+      auto c = huffman_table[pr];
+      for (auto color : COLOR)
+      {
+        if (pr == GOLD)
+        {
+          // 金は成りフラグがない。
+          fill(board, c.code | (color << c.bits), c.bits + 1, make_piece(color, pr));
+          fill(hand, (c.code >> 1) | (color << (c.bits - 1)), c.bits, make_piece(color, pr));
+          continue;
+        }
+
+        for (int promote = 0; promote < 2; ++promote)
+        {
+          fill(board, c.code | (promote << c.bits) | (color << (c.bits + 1)), c.bits + 2,
+            make_piece(color, pr + (promote ? PIECE_TYPE_PROMOTE : NO_PIECE_TYPE)));
+          // 手駒の成りフラグは読み捨てる。
+          fill(hand, (c.code >> 1) | (promote << (c.bits - 1)) | (color << c.bits), c.bits + 1,
+            make_piece(color, pr));
+        }
+      }
+    }
+  }
+};
+
+const HuffmanDecodeTable huffman_decode_table;
+
 // sfenを圧縮/解凍するためのクラス
 // sfenはハフマン符号化をすることで256bit(32bytes)にpackできる。
 // このことはなのはminiにより証明された。上のハフマン符号化である。
@@ -236,23 +322,26 @@ struct SfenPacker
   BitStream stream;
 
   // 盤面の駒をstreamに出力する。
+  // 駒種の符号と成りフラグ、先後フラグを合わせて(最大8bit)まとめて書き出す。
   void write_board_piece_to_stream(Piece pc)
   {
     // 駒種
     PieceType pr = raw_type_of(pc);
     auto c = huffman_table[pr];
-    stream.write_n_bit(c.code, c.bits);
- 
-    if (pc == NO_PIECE)
-      return;
+    int code = c.code, bits = c.bits;
 
-    // 成りフラグ
-    // (金はこのフラグはない)
-    if (pr!=GOLD)
-      stream.write_one_bit((PIECE_PROMOTE & pc) ? 1 : 0);
+    if (pc != NO_PIECE)
+    {
+      // 成りフラグ
+      // (金はこのフラグはない)
+      if (pr != GOLD)
+        code |= ((PIECE_PROMOTE & pc) ? 1 : 0) << bits++;
 
-    // 先後フラグ
-    stream.write_one_bit(color_of(pc));
+      // 先後フラグ
+      code |= color_of(pc) << bits++;
+    }
+
+    stream.write_n_bit(code, bits);
   }
 
   // 手駒をstreamに出力する
@@ -263,75 +352,33 @@ struct SfenPacker
     // 駒種
     PieceType pr = raw_type_of(pc);
     auto c = huffman_table[pr];
-    stream.write_n_bit(c.code >> 1, c.bits - 1);
+    int code = c.code >> 1, bits = c.bits - 1;
 
     // 金以外は手駒であっても不成を出力して、盤上の駒のbit数-1を保つ
     if (pr != GOLD)
-      stream.write_one_bit(false);
+      ++bits;
 
     // 先後フラグ
-    stream.write_one_bit(color_of(pc));
+    code |= color_of(pc) << bits++;
+
+    stream.write_n_bit(code, bits);
   }
 
   // 盤面の駒を1枚streamから読み込む
+  // 復号表を引いて、成りフラグ・先後フラグまで一度に読み込む。
   Piece read_board_piece_from_stream()
   {
-    PieceType pr = NO_PIECE_TYPE;
-    int code = 0, bits = 0;
-    while (true)
-    {
-      code |= stream.read_one_bit() << bits;
-      ++bits;
-
-      ASSERT_LV3(bits <= 6);
-
-      for (pr = NO_PIECE_TYPE; pr < KING; ++pr)
-        if (huffman_table[pr].code == code
-          && huffman_table[pr].bits == bits)
-          goto Found;
-    }
-  Found:;
-    if (pr == NO_PIECE_TYPE)
-      return NO_PIECE;
-
-    // 成りフラグ
-    // (金はこのフラグはない)
-    bool promote = (pr == GOLD) ? false : stream.read_one_bit();
-
-    // 先後フラグ
-    Color c = (Color)stream.read_one_bit();
-    
-    return make_piece(c, pr + (promote ? PIECE_TYPE_PROMOTE : NO_PIECE_TYPE));
+    const auto& e = huffman_decode_table.board[stream.peek_8bit()];
+    stream.skip_n_bit(e.bits);
+    return e.piece;
   }
 
   // 手駒を1枚streamから読み込む
   Piece read_hand_piece_from_stream()
   {
-    PieceType pr = NO_PIECE_TYPE;
-    int code = 0, bits = 0;
-    while (true)
-    {
-      code |= stream.read_one_bit() << bits;
-      ++bits;
-
-      ASSERT_LV3(bits <= 6);
-
-      for (pr = PAWN; pr < KING; ++pr)
-        if ((huffman_table[pr].code >> 1) == code
-          && (huffman_table[pr].bits -1) == bits)
-          goto Found;
-    }
-  Found:;
-    ASSERT_LV3(pr != NO_PIECE_TYPE);
-
-    // 金以外であれば成りフラグを1bit捨てる
-    if (pr != GOLD)
-      stream.read_one_bit();
-
-    // 先後フラグ
-    Color c = (Color)stream.read_one_bit();
-
-    return make_piece(c, pr);
+    const auto& e = huffman_decode_table.hand[stream.peek_8bit()];
+    stream.skip_n_bit(e.bits);
+    return e.piece;
   }
 };
 
@@ -10,6 +10,8 @@
 #if defined(EVAL_LEARN)
 #include "../learn/learn.h"
 #include "../learn/learning_tools.h"
+#include "../tanuki_book.h"
+#include "../tanuki_hashed_book.h"
 using namespace EvalLearningTools;
 #endif
 
@@ -18,8 +20,10 @@ using namespace EvalLearningTools;
 #include "../eval/nnue/nnue_test_command.h"
 #endif
 
+#include <queue>
 #include <unordered_set>
 #include <cmath>               // sqrt() , fabs()
+#include <cstring>             // memcmp()
 #include "all.h"
 
 // ----------------------------------
@@ -276,6 +280,71 @@ void random_player_bench_cmd(Position& pos, istringstream& is)
 	cout << endl << "bench done , " << gps << " games/second " << endl;
 }
 
+#if defined(USE_SFEN_PACKER)
+// --- "test sfenbench"コマンド
+
+// ランダムプレイヤーで生成した局面を用いて、局面のpack/unpackの速度を計測する。
+// あわせて、packした局面を展開してpackし直すと元に戻ることを確認する。
+void sfen_packer_bench_cmd(Position& pos, istringstream& is)
+{
+	uint64_t num_positions = 1000000; // default 100万局面
+	is >> num_positions;
+	cout << "Sfen packer bench test , num_positions = " << num_positions << endl;
+
+	const int MAX_PLY = 256;
+	std::vector<StateInfo> state(MAX_PLY + 1);
+	std::vector<PackedSfen> sfens(num_positions);
+	PRNG prng(20201016);
+
+	// 局面の生成
+	pos.set_hirate(&state[0], Threads.main());
+	int ply = 0;
+	for (auto& sfen : sfens)
+	{
+		MoveList<LEGAL_ALL> mg(pos);
+		if (mg.size() == 0 || ply == MAX_PLY)
+		{
+			pos.set_hirate(&state[0], Threads.main());
+			ply = 0;
+		}
+		else
+			pos.do_move(mg.begin()[prng.rand(mg.size())], state[++ply]);
+
+		pos.sfen_pack(sfen);
+	}
+
+	auto rate = [&](TimePoint start) { return (double)num_positions * 1000 / std::max<TimePoint>(1, now() - start); };
+
+	// pack
+	PackedSfen packed;
+	auto start = now();
+	for (uint64_t i = 0; i < num_positions; ++i)
+		pos.sfen_pack(packed);
+	cout << "sfen_pack            : " << rate(start) << " positions/second" << endl;
+
+	// Positionの構築
+	StateInfo si;
+	uint64_t num_errors = 0;
+	start = now();
+	for (const auto& sfen : sfens)
+		num_errors += pos.set_from_packed_sfen(sfen, &si, Threads.main()).is_not_ok();
+	cout << "set_from_packed_sfen : " << rate(start) << " positions/second" << endl;
+
+	// 展開してpackし直すと元に戻るか
+	for (const auto& sfen : sfens)
+	{
+		pos.set_from_packed_sfen(sfen, &si, Threads.main());
+		pos.sfen_pack(packed);
+		num_errors += std::memcmp(&packed, &sfen, sizeof(PackedSfen)) != 0;
+		num_errors += pos.sfen() != Position::sfen_unpack(sfen);
+	}
+
+	cout << "bench done , errors = " << num_errors << endl;
+
+	pos.set_hirate(&state[0], Threads.main());
+}
+#endif
+
 
 // --- "test genchecks"コマンド
 
@@ -1107,6 +1176,116 @@ void book_check_cmd(Position& pos, istringstream& is)
 	cout << "..done , write to " << file_name << endl;
 }
 
+// バイナリ定跡のテスト
+// やねうら王形式の定跡をバイナリ定跡に変換し、mapして読み込んだものと
+// 従来の読み込み方で読み込んだものとで、全局面のfind()の結果が一致するかを調べる。
+// 例) test binarybook book/user_book1.db
+// バイナリ定跡は、2つ目の引数を省略すると元のファイル名に".bin"を付けたファイルに書き出す。
+// ("book.bin"というファイル名はApery定跡として扱われるので避けること。)
+void test_binary_book(Position& pos, istringstream& is)
+{
+	string text_book_name, binary_book_name;
+	is >> text_book_name >> binary_book_name;
+	if (binary_book_name.empty())
+		binary_book_name = text_book_name + ".bin";
+
+	Book::MemoryBook text_book, binary_book;
+
+	auto start = now();
+	if (text_book.read_book(text_book_name, /*BookOnTheFly*/ false).is_not_ok())
+		return;
+	cout << "read text book : " << (now() - start) << "[ms]" << endl;
+
+	if (text_book.write_binary_book(binary_book_name).is_not_ok())
+		return;
+
+	start = now();
+	if (binary_book.read_book(binary_book_name, /*BookOnTheFly*/ false).is_not_ok())
+		return;
+	cout << "map binary book : " << (now() - start) << "[ms]" << endl;
+
+	// バイナリ定跡には手数違いの重複局面は一番若い手数のものしか書き出されないので、
+	// 局面ごとに一番若い手数を調べておき、それ以外の手数の局面は比較しない。
+	const bool ignore_book_ply = (bool)Options["IgnoreBookPly"];
+	std::unordered_map<Key, int> min_plies;
+	for (auto& it : *text_book.get_body())
+	{
+		if (it.second->size() == 0)
+			continue;
+
+		StateInfo si;
+		pos.set(it.first, &si, Threads.main());
+		auto result = min_plies.emplace(pos.key(), pos.game_ply());
+		if (!result.second)
+			result.first->second = std::min(result.first->second, pos.game_ply());
+	}
+
+	// 比較のために指し手の順番を揃える。
+	auto sorted_moves = [](const Book::PosMoveListPtr& ptr) {
+		Book::PosMoveList moves = *ptr;
+		std::sort(moves.begin(), moves.end(), [](const Book::BookPos& lhs, const Book::BookPos& rhs) {
+			return lhs.bestMove.to_u16() < rhs.bestMove.to_u16();
+		});
+		return moves;
+	};
+
+	u64 num_positions = 0, num_skipped = 0, num_errors = 0;
+	for (auto& it : *text_book.get_body())
+	{
+		if (it.second->size() == 0)
+			continue;
+
+		StateInfo si;
+		pos.set(it.first, &si, Threads.main());
+
+		auto expected = text_book.find(pos);
+		auto actual = binary_book.find(pos);
+
+		if (!ignore_book_ply && pos.game_ply() != min_plies[pos.key()])
+		{
+			// 手数違いの重複局面なので、バイナリ定跡では見つからないのが正しい。
+			if (actual)
+			{
+				cout << "Error! : found a duplicated position , sfen = " << it.first << endl;
+				++num_errors;
+			}
+			++num_skipped;
+			continue;
+		}
+
+		++num_positions;
+
+		if (!expected || !actual)
+		{
+			cout << "Error! : position not found , sfen = " << it.first << endl;
+			++num_errors;
+			continue;
+		}
+
+		auto expected_moves = sorted_moves(expected);
+		auto actual_moves = sorted_moves(actual);
+		bool equal = expected_moves.size() == actual_moves.size();
+		for (size_t i = 0; equal && i < expected_moves.size(); ++i)
+		{
+			auto& e = expected_moves[i];
+			auto& a = actual_moves[i];
+			equal = e.bestMove == a.bestMove && e.nextMove == a.nextMove
+				&& e.value == a.value && e.depth == a.depth
+				&& std::min(e.num, (uint64_t)UINT32_MAX) == a.num;
+		}
+
+		if (!equal)
+		{
+			cout << "Error! : moves mismatch , sfen = " << it.first << endl;
+			++num_errors;
+		}
+	}
+
+	cout << "positions = " << num_positions << " , skipped = " << num_skipped
+		<< " , errors = " << num_errors << endl;
+	cout << (num_errors == 0 ? "test binarybook : OK" : "test binarybook : NG") << endl;
+}
+
 
 #if defined(EVAL_LEARN)
 // "test search"コマンド。
@@ -1788,6 +1967,223 @@ void dump_sfen(Position& pos, istringstream& is)
 
 	cout << "sfen_dump , finished." << endl;
 }
+
+// --- "test propagate"コマンド
+
+// Tanuki::PropagateLeafNodeValues()の検証用の参照実装。
+// 以前のPropagateLeafNodeValuesToRoot()と同じく、平手局面、続いて残りの局面から再帰呼び出しで評価値を伝搬する。
+// 以前の実装はsfen文字列(手数を含む)をキーとしてメモ化していたため、経路上の局面に戻ると手数違いの局面として
+// Position::is_repetition()で千日手と判定されていた。手数を区別しないHashedBookでは、経路上の局面かどうかを別に調べる。
+Tanuki::ValueMoveDepth propagate_nega_max(Tanuki::HashedBook& book, Position& pos, std::vector<Tanuki::ValueMoveDepth>& memo, std::vector<uint8_t>& on_path) {
+	size_t index = book.FindIndex(pos);
+	ASSERT_LV3(index != book.NumEntries());
+
+	if (on_path[index]) {
+		// 経路上の局面に戻った場合
+		return Tanuki::GetRepetitionValue(Tanuki::GetRepetitionOnPath(pos));
+	}
+
+	auto& vmd = memo[index];
+	if (vmd.depth != DEPTH_NONE) {
+		// キャッシュにヒットした場合、その値を返す。
+		return vmd;
+	}
+
+	if (pos.is_mated()) {
+		// 詰んでいる場合
+		vmd.value = mated_in(0);
+		vmd.depth = 0;
+		return vmd;
+	}
+
+	if (pos.DeclarationWin() != MOVE_NONE) {
+		// 宣言勝ちできる場合
+		vmd.value = mate_in(1);
+		vmd.depth = 0;
+		return vmd;
+	}
+
+	auto repetition_state = pos.is_repetition();
+	if (repetition_state != REPETITION_NONE) {
+		vmd = Tanuki::GetRepetitionValue(repetition_state);
+		return vmd;
+	}
+
+	vmd.value = mated_in(0);
+	vmd.depth = 0;
+	on_path[index] = true;
+	// 全合法手について調べる
+	for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
+		StateInfo state_info = {};
+		pos.do_move(move, state_info);
+		if (book.Contains(pos)) {
+			// 子局面が存在する場合のみ処理する。
+			Tanuki::ValueMoveDepth vmd_child = propagate_nega_max(book, pos, memo, on_path);
+
+			// 指し手情報に探索の結果を格納する。
+			// 返ってきた評価値は次の局面から見た評価値なので、符号を反転する。
+			// また、探索深さを+1する。
+			book.Upsert(index, Book::BookPos(Move16(move.move), vmd_child.move, -vmd_child.value, vmd_child.depth + 1, 1));
+		}
+		pos.undo_move(move);
+	}
+	on_path[index] = false;
+
+	// 現局面について、定跡データベースに子局面への指し手が登録された。
+	// 定跡データベースを調べ、この局面における最適な指し手を調べて返す。
+	for (const auto& book_move : book.GetMoves(index)) {
+		if (vmd.value < book_move.value) {
+			vmd.value = static_cast<Value>(book_move.value);
+			vmd.move = book_move.bestMove;
+			vmd.depth = book_move.depth;
+		}
+	}
+
+	return vmd;
+}
+
+void propagate_leaf_node_values_recursively(Tanuki::HashedBook& book) {
+	std::vector<Tanuki::ValueMoveDepth> memo(book.NumEntries());
+	std::vector<uint8_t> on_path(book.NumEntries());
+	Thread& thread = *Threads[0];
+	Position& pos = thread.rootPos;
+	StateInfo state_info = {};
+
+	// 平手の局面からたどれる局面について処理する
+	pos.set_hirate(&state_info, &thread);
+	if (book.Contains(pos)) {
+		propagate_nega_max(book, pos, memo, on_path);
+	}
+
+	// 平手の局面から辿れなかった局面を処理する
+	for (size_t index = 0; index < book.NumEntries(); ++index) {
+		const auto& entry = book.GetEntry(index);
+		if (entry.used) {
+			pos.set_from_packed_sfen(entry.packed_sfen, &state_info, &thread, false, entry.ply);
+			propagate_nega_max(book, pos, memo, on_path);
+		}
+	}
+}
+
+// Tanuki::PropagateLeafNodeValues()が、以前の再帰呼び出しによる実装(propagate_leaf_node_values_recursively())と
+// 同じ結果になるかを調べる。
+// 千日手・優等局面・劣等局面を含む定跡を、玉と飛車の往復と香の打ち捨てだけからなる小さな局面から生成して比較する。
+void test_propagate_leaf_node_values()
+{
+	Search::LimitsType limits;
+	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
+	limits.max_game_ply = 1 << 16;
+	limits.depth = MAX_PLY;
+	limits.silent = true;
+	limits.enteringKingRule = EKR_27_POINT;
+	Search::Limits = limits;
+
+	// 平手から後手の香と5筋の歩を先手の持ち駒に、先手の2筋の歩を後手の持ち駒にし、後手の飛車を5bに移した局面から始める。
+	// 先手が5dに打った香を後手の飛車が取り、後手が2fに打った香を先手の飛車が取るので、
+	// どの局面から探索を始めても、盤上の駒が同じで手駒だけが異なる局面に行き当たる。
+	// 玉は先手が5iと4h、後手が5aと4bを往復し、飛車は先手が2f～2h、後手が5b～5dを動く。
+	// (HashedBookは局面をPackedSfenで保持するので、全ての駒が盤上か手駒にある局面でなければならない)
+	const std::string root_sfen = "1nsgkgsnl/4r2b1/pppp1pppp/9/9/9/PPPPPPP1P/1B5R1/LNSGKGSNL b LPp 1";
+	auto is_cycle_move = [](const Position& pos, Move move) {
+		Square to = to_sq(move);
+		if (is_drop(move)) {
+			return move_dropped_piece(move) == LANCE && (to == SQ_54 || to == SQ_26);
+		}
+		if (is_promote(move)) {
+			return false;
+		}
+		switch (type_of(pos.piece_on(from_sq(move)))) {
+		case KING:
+			return to == SQ_59 || to == SQ_48 || to == SQ_51 || to == SQ_42;
+		case ROOK:
+			return to == SQ_52 || to == SQ_53 || to == SQ_54 || to == SQ_26 || to == SQ_27 || to == SQ_28;
+		default:
+			return false;
+		}
+	};
+
+	// 上記の指し手でたどれる局面を幅優先探索で全て登録する。
+	// 上記以外の指し手がある局面には、末端局面の代わりとして、局面ごとに異なる評価値の指し手をひとつ登録しておく。
+	Tanuki::HashedBook book;
+	Thread& thread = *Threads[0];
+	Position& pos = thread.rootPos;
+	StateInfo state_info = {};
+	StateInfo child_state_info = {};
+	pos.set(root_sfen, &state_info, &thread);
+	std::unordered_set<Key> visited = { pos.key() };
+	std::queue<std::pair<PackedSfen, int>> queue;
+	queue.push({ {}, pos.game_ply() });
+	pos.sfen_pack(queue.back().first);
+	while (!queue.empty()) {
+		auto packed_sfen_and_ply = queue.front();
+		queue.pop();
+		pos.set_from_packed_sfen(packed_sfen_and_ply.first, &state_info, &thread, false, packed_sfen_and_ply.second);
+
+		bool has_leaf_move = false;
+		for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
+			if (!is_cycle_move(pos, move.move)) {
+				if (!has_leaf_move) {
+					int value = static_cast<int>(pos.key() % 601) - 300;
+					book.Upsert(pos, Book::BookPos(Move16(move.move), MOVE_NONE, value, 16, 1));
+					has_leaf_move = true;
+				}
+				continue;
+			}
+
+			book.Upsert(pos, Book::BookPos(Move16(move.move), MOVE_NONE, 0, 0, 1));
+			pos.do_move(move.move, child_state_info);
+			if (visited.insert(pos.key()).second) {
+				queue.push({ {}, pos.game_ply() });
+				pos.sfen_pack(queue.back().first);
+			}
+			pos.undo_move(move.move);
+		}
+	}
+	cout << "num_positions=" << visited.size() << endl;
+
+	Tanuki::HashedBook expected = book;
+	propagate_leaf_node_values_recursively(expected);
+	Tanuki::HashedBook actual = book;
+	Tanuki::PropagateLeafNodeValues(actual);
+
+	// 指し手の順序は問わず、各指し手の内容が一致するかを調べる。
+	auto sorted_moves = [](Tanuki::HashedBook& book, size_t index) {
+		auto moves = book.GetMoves(index);
+		std::vector<Book::BookPos> sorted(moves.begin(), moves.end());
+		std::sort(sorted.begin(), sorted.end(), [](const Book::BookPos& lhs, const Book::BookPos& rhs) {
+			return lhs.bestMove.to_u16() < rhs.bestMove.to_u16();
+		});
+		return sorted;
+	};
+
+	int num_errors = 0;
+	for (size_t index = 0; index < book.NumEntries(); ++index) {
+		const auto& entry = book.GetEntry(index);
+		if (!entry.used) {
+			continue;
+		}
+
+		auto expected_moves = sorted_moves(expected, index);
+		auto actual_moves = sorted_moves(actual, index);
+		bool equal = expected_moves.size() == actual_moves.size();
+		for (size_t i = 0; equal && i < expected_moves.size(); ++i) {
+			const auto& e = expected_moves[i];
+			const auto& a = actual_moves[i];
+			equal = e.bestMove == a.bestMove && e.nextMove == a.nextMove
+				&& e.value == a.value && e.depth == a.depth && e.num == a.num;
+		}
+
+		if (!equal) {
+			pos.set_from_packed_sfen(entry.packed_sfen, &state_info, &thread, false, entry.ply);
+			cout << "Error! : moves mismatch , sfen = " << pos.sfen() << endl;
+			++num_errors;
+		}
+	}
+
+	cout << "num_errors=" << num_errors << endl;
+	cout << (num_errors == 0 ? "test propagate : OK" : "test propagate : NG") << endl;
+}
+
 #endif // EVAL_LEARN
 
 #if defined (USE_KIF_CONVERT_TOOLS)
@@ -1913,6 +2309,9 @@ void test_cmd(Position& pos, istringstream& is)
 	if (param == "unit") unit_test(pos, is);                         // 単体テスト
 	else if (param == "rp") random_player_cmd(pos, is);              // ランダムプレイヤー
 	else if (param == "rpbench") random_player_bench_cmd(pos, is);   // ランダムプレイヤーベンチ
+#if defined(USE_SFEN_PACKER)
+	else if (param == "sfenbench") sfen_packer_bench_cmd(pos, is);   // 局面のpack/unpackのベンチ
+#endif
 	else if (param == "cm") cooperation_mate_cmd(pos, is);           // 協力詰めルーチン
 	else if (param == "checks") test_genchecks(pos, is);             // 王手生成ルーチンのテスト
 	else if (param == "hand") test_hand();                           // 手駒の優劣関係などのテスト
@@ -1921,10 +2320,12 @@ void test_cmd(Position& pos, istringstream& is)
 	else if (param == "timeman") test_timeman();                     // TimeManagerのテスト
 	else if (param == "exambook") exam_book(pos);                    // 定跡の精査用コマンド
 	else if (param == "bookcheck") book_check_cmd(pos,is);           // 定跡のチェックコマンド
+	else if (param == "binarybook") test_binary_book(pos, is);       // バイナリ定跡の読み込みテスト
 #if defined (EVAL_LEARN)
 	else if (param == "search") test_search(pos, is);                // 現局面からLearner::search()を呼び出して探索させる
 	else if (param == "dumpsfen") dump_sfen(pos, is);                // gensfenコマンドで生成した教師局面のダンプ
 	else if (param == "evalsave") Eval::save_eval("");               // 現在の評価関数のパラメーターをファイルに保存
+	else if (param == "propagate") test_propagate_leaf_node_values(); // 定跡の評価値の伝搬のテスト
 #endif
 #if defined (EVAL_KPPT) || defined(EVAL_KPP_KKPT)
 	else if (param == "evalmerge") eval_merge(is);                   // 評価関数の合成コマンド
@@ -1947,13 +2348,16 @@ void test_cmd(Position& pos, istringstream& is)
 		cout << "test unit               // UnitTest" << endl;
 		cout << "test rp                 // Random Player" << endl;
 		cout << "test rpbench            // Random Player bench" << endl;
+		cout << "test sfenbench [num]    // Sfen packer bench" << endl;
 		cout << "test cm [depth]         // Cooperation Mate" << endl;
 		cout << "test checks             // Generate Checks Test" << endl;
 		cout << "test records [filename] // Read records.sfen Test" << endl;
 		cout << "test autoplay           // Auto Play Test" << endl;
 		cout << "test timeman            // Time Manager Test" << endl;
 		cout << "test exambook           // Examine Book" << endl;
+		cout << "test binarybook [book.db] [out.bin] // Binary Book Test" << endl;
 		cout << "test dumpsfen [filename]// dump gensfen's file" << endl;
+		cout << "test propagate          // Propagate Leaf Node Values Test" << endl;
 	}
 }
 
@@ -70,6 +70,7 @@
 #if defined(EVAL_NNUE)
 #include "../eval/nnue/evaluate_nnue_learner.h"
 #include "../tanuki_progress.h"
+#include "../tanuki_kifu_container.h"
 #include <shared_mutex>
 #endif
 
@@ -1223,12 +1224,14 @@ struct SfenReader
 
 	void read_validation_set(const string file_name, int eval_limit)
 	{
-		ifstream fs(file_name, ios::binary);
+		// 生の教師局面ファイルと圧縮棋譜コンテナのどちらも読み込めるようにしておく。
+		Tanuki::KifuFileReader fs;
+		fs.Open(file_name);
 
-		while (fs)
+		while (fs.IsOpen())
 		{
 			PackedSfenValue p;
-			if (fs.read((char*)&p, sizeof(PackedSfenValue)))
+			if (fs.Read(p))
 			{
 				if (eval_limit < abs(p.score) || abs(p.score) == VALUE_SUPERIOR)
 					continue;
@@ -1320,8 +1323,8 @@ struct SfenReader
 	{
 		auto open_next_file = [&]()
 		{
-			if (fs.is_open())
-				fs.close();
+			if (fs.IsOpen())
+				fs.Close();
 
 			// もう無い
 			if (filenames.size() == 0)
@@ -1331,9 +1334,9 @@ struct SfenReader
 			string filename = *filenames.rbegin();
 			filenames.pop_back();
 
-			fs.open(filename, ios::in | ios::binary);
+			fs.Open(filename);
 			//cout << "open filename = " << filename << endl;
-			ASSERT(fs);
+			ASSERT(fs.IsOpen());
 
 			return true;
 		};
@@ -1354,7 +1357,7 @@ struct SfenReader
 			while (sfens.size() < SFEN_READ_SIZE)
 			{
 				PackedSfenValue p;
-				if (fs.read((char*)&p, sizeof(PackedSfenValue)))
+				if (fs.Read(p))
 				{
 					sfens.push_back(p);
 				} else
@@ -1462,7 +1465,8 @@ protected:
 
 
 	// sfenファイルのハンドル
-	std::fstream fs;
+	// 生の教師局面ファイルと圧縮棋譜コンテナのどちらも読み込める。
+	Tanuki::KifuFileReader fs;
 
 	// 各スレッド用のsfen
 	// (使いきったときにスレッドが自らdeleteを呼び出して開放すべし。)
@@ -1852,6 +1856,8 @@ void LearnerThink::thread_worker(size_t thread_id)
 #else
 				{
 					// パラメータの更新
+					// 勾配の計算は裏で進み、その間も他のスレッドは次の学習データを集める。
+					// 評価関数に反映されるのは次回の更新時(または保存・lossの計算の前)となる。
 
 					// 更新中に評価関数を使わないようにロックする。
 					lock_guard<shared_timed_mutex> write_lock(nn_mutex);
@@ -1868,6 +1874,13 @@ void LearnerThink::thread_worker(size_t thread_id)
 					sr.save_count = 0;
 
 					// この間、gradientの計算が進むと値が大きくなりすぎて困る気がするので他のスレッドを停止させる。
+#if defined(EVAL_NNUE)
+					{
+						// 裏で進めている更新を完了させてから保存する。
+						lock_guard<shared_timed_mutex> write_lock(nn_mutex);
+						Eval::NNUE::FinishUpdateParameters();
+					}
+#endif
 					const bool converged = save();
 					if (converged)
 					{
@@ -1888,6 +1901,14 @@ void LearnerThink::thread_worker(size_t thread_id)
 					// 今回処理した件数
 					u64 done = sr.total_done - sr.last_done;
 
+#if defined(EVAL_NNUE)
+					{
+						// 最新のパラメーターでlossを計算する。
+						lock_guard<shared_timed_mutex> write_lock(nn_mutex);
+						Eval::NNUE::FinishUpdateParameters();
+					}
+#endif
+
 					// lossの計算
 					calc_loss(thread_id , done);
 
@@ -2899,6 +2920,11 @@ void learn(Position&, istringstream& is)
 	// 学習開始。
 	learn_think.go_think();
 
+#if defined(EVAL_NNUE)
+	// 裏で進めている更新を完了させておく。
+	Eval::NNUE::FinishUpdateParameters();
+#endif
+
 	// 最後に一度保存。
 	learn_think.save(true);
 
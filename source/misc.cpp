@@ -45,6 +45,13 @@ extern "C" {
 #include <sys/mman.h> // madvise()
 #endif
 
+#if !defined(_WIN32)
+#include <fcntl.h>    // open()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <unistd.h>   // close()
+#endif
+
 #include "misc.h"
 #include "thread.h"
 #include "usi.h"
@@ -1016,6 +1023,112 @@ Tools::Result FileOperator::WriteMemoryToFile(const std::string& filename, void*
 	return Tools::Result::Ok();
 }
 
+// --- MemoryMappedFile
+
+#if defined(_WIN32)
+
+Tools::Result MemoryMappedFile::Open(const std::string& filename, bool sequential)
+{
+	Close();
+
+	HANDLE file = ::CreateFileW(Tools::MultiByteToWideChar(filename).c_str(), GENERIC_READ, FILE_SHARE_READ,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | (sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS), nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	LARGE_INTEGER size;
+	if (!::GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		::CloseHandle(file);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		::CloseHandle(file);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	void* view = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr)
+	{
+		::CloseHandle(mapping);
+		::CloseHandle(file);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	ptr = (const u8*)view;
+	file_size = (u64)size.QuadPart;
+
+	return Tools::Result::Ok();
+}
+
+void MemoryMappedFile::Close()
+{
+	if (ptr != nullptr)
+		::UnmapViewOfFile(ptr);
+	if (mapping_handle != nullptr)
+		::CloseHandle(mapping_handle);
+	if (file_handle != nullptr)
+		::CloseHandle(file_handle);
+
+	ptr = nullptr;
+	file_size = 0;
+	mapping_handle = nullptr;
+	file_handle = nullptr;
+}
+
+#else
+
+Tools::Result MemoryMappedFile::Open(const std::string& filename, bool sequential)
+{
+	Close();
+
+	int file = ::open(filename.c_str(), O_RDONLY);
+	if (file == -1)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	struct stat st;
+	if (::fstat(file, &st) != 0 || st.st_size == 0)
+	{
+		::close(file);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	void* view = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED)
+	{
+		::close(file);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	// 二分探索でランダムにアクセスするなら先読みは要らない。
+	::madvise(view, (size_t)st.st_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+
+	fd = file;
+	ptr = (const u8*)view;
+	file_size = (u64)st.st_size;
+
+	return Tools::Result::Ok();
+}
+
+void MemoryMappedFile::Close()
+{
+	if (ptr != nullptr)
+		::munmap((void*)ptr, (size_t)file_size);
+	if (fd != -1)
+		::close(fd);
+
+	ptr = nullptr;
+	file_size = 0;
+	fd = -1;
+}
+
+#endif
+
 // --- TextFileReader
 
 // C++のifstreamが遅すぎるので、高速化されたテキストファイル読み込み器
@@ -461,6 +461,52 @@ struct FileOperator
 	static Tools::Result WriteMemoryToFile(const std::string& filename, void* ptr, u64 size);
 };
 
+// --------------------
+//  ファイルのメモリマップ
+// --------------------
+
+// ファイルを読み込み専用でメモリにmapする。
+// ReadFileToMemory()と違ってファイルを丸読みしないので、巨大なファイルでもOpen()は一瞬で終わる。
+// また、同じファイルを複数のプロセスでmapした場合、OSのページキャッシュは共有される。
+struct MemoryMappedFile
+{
+	MemoryMappedFile() {}
+	~MemoryMappedFile() { Close(); }
+
+	// 2重にunmapされると困るのでコピーは禁止。
+	MemoryMappedFile(const MemoryMappedFile&) = delete;
+	MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+	// ファイルをopenしてメモリにmapする。
+	// 空のファイルはmapできないので、FileReadErrorを返す。
+	// sequential : 先頭から順番に読むならtrue。OSに先読みさせる。falseならランダムアクセス用。
+	Tools::Result Open(const std::string& filename, bool sequential = false);
+
+	// Open()でmapしたファイルをunmapしてcloseする。
+	void Close();
+
+	// Open()に成功していればtrue
+	bool is_open() const { return ptr != nullptr; }
+
+	// mapされたメモリの先頭アドレス
+	const u8* data() const { return ptr; }
+
+	// mapされたファイルのサイズ[byte]
+	u64 size() const { return file_size; }
+
+private:
+	const u8* ptr = nullptr;
+	u64 file_size = 0;
+
+#if defined(_WIN32)
+	// CreateFile()とCreateFileMapping()のHANDLE。windows.hをincludeしたくないのでvoid*で持つ。
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
 // C#のTextReaderみたいなもの。
 // C++のifstreamが遅すぎるので、高速化されたテキストファイル読み込み器
 // fopen()～fread()で実装されている。
@@ -6,13 +6,19 @@
 #ifdef EVAL_LEARN
 
 #include <atomic>
+#include <cstdio>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <queue>
 #include <random>
 #include <set>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <omp.h>
 
@@ -21,6 +27,9 @@
 #include "learn/learn.h"
 #include "misc.h"
 #include "position.h"
+#include "tanuki_concurrent_book.h"
+#include "tanuki_filesystem.h"
+#include "tanuki_hashed_book.h"
 #include "tanuki_progress_report.h"
 #include "thread.h"
 #include "tt.h"
@@ -28,6 +37,10 @@
 using Book::BookMoveSelector;
 using Book::BookPos;
 using Book::MemoryBook;
+using Tanuki::ConcurrentBook;
+using Tanuki::HashedBook;
+using Tanuki::ProgressReport;
+using Tanuki::ValueMoveDepth;
 using USI::Option;
 
 namespace {
@@ -45,15 +58,49 @@ namespace {
 	constexpr const char* kBookNarrowBook = "NarrowBook";
 	constexpr const char* kBookTargetSfensFile = "BookTargetSfensFile";
 	constexpr int kShowProgressPerAtMostSec = 1 * 60 * 60;	// 1
-	constexpr time_t kSavePerAtMostSec = 6 * 60 * 60;		// 6
 
 	struct SfenAndMove {
 		std::string sfen;
 		Move best_move;
 		Move next_move;
+		// ǖʂՂ̎wǂĂ̎w肪wmB̗D揇ʂɗpB
+		double reach = 0.0;
+		int ply = 0;
 	};
 
-	void WriteBook(Book::MemoryBook& book, const std::string output_book_file_path) {
+	// ǖʂ̎w܂Ƃ߂́B
+	// ǖʂsfensxp[XȂčςނ悤APackedSfenŕێB
+	struct SfenAndMoveGroup {
+		PackedSfen packed_sfen;
+		int ply;
+		std::vector<int> sfen_and_move_indices;
+	};
+
+	// wǖʂƂɂ܂Ƃ߂B
+	// ǖʂ̏́A̋ǖʂ̎ŵłOɂ̂̏ƂB
+	std::vector<SfenAndMoveGroup> GroupSfenAndMovesByPosition(const std::vector<SfenAndMove>& sfen_and_moves) {
+		std::vector<SfenAndMoveGroup> groups;
+		std::unordered_map<std::string, int> sfen_to_group_index;
+		Position& pos = Threads[0]->rootPos;
+		for (int sfen_and_move_index = 0; sfen_and_move_index < static_cast<int>(sfen_and_moves.size()); ++sfen_and_move_index) {
+			const auto& sfen = sfen_and_moves[sfen_and_move_index].sfen;
+			auto it = sfen_to_group_index.find(sfen);
+			if (it == sfen_to_group_index.end()) {
+				StateInfo state_info;
+				pos.set(sfen, &state_info, Threads[0]);
+				SfenAndMoveGroup group;
+				pos.sfen_pack(group.packed_sfen);
+				group.ply = pos.game_ply();
+				it = sfen_to_group_index.emplace(sfen, static_cast<int>(groups.size())).first;
+				groups.push_back(std::move(group));
+			}
+			groups[it->second].sfen_and_move_indices.push_back(sfen_and_move_index);
+		}
+		return groups;
+	}
+
+	// Ճt@CuOɁÃt@C.bakɃl[ĂB
+	void BackupBookFile(const std::string& output_book_file_path) {
 		std::string backup_file_path = output_book_file_path + ".bak";
 
 		if (std::filesystem::exists(backup_file_path)) {
@@ -65,15 +112,368 @@ namespace {
 			sync_cout << "Renaming the output file. output_book_file_path=" << output_book_file_path << " backup_file_path=" << backup_file_path << sync_endl;
 			std::filesystem::rename(output_book_file_path, backup_file_path);
 		}
+	}
+
+	// o̓rŃvZXĂՃt@CȂ悤A
+	// ꎞt@CɏoIĂՃt@CƒuB
+	std::string GetTemporaryBookFilePath(const std::string& output_book_file_path) {
+		return output_book_file_path + ".tmp";
+	}
+
+	void ReplaceBookFile(const std::string& output_book_file_path) {
+		BackupBookFile(output_book_file_path);
+		std::filesystem::rename(GetTemporaryBookFilePath(output_book_file_path), output_book_file_path);
+	}
+
+	// ReplaceBookFile()̓rŃvZXꍇAՃt@C݂Aoς݂̈ꎞt@Ĉ݂cB
+	// ̏ꍇ͈ꎞt@CՃt@CƂB
+	void RecoverBookFile(const std::string& output_book_file_path) {
+		std::string temporary_file_path = GetTemporaryBookFilePath(output_book_file_path);
+		if (!std::filesystem::exists(output_book_file_path) && std::filesystem::exists(temporary_file_path)) {
+			sync_cout << "Recovering the output file. temporary_file_path=" << temporary_file_path << sync_endl;
+			std::filesystem::rename(temporary_file_path, output_book_file_path);
+		}
+	}
 
-		book.write_book(output_book_file_path);
+	void WriteBook(Book::MemoryBook& book, const std::string output_book_file_path) {
+		book.write_book(GetTemporaryBookFilePath(output_book_file_path));
+		ReplaceBookFile(output_book_file_path);
 		sync_cout << "|output_book_file_path|=" << book.get_body()->size() << sync_endl;
 	}
 
+	void WriteBook(HashedBook& book, const std::string output_book_file_path) {
+		book.Write(GetTemporaryBookFilePath(output_book_file_path));
+		ReplaceBookFile(output_book_file_path);
+		sync_cout << "|output_book_file_path|=" << book.Size() << sync_endl;
+	}
+
 	void WriteBook(BookMoveSelector& book, const std::string output_book_file_path) {
 		WriteBook(book.get_body(), output_book_file_path);
 	}
 
+	void ReadBook(MemoryBook& book, const std::string& book_file_path) {
+		book.read_book(book_file_path);
+	}
+
+	void ReadBook(HashedBook& book, const std::string& book_file_path) {
+		book.Read(book_file_path);
+	}
+
+	// Ճf[^x[Xւ̕ύXǋLĂW[iB
+	// ȒՂ莞ԂƂɊۂƏoI/ÕRXg傫̂ŁA
+	// UpsertBookMove()ōXVꂽwՂƓ`ŃW[it@CɒǋLĂA
+	// Ճt@Cւ̔f́AW[iՃt@CƓx̑傫ɂȂƂɂ̂Compact()ōsB
+	// Ճt@C̏oɂI/ÓAW[iɒǋLʂŏpB
+	// W[iɂ͍XV̎ŵ܂܏ôŁAL^xKpĂʂ͕ςȂB
+	// ̂߁ACompact()̓rŃvZXĂAOpen()œKpΕύX͎ȂB
+	//
+	// L^̓XbhƂɐU蕪obt@ɗ߂ĂAʂ܂͈莞ԂƂɂ܂Ƃ߂ďoB
+	// vZXꍇA܂oĂȂL^͎B
+	// Ղ̋ǖʒPʂ̃bN܂܃W[ȉo҂Ȃčςނ悤A
+	// bNĂԂBeginAppend()Œʂԍ邾ɂAAppend()̓bNOĂĂяoB
+	// ̂ߓw̋L^t@CőOシ邱Ƃ邪AReplay()ł͒ʂԍ̈ԑ傫̂KpB
+	class BookJournal {
+	public:
+		// Compact()ĂȂύXȂ悤AfXgN^[ł̓W[i폜ȂB
+		~BookJournal() {
+			if (file_ != nullptr) {
+				Flush();
+				std::fclose(file_);
+			}
+		}
+
+		// Ճt@Cǂݍ݁AÕW[icĂ΂̓eKpĂAW[iǋLpɊJB
+		// BookTypeMemoryBook܂HashedBookƂB
+		template<typename BookType>
+		void Open(BookType& book, const std::string& book_file_path) {
+			book_file_path_ = book_file_path;
+			journal_file_path_ = book_file_path + ".journal";
+
+			RecoverBookFile(book_file_path_);
+			ReadBook(book, book_file_path_);
+			book_file_size_ = GetFileSize(book_file_path_);
+
+			int num_records = Replay(book);
+			if (num_records > 0) {
+				sync_cout << "Replayed the journal file. journal_file_path=" << journal_file_path_
+					<< " num_records=" << num_records << sync_endl;
+			}
+
+			file_ = std::fopen(journal_file_path_.c_str(), "ab");
+			if (file_ == nullptr) {
+				sync_cout << "info string Failed to open the journal file. journal_file_path=" << journal_file_path_ << sync_endl;
+				std::exit(-1);
+			}
+			last_flush_time_sec_ = std::time(nullptr);
+		}
+
+		// L^̒ʂԍB
+		// ՂXVƂ̃bN܂܌ĂяoAbNOĂΉAppend()KĂяoƁB
+		uint64_t BeginAppend() {
+			++num_pending_appends_;
+			return next_sequence_number_++;
+		}
+
+		// w̍XV̓eobt@ɒǋLB
+		// obt@ʂ𒴂邩AȌo莞ԂoĂ΁AW[it@CɏoB
+		void Append(const std::string& sfen, const BookPos& book_pos, uint64_t sequence_number) {
+			std::ostringstream oss;
+			oss << "sfen " << sfen << "\n" << book_pos.bestMove << ' ' << book_pos.nextMove << ' '
+				<< book_pos.value << ' ' << book_pos.depth << ' ' << book_pos.num << ' ' << sequence_number << "\n";
+
+			auto& buffer = buffers_[std::hash<std::thread::id>()(std::this_thread::get_id()) % kNumBuffers];
+			{
+				std::lock_guard<std::mutex> lock(buffer.mutex);
+				buffer.records += oss.str();
+				if (buffer.records.size() >= kFlushBufferSize) {
+					FlushBuffer(buffer);
+				}
+			}
+			--num_pending_appends_;
+
+			if (last_flush_time_sec_ + kFlushPerAtMostSec < std::time(nullptr)) {
+				Flush();
+			}
+		}
+
+		// obt@ɗ܂ĂL^W[it@CɏoB
+		void Flush() {
+			for (auto& buffer : buffers_) {
+				std::lock_guard<std::mutex> lock(buffer.mutex);
+				FlushBuffer(buffer);
+			}
+			last_flush_time_sec_ = std::time(nullptr);
+		}
+
+		// W[iՃt@CƓx̑傫ɂȂACompact()ׂǂԂB
+		// obt@ɗ܂ĂL^͊܂܂ȂB
+		bool NeedsCompaction() {
+			std::lock_guard<std::mutex> lock(file_mutex_);
+			return journal_file_size_ >= std::max(book_file_size_, kMinCompactionSize);
+		}
+
+		// Ճt@CoāAW[iɂB
+		// ̃XbhՂXVȂԂŌĂяoƁB
+		// BeginAppend()Ăяoς݂Append()܂̃Xbh΁AAppend()Î҂B
+		template<typename BookType>
+		void Compact(BookType& book) {
+			while (num_pending_appends_ > 0) {
+				std::this_thread::yield();
+			}
+
+			// Ճt@C̏oɃvZXĂW[i畜ł悤AɑSďoĂB
+			Flush();
+			WriteBook(book, book_file_path_);
+
+			std::lock_guard<std::mutex> lock(file_mutex_);
+			std::fclose(file_);
+			file_ = std::fopen(journal_file_path_.c_str(), "wb");
+			if (file_ == nullptr) {
+				sync_cout << "info string Failed to open the journal file. journal_file_path=" << journal_file_path_ << sync_endl;
+				std::exit(-1);
+			}
+			book_file_size_ = GetFileSize(book_file_path_);
+			journal_file_size_ = 0;
+		}
+
+		// W[ič폜B
+		// ύXȂ悤ACompact()ĂяoĂĂяoƁB
+		void Close() {
+			if (file_ == nullptr) {
+				return;
+			}
+
+			std::fclose(file_);
+			file_ = nullptr;
+			std::filesystem::remove(journal_file_path_);
+		}
+
+	private:
+		// L^𗭂߂Ăobt@
+		// ̃XbhǋLƂɃbN̎荇ɂȂȂ悤AXbhƂɐU蕪B
+		struct Buffer {
+			std::mutex mutex;
+			std::string records;
+		};
+
+		// obt@̐
+		static constexpr size_t kNumBuffers = 64;
+		// ЂƂ̃obt@ɂ̑傫ȏ㗭߂珑oB
+		static constexpr size_t kFlushBufferSize = 64 << 10;
+		// Ȍo炱̎ԈȏoĂ珑oB
+		static constexpr time_t kFlushPerAtMostSec = 60;
+		// Ճt@CƂɁACompact()pɂɋNȂ悤ɂ邽߂̉
+		static constexpr uint64_t kMinCompactionSize = UINT64_C(64) << 20;
+
+		static uint64_t GetFileSize(const std::string& file_path) {
+			std::error_code error_code;
+			auto file_size = std::filesystem::file_size(file_path, error_code);
+			return error_code ? 0 : static_cast<uint64_t>(file_size);
+		}
+
+		// buffer.mutexԂŌĂяoƁB
+		void FlushBuffer(Buffer& buffer) {
+			if (buffer.records.empty()) {
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(file_mutex_);
+			std::fwrite(buffer.records.data(), 1, buffer.records.size(), file_);
+			std::fflush(file_);
+			journal_file_size_ += buffer.records.size();
+			buffer.records.clear();
+		}
+
+		// W[it@C̓eՂɓKpAKpL^̐ԂB
+		// w̋L^ꍇ́Aʂԍ̈ԑ傫̂KpB
+		// Kpǖʂ̎ẃȂ񐔂ŕבւč̑mvZB
+		template<typename BookType>
+		int Replay(BookType& book) {
+			std::ifstream ifs(journal_file_path_, std::ios::binary);
+			if (!ifs) {
+				return 0;
+			}
+
+			struct Record {
+				BookPos book_pos;
+				uint64_t sequence_number;
+			};
+
+			int num_records = 0;
+			std::string sfen;
+			std::string line;
+			std::unordered_map<std::string, std::vector<Record>> records;
+			// Ō܂ŏ܂ꂽL^̖̈ʒu
+			std::streamoff valid_size = 0;
+			while (std::getline(ifs, line)) {
+				if (ifs.eof()) {
+					// sŏIĂȂŌ̍śA݂̓rŃvZX̂Ȃ̂Ŏ̂ĂB
+					break;
+				}
+
+				if (line.compare(0, 5, "sfen ") == 0) {
+					sfen = line.substr(5);
+					continue;
+				}
+
+				LineScanner scanner(line);
+				std::string best_move = scanner.get_text();
+				std::string next_move = scanner.get_text();
+				int value = static_cast<int>(scanner.get_number(0));
+				int depth = static_cast<int>(scanner.get_number(0));
+				uint64_t num = static_cast<uint64_t>(scanner.get_number(1));
+				uint64_t sequence_number = static_cast<uint64_t>(scanner.get_number(0));
+				Record record = { BookPos(ToMove16(best_move), ToMove16(next_move), value, depth, num), sequence_number };
+
+				auto& sfen_records = records[sfen];
+				auto it = std::find_if(sfen_records.begin(), sfen_records.end(),
+					[&record](const Record& rhs) { return rhs.book_pos == record.book_pos; });
+				if (it == sfen_records.end()) {
+					sfen_records.push_back(record);
+				}
+				else if (it->sequence_number <= record.sequence_number) {
+					*it = record;
+				}
+
+				next_sequence_number_ = std::max<uint64_t>(next_sequence_number_, sequence_number + 1);
+				++num_records;
+				valid_size = ifs.tellg();
+			}
+			ifs.close();
+
+			for (const auto& sfen_records : records) {
+				for (const auto& record : sfen_records.second) {
+					Apply(book, sfen_records.first, record.book_pos);
+				}
+				UpdateProbabilities(book, sfen_records.first);
+			}
+
+			// ݂̓rŐ؂ꂽL^̌ɒǋLȂ悤A؂l߂ĂB
+			std::filesystem::resize_file(journal_file_path_, valid_size);
+			journal_file_size_ = valid_size;
+
+			return num_records;
+		}
+
+		// ̑񐔂Zɂ̂܂܏㏑B
+		static void Apply(MemoryBook& book, const std::string& sfen, const BookPos& book_pos) {
+			auto& move_list = (*book.get_body())[sfen];
+			if (!move_list) {
+				move_list = std::make_shared<Book::PosMoveList>();
+			}
+			auto it = std::find(move_list->begin(), move_list->end(), book_pos);
+			if (it != move_list->end()) {
+				*it = book_pos;
+			}
+			else {
+				move_list->push_back(book_pos);
+			}
+		}
+
+		static void Apply(HashedBook& book, const std::string& sfen, const BookPos& book_pos) {
+			Position pos;
+			StateInfo state_info = {};
+			pos.set(sfen, &state_info, Threads.main());
+			auto moves = book.Find(pos);
+			auto it = std::find(moves.begin(), moves.end(), book_pos);
+			if (it != moves.end()) {
+				*it = book_pos;
+			}
+			else {
+				book.Upsert(pos, book_pos, false);
+			}
+		}
+
+		// MemoryBook::read_book()ƓAw̑񐔂ŕבւč̑mvZB
+		template<typename Iterator>
+		static void UpdateProbabilities(Iterator begin, Iterator end) {
+			std::stable_sort(begin, end);
+			uint64_t num_sum = 0;
+			for (auto it = begin; it != end; ++it) {
+				num_sum += it->num;
+			}
+			num_sum = std::max(num_sum, UINT64_C(1)); // [Z΍
+			for (auto it = begin; it != end; ++it) {
+				it->prob = static_cast<float>(it->num) / num_sum;
+			}
+		}
+
+		static void UpdateProbabilities(MemoryBook& book, const std::string& sfen) {
+			auto& move_list = *(*book.get_body())[sfen];
+			UpdateProbabilities(move_list.begin(), move_list.end());
+		}
+
+		static void UpdateProbabilities(HashedBook& book, const std::string& sfen) {
+			Position pos;
+			StateInfo state_info = {};
+			pos.set(sfen, &state_info, Threads.main());
+			auto moves = book.Find(pos);
+			UpdateProbabilities(moves.begin(), moves.end());
+		}
+
+		static Move16 ToMove16(const std::string& move) {
+			if (move == "none" || move == "resign") {
+				return MOVE_NONE;
+			}
+			return USI::to_move16(move);
+		}
+
+		std::string book_file_path_;
+		std::string journal_file_path_;
+		// file_Abook_file_size_Ajournal_file_size_file_mutex_Ă瑀삷B
+		FILE* file_ = nullptr;
+		std::mutex file_mutex_;
+		// ܂W[it@CɏoĂȂL^
+		Buffer buffers_[kNumBuffers];
+		std::atomic<time_t> last_flush_time_sec_ = 0;
+		std::atomic<uint64_t> next_sequence_number_ = 0;
+		// BeginAppend()Ăяoς݂ŁAAppend()܂IĂȂL^̐
+		std::atomic<int> num_pending_appends_ = 0;
+		// ŌCompact()Ƃ̒Ճt@C̑傫ƁAȍ~ɃW[it@Cɏo傫
+		uint64_t book_file_size_ = 0;
+		uint64_t journal_file_size_ = 0;
+	};
+
 	std::mutex UPSERT_BOOK_MOVE_MUTEX;
 
 	/// <summary>
@@ -96,6 +496,216 @@ namespace {
 		// MemoryBook::insert()ɏڏB
 		book.insert(sfen, BookPos(Move16(best_move), Move16(next_move), value, depth, num));
 	}
+
+	// Ճf[^x[XɎwo^AXV̎wW[iɒǋLB
+	// IȃbN͎炸AǖʂV[h̃bN݂̂B
+	// V[h̃bNĂԂ́AXV̎w̃Rs[ƋL^̒ʂԍ̎擾݂̂sA
+	// W[iւ̒ǋL̓bNOĂsB
+	void UpsertBookMove(ConcurrentBook& book, BookJournal& journal, const std::string& sfen, Move best_move, Move next_move, int value, int depth, uint64_t num)
+	{
+		BookPos upserted_book_pos(Move16(best_move), Move16(next_move), value, depth, num);
+		uint64_t sequence_number = 0;
+		book.Upsert(sfen, upserted_book_pos, true,
+			[&journal, &upserted_book_pos, &sequence_number](const BookPos& upserted) {
+				upserted_book_pos = upserted;
+				sequence_number = journal.BeginAppend();
+			});
+		journal.Append(sfen, upserted_book_pos, sequence_number);
+	}
+
+	// ǂݎpŋLĂHashedBookɑ΂XVÃXbhConcurrentBookɓo^A
+	// XV̎wW[iɒǋLBW[iɂHashedBookɓo^ς݂̍̑񐔂𑫂̂L^B
+	// IȃbN͎炸AǖʂV[h̃bN݂̂B
+	// ConcurrentBook̓éASẴXbh̓o^IMergeUpsertedMoves()HashedBookɔf邱ƁB
+	// pos͎wwŐǖʂnƁB
+	void UpsertBookMove(ConcurrentBook& book, HashedBook& base_book, BookJournal& journal, Position& pos, Move best_move, Move next_move, int value, int depth, uint64_t num)
+	{
+		std::string sfen = pos.sfen();
+		HashedBook::Moves base_moves;
+		size_t base_index = base_book.FindIndex(pos);
+		if (base_index != base_book.NumEntries()) {
+			// HashedBook͎萔Ⴂ̓ǖʂʂȂ̂ŁAHashedBookɓo^Ă萔̋ǖʂƂēo^B
+			sfen = StringExtension::trim_number(sfen) + " " + std::to_string(base_book.GetEntry(base_index).ply);
+			base_moves = base_book.GetMoves(base_index);
+		}
+
+		BookPos upserted_book_pos(Move16(best_move), Move16(next_move), value, depth, num);
+		uint64_t sequence_number = 0;
+		book.Upsert(sfen, upserted_book_pos, true,
+			[&journal, &upserted_book_pos, &sequence_number](const BookPos& upserted) {
+				upserted_book_pos = upserted;
+				sequence_number = journal.BeginAppend();
+			});
+
+		auto it = std::find(base_moves.begin(), base_moves.end(), upserted_book_pos);
+		if (it != base_moves.end()) {
+			upserted_book_pos.num += it->num;
+		}
+		journal.Append(sfen, upserted_book_pos, sequence_number);
+	}
+
+	// UpsertBookMove()ConcurrentBookɓo^wHashedBookɔfAConcurrentBook菜B
+	void MergeUpsertedMoves(MemoryBook& upserted_book, HashedBook& book) {
+		Position pos;
+		StateInfo state_info = {};
+		for (const auto& sfen_and_moves : *upserted_book.get_body()) {
+			pos.set(sfen_and_moves.first, &state_info, Threads.main());
+			for (const auto& book_pos : *sfen_and_moves.second) {
+				// ̑񐔂͉ZAȊO͏㏑B
+				book.Upsert(pos, book_pos, true);
+			}
+		}
+		upserted_book.get_body()->clear();
+	}
+
+	// ǖʂɓo^ĂwԂBo^ĂȂꍇ͋̃XgԂB
+	std::vector<BookPos> GetBookMoves(MemoryBook& book, const Position& pos) {
+		auto pos_move_list = book.find(pos);
+		if (!pos_move_list) {
+			return {};
+		}
+		return *pos_move_list;
+	}
+
+	std::vector<BookPos> GetBookMoves(HashedBook& book, const Position& pos) {
+		auto moves = book.Find(pos);
+		return std::vector<BookPos>(moves.begin(), moves.end());
+	}
+
+	// Ղ̎w̑񐔂ɔႵđIԂƂƂɁAmoveI΂mԂB
+	// ̑񐔂S0̏ꍇ͓mőIԂ̂ƂBo^ĂȂw̏ꍇ0ԂB
+	double GetBookMoveProbability(const std::vector<BookPos>& book_moves, Move16 move) {
+		uint64_t num_sum = 0;
+		uint64_t num = 0;
+		bool found = false;
+		for (const auto& book_move : book_moves) {
+			num_sum += book_move.num;
+			if (book_move.bestMove == move) {
+				num = book_move.num;
+				found = true;
+			}
+		}
+
+		if (!found) {
+			return 0.0;
+		}
+
+		if (num_sum == 0) {
+			return 1.0 / book_moves.size();
+		}
+
+		return static_cast<double>(num) / num_sum;
+	}
+
+	// ǖʂՂ̎wǂƂɁAeǖʂɓBmςB
+	// Ȃǂ̕HƌoH̊m̘a܂Ȃ߁Ałm̍oH̊mőpB
+	// m̍ǖʂ珇Ɋm肳ŗǗDTŋ߂B
+	// Ղɓo^ĂȂǖʂAՂ̎wœBłꍇ͊܂܂B
+	template<typename BookType>
+	std::unordered_map<Key, double> CalculateBookReach(BookType& book) {
+		struct QueueItem {
+			double reach;
+			PackedSfen packed_sfen;
+			int ply;
+
+			bool operator<(const QueueItem& rhs) const {
+				return reach < rhs.reach;
+			}
+		};
+
+		Thread& thread = *Threads[0];
+		Position& pos = thread.rootPos;
+		StateInfo state_info = {};
+		StateInfo child_state_info = {};
+		pos.set_hirate(&state_info, &thread);
+
+		std::unordered_map<Key, double> reaches;
+		std::unordered_set<Key> expanded;
+		std::priority_queue<QueueItem> queue;
+
+		QueueItem root = { 1.0, {}, pos.game_ply() };
+		pos.sfen_pack(root.packed_sfen);
+		reaches[pos.key()] = root.reach;
+		queue.push(root);
+
+		while (!queue.empty()) {
+			QueueItem item = queue.top();
+			queue.pop();
+
+			pos.set_from_packed_sfen(item.packed_sfen, &state_info, &thread, false, item.ply);
+			if (!expanded.insert(pos.key()).second) {
+				// m̍oHŊmς݂̋ǖ
+				continue;
+			}
+
+			auto book_moves = GetBookMoves(book, pos);
+			for (const auto& book_move : book_moves) {
+				Move move = pos.to_move(book_move.bestMove);
+				if (!pos.pseudo_legal(move) || !pos.legal(move)) {
+					continue;
+				}
+
+				double reach = item.reach * GetBookMoveProbability(book_moves, book_move.bestMove);
+				pos.do_move(move, child_state_info);
+				auto& child_reach = reaches[pos.key()];
+				if (child_reach < reach) {
+					child_reach = reach;
+					QueueItem child = { reach, {}, item.ply + 1 };
+					pos.sfen_pack(child.packed_sfen);
+					queue.push(child);
+				}
+				pos.undo_move(move);
+			}
+		}
+
+		return reaches;
+	}
+
+	// Ώۂ̋ǖʂAǖʂՂ̎wœBm̍ɕבւB
+	// rŏł؂ĂAŌ₷ǖʂ珇ɒՂɓo^Ă悤ɂ邽߁B
+	// mǖʓm͌̏ۂB
+	template<typename BookType>
+	void SortTargetPositionsByReach(BookType& book, std::vector<std::vector<Move16>>& target_positions) {
+		auto reaches = CalculateBookReach(book);
+
+		Thread& thread = *Threads[0];
+		Position& pos = thread.rootPos;
+		std::vector<std::pair<double, size_t>> order;
+		order.reserve(target_positions.size());
+		int num_reachable_positions = 0;
+		for (size_t index = 0; index < target_positions.size(); ++index) {
+			const auto& moves = target_positions[index];
+			std::vector<StateInfo> state_info(moves.size() + 1);
+			pos.set_hirate(&state_info[0], &thread);
+			for (size_t ply = 0; ply < moves.size(); ++ply) {
+				pos.do_move(pos.to_move(moves[ply]), state_info[ply + 1]);
+			}
+
+			double reach = 0.0;
+			auto it = reaches.find(pos.key());
+			if (it != reaches.end()) {
+				reach = it->second;
+			}
+			if (reach > 0.0) {
+				++num_reachable_positions;
+			}
+			order.emplace_back(reach, index);
+		}
+
+		std::stable_sort(order.begin(), order.end(), [](const auto& lhs, const auto& rhs) {
+			return lhs.first > rhs.first;
+		});
+
+		std::vector<std::vector<Move16>> sorted_target_positions;
+		sorted_target_positions.reserve(target_positions.size());
+		for (const auto& reach_and_index : order) {
+			sorted_target_positions.push_back(std::move(target_positions[reach_and_index.second]));
+		}
+		target_positions.swap(sorted_target_positions);
+
+		sync_cout << "Sorted target positions by reach. |target_positions|=" << target_positions.size()
+			<< " num_reachable_positions=" << num_reachable_positions << sync_endl;
+	}
 }
 
 bool Tanuki::InitializeBook(USI::OptionsMap& o) {
@@ -202,9 +812,10 @@ bool Tanuki::CreateScoredBook() {
 	sync_cout << "|input_book|=" << input_book.get_body()->size() << sync_endl;
 
 	MemoryBook output_book;
+	BookJournal output_book_journal;
 	output_book_file = "book/" + output_book_file;
 	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
-	output_book.read_book(output_book_file);
+	output_book_journal.Open(output_book, output_book_file);
 	sync_cout << "done..." << sync_endl;
 	sync_cout << "|output_book|=" << output_book.get_body()->size() << sync_endl;
 
@@ -225,7 +836,10 @@ bool Tanuki::CreateScoredBook() {
 	std::atomic_int global_position_index;
 	global_position_index = 0;
 	ProgressReport progress_report(num_sfens, kShowProgressPerAtMostSec);
-	time_t last_save_time_sec = std::time(nullptr);
+
+	// ̃XbhǖʒPʂ̃bNŏ߂悤AV[hՂɈڂB
+	ConcurrentBook concurrent_output_book;
+	concurrent_output_book.MoveFrom(output_book);
 
 	std::atomic<bool> need_wait = false;
 	std::atomic_int global_pos_index;
@@ -263,7 +877,7 @@ bool Tanuki::CreateScoredBook() {
 					next = root_move.pv[1];
 				}
 				int value = root_move.score;
-				UpsertBookMove(output_book, sfen, best, next, value, thread.completedDepth, 1);
+				UpsertBookMove(concurrent_output_book, output_book_journal, sfen, best, next, value, thread.completedDepth, 1);
 			}
 
 			int num_processed_positions = ++global_num_processed_positions;
@@ -273,13 +887,11 @@ bool Tanuki::CreateScoredBook() {
 				// i󋵂\
 				progress_report.Show(num_processed_positions);
 
-				// 莞ԂƂɕۑ
-				{
-					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-						WriteBook(output_book, output_book_file);
-						last_save_time_sec = std::time(nullptr);
-					}
+				// W[i傫ȂՃt@Cɔf
+				if (output_book_journal.NeedsCompaction()) {
+					concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+						output_book_journal.Compact(book);
+					});
 				}
 			}
 
@@ -310,7 +922,10 @@ bool Tanuki::CreateScoredBook() {
 		}
 	}
 
-	WriteBook(output_book, output_book_file);
+	concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+		output_book_journal.Compact(book);
+	});
+	output_book_journal.Close();
 
 	return true;
 }
@@ -409,14 +1024,20 @@ bool Tanuki::SetScoreToMove() {
 	sync_cout << "|input_book|=" << input_book.get_body()->size() << sync_endl;
 
 	MemoryBook output_book;
+	BookJournal output_book_journal;
 	output_book_file = "book/" + output_book_file;
 	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
-	output_book.read_book(output_book_file);
+	output_book_journal.Open(output_book, output_book_file);
 	sync_cout << "done..." << sync_endl;
 	sync_cout << "|output_book|=" << output_book.get_body()->size() << sync_endl;
 
 	std::vector<SfenAndMove> sfen_and_moves;
 
+	sync_cout << "Calculating book reach..." << sync_endl;
+	auto reaches = CalculateBookReach(input_book);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|reaches|=" << reaches.size() << sync_endl;
+
 	// ̋ǖʂL[ɓo^
 	for (const auto& input_sfen_and_pos_move_list : *input_book.get_body()) {
 		const auto& input_sfen = input_sfen_and_pos_move_list.first;
@@ -425,6 +1046,16 @@ bool Tanuki::SetScoreToMove() {
 		StateInfo state_info;
 		position.set(input_sfen, &state_info, Threads[0]);
 
+		double position_reach = 0.0;
+		auto reach_it = reaches.find(position.key());
+		if (reach_it != reaches.end()) {
+			position_reach = reach_it->second;
+		}
+		const auto& input_book_moves = *input_sfen_and_pos_move_list.second;
+		auto get_move_reach = [&](const BookPos& book_move) {
+			return position_reach * GetBookMoveProbability(input_book_moves, book_move.bestMove);
+		};
+
 		auto output_book_moves_it = output_book.get_body()->find(input_sfen);
 		if (output_book_moves_it == output_book.get_body()->end()) {
 			// o͒Ճf[^x[Xɋǖʂo^ĂȂꍇ
@@ -432,7 +1063,9 @@ bool Tanuki::SetScoreToMove() {
 				sfen_and_moves.push_back({
 					input_sfen,
 					position.to_move(input_book_move.bestMove),
-					position.to_move(input_book_move.nextMove)
+					position.to_move(input_book_move.nextMove),
+					get_move_reach(input_book_move),
+					position.game_ply()
 					});
 			}
 			continue;
@@ -451,22 +1084,41 @@ bool Tanuki::SetScoreToMove() {
 			sfen_and_moves.push_back({
 				input_sfen,
 				position.to_move(input_book_move.bestMove),
-				position.to_move(input_book_move.nextMove)
+				position.to_move(input_book_move.nextMove),
+				get_move_reach(input_book_move),
+				position.game_ply()
 				});
 		}
 	}
 	int num_sfen_and_moves = sfen_and_moves.size();
 	sync_cout << "Number of the moves to be processed: " << num_sfen_and_moves << sync_endl;
 
+	// rŏł؂ĂŌ₷w肩珇ɕ]ltĂ悤A
+	// Bm̍ɏBBmꍇ͎萔̐󂢏ƂB
+	std::stable_sort(sfen_and_moves.begin(), sfen_and_moves.end(),
+		[](const SfenAndMove& lhs, const SfenAndMove& rhs) {
+			if (lhs.reach != rhs.reach) {
+				return lhs.reach > rhs.reach;
+			}
+			return lhs.ply < rhs.ply;
+		});
+
+	// ǖʂ̎w𓯂XbhőĒTAXbhƂ̒u\ɎcTʂėpł悤A
+	// ǖʂƂɂ܂Ƃ߂ĊeXbhɊ蓖ĂB
+	auto sfen_and_move_groups = GroupSfenAndMovesByPosition(sfen_and_moves);
+	int num_sfen_and_move_groups = sfen_and_move_groups.size();
+	sync_cout << "Number of the positions to be processed: " << num_sfen_and_move_groups << sync_endl;
+
 	// }`Xbĥ߁ACfbNX
-	std::atomic_int global_sfen_and_move_index;
-	global_sfen_and_move_index = 0;
+	std::atomic_int global_sfen_and_move_group_index;
+	global_sfen_and_move_group_index = 0;
 
 	// i󋵕\̏
 	ProgressReport progress_report(num_sfen_and_moves, kShowProgressPerAtMostSec);
 
-	// ՂIɕۑ邽߂̕ϐ
-	time_t last_save_time_sec = std::time(nullptr);
+	// ̃XbhǖʒPʂ̃bNŏ߂悤AV[hՂɈڂB
+	ConcurrentBook concurrent_output_book;
+	concurrent_output_book.MoveFrom(output_book);
 
 	// Apery}`Xbh
 	std::atomic<bool> need_wait = false;
@@ -477,61 +1129,70 @@ bool Tanuki::SetScoreToMove() {
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
 
-		for (int position_index = global_sfen_and_move_index++; position_index < num_sfen_and_moves;
-			position_index = global_sfen_and_move_index++) {
-			const auto& sfen_and_move = sfen_and_moves[position_index];
-			const auto& sfen = sfen_and_move.sfen;
+		for (int group_index = global_sfen_and_move_group_index++; group_index < num_sfen_and_move_groups;
+			group_index = global_sfen_and_move_group_index++) {
+			const auto& sfen_and_move_group = sfen_and_move_groups[group_index];
 			Thread& thread = *Threads[thread_index];
 			StateInfo state_info = {};
 			Position& pos = thread.rootPos;
-			pos.set(sfen, &state_info, &thread);
-			Move best_move = sfen_and_move.best_move;
-			Move next_move = MOVE_NONE;
+			pos.set_from_packed_sfen(sfen_and_move_group.packed_sfen, &state_info, &thread, false, sfen_and_move_group.ply);
 
 			if (pos.is_mated()) {
 				continue;
 			}
 
-			if (!pos.pseudo_legal(best_move) || !pos.legal(best_move)) {
-				sync_cout << "Illegal move. sfen=" << sfen << " best_move=" <<
-					USI::move(best_move) << " next_move=" << USI::move(next_move) << sync_endl;
-				continue;
-			}
+			for (int sfen_and_move_index : sfen_and_move_group.sfen_and_move_indices) {
+				const auto& sfen_and_move = sfen_and_moves[sfen_and_move_index];
+				const auto& sfen = sfen_and_move.sfen;
+				Move best_move = sfen_and_move.best_move;
+				Move next_move = MOVE_NONE;
 
-			StateInfo state_info0;
-			pos.do_move(best_move, state_info0);
-			Eval::evaluate_with_no_return(pos);
+				if (!pos.pseudo_legal(best_move) || !pos.legal(best_move)) {
+					sync_cout << "Illegal move. sfen=" << sfen << " best_move=" <<
+						USI::move(best_move) << " next_move=" << USI::move(next_move) << sync_endl;
+					continue;
+				}
 
-			// ̋ǖʂɂĒT
-			auto value_and_pv = Learner::search(pos, search_depth, 1, search_nodes);
+				StateInfo state_info0;
+				pos.do_move(best_move, state_info0);
+				Eval::evaluate_with_no_return(pos);
 
-			// ЂƂŐǖʂ猩]lKv̂ŁA𔽓]B
-			Value value = -value_and_pv.first;
+				// ̋ǖʂɂĒT
+				auto value_and_pv = Learner::search(pos, search_depth, 1, search_nodes);
 
-			auto pv = value_and_pv.second;
-			if (next_move == MOVE_NONE && pv.size() >= 1) {
-				// Ղ̎w̋ǖʂȂ̂ŁAnextMoveɂpv[0]B
-				// AƂnextMoveݒ肳ĂꍇAD悷B
-				next_move = pv[0];
-			}
+				// ЂƂŐǖʂ猩]lKv̂ŁA𔽓]B
+				Value value = -value_and_pv.first;
+
+				auto pv = value_and_pv.second;
+				if (next_move == MOVE_NONE && pv.size() >= 1) {
+					// Ղ̎w̋ǖʂȂ̂ŁAnextMoveɂpv[0]B
+					// AƂnextMoveݒ肳ĂꍇAD悷B
+					next_move = pv[0];
+				}
 
-			Depth depth = pos.this_thread()->completedDepth;
+				Depth depth = thread.completedDepth;
 
-			// wo͐̒Ղɓo^
-			UpsertBookMove(output_book, sfen, best_move, next_move, value, depth, 1);
+				// ǖʂ̎̎ŵ߁A̋ǖʂɖ߂ĂB
+				pos.undo_move(best_move);
 
-			int num_processed_positions = ++global_num_processed_positions;
+				// wo͐̒Ղɓo^
+				UpsertBookMove(concurrent_output_book, output_book_journal, sfen, best_move, next_move, value, depth, 1);
+
+				++global_num_processed_positions;
+			}
+
+			int num_processed_positions = global_num_processed_positions;
 			// Ô߁AI/O̓}X^[Xbhł̂ݍs
 #pragma omp master
 			{
 				// i󋵂\
 				progress_report.Show(num_processed_positions);
 
-				// ՂXg[WɏoB
-				if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					WriteBook(output_book, output_book_file);
-					last_save_time_sec = std::time(nullptr);
+				// W[i傫ȂՃt@CɔfB
+				if (output_book_journal.NeedsCompaction()) {
+					concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+						output_book_journal.Compact(book);
+					});
 				}
 			}
 
@@ -562,191 +1223,408 @@ bool Tanuki::SetScoreToMove() {
 		}
 	}
 
-	WriteBook(output_book, output_book_file);
+	concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+		output_book_journal.Compact(book);
+	});
+	output_book_journal.Close();
 
 	return true;
 }
 
 namespace {
-	struct ValueMoveDepth {
-		// ]l
-		Value value = VALUE_NONE;
-		// ̋ǖʂɂw
-		// Ղ̎wɑ΂鉞Ճf[^x[Xɓo^邽߁AwԂ悤ɂĂ
-		Move move = MOVE_NONE;
-		// T[
-		Depth depth = DEPTH_NONE;
+	// Ճf[^x[X̋ǖʂ̎
+	enum class BookNodeType : uint8_t {
+		// qǖʂ̕]l]l߂ǖ
+		Inner,
+		// lłǖ
+		Mated,
+		// 錾łǖ
+		DeclarationWin,
+		// ŏɂǂ蒅oH̋ǖʂɑ΂Dǖ
+		RepetitionSuperior,
+		// ŏɂǂ蒅oH̋ǖʂɑ΂򓙋ǖ
+		RepetitionInferior,
 	};
 
-	// (sfen, ValueAndDepth)
-	// ˂牤{Ƃł͎萔̕폜Ă邪A
-	// eՂɂ邽ߎ萔܂߂Ċi[B
-	// {ł΂ɂ镛pnlKv邪A
-	// 悭Ȃ̂œKɎB
-	std::unordered_map<std::string, ValueMoveDepth> memo;
-
-	// IgnoreBookPlyIvVtruȅꍇA
-	// ^ꂽsfen񂩂ply菜
-	std::string RemovePlyIfIgnoreBookPly(const std::string& sfen) {
-		if (Options["IgnoreBookPly"]) {
-			return StringExtension::trim_number(sfen);
-		}
-		else {
-			return sfen;
-		}
-	}
-
-	// Nega-Max@Ŗ[ǖʂ̕]lrootǖʂɌē`
-	// book Ճf[^x[X
-	// pos ݂̋ǖ
-	// value_and_depth_without_nega_max_parent SetScoreToMove()Őݒ肵]lƒT[
-	//                                         ǖʂ猩]lɂȂ悤A𔽓]Ăn
-	ValueMoveDepth NegaMax(MemoryBook& book, Position& pos, int& counter) {
-		if (++counter % 1000000 == 0) {
-			sync_cout << counter << " |memo|=" << memo.size() << sync_endl;
-		}
-
-		// ̋ǖʂɑ΂ẴL[ƂĎgpsfenB
-		// KvɉĖply菜ĂB
-		std::string sfen = RemovePlyIfIgnoreBookPly(pos.sfen());
-
-		// NegaMax()͒Ճf[^x[Xɓo^ĂǖʂɂĂ̂ݏsB
-		ASSERT_LV3(book.get_body()->count(sfen));
+	// Ճf[^x[X̋ǖʂAՃf[^x[Xɓo^Ăqǖʂւ̎w
+	struct BookEdge {
+		// qǖʂHashedBook̓Y
+		uint32_t child;
+		Move16 move;
+		// [DŤoH̋ǖʂɖ߂w̏ꍇAqǖʂPosition::is_repetition()̌
+		// ȊȌꍇREPETITION_NONEƂAqǖʂ̕]lpB
+		RepetitionState repetition;
+	};
 
-		auto& vmd = memo[sfen];
-		if (vmd.depth != DEPTH_NONE) {
-			// LbVɃqbgꍇA̒lԂB
-			return vmd;
-		}
+	// [DŤoH̋ǖ
+	struct BookSearchFrame {
+		uint32_t node;
+		// ɒׂwedges̓Y
+		uint64_t edge_index;
+		// ̋ǖʂɎw
+		Move move;
+	};
+}
 
-		if (pos.is_mated()) {
-			// lłꍇ
-			vmd.value = mated_in(0);
-			vmd.depth = 0;
-			return vmd;
-		}
+// EDǖʁE򓙋ǖʂ́A̋ǖʂ̎ԑ猩]lԂB
+Tanuki::ValueMoveDepth Tanuki::GetRepetitionValue(RepetitionState repetition) {
+	ValueMoveDepth vmd;
+	vmd.depth = 0;
+	switch (repetition) {
+	case REPETITION_WIN:
+		// A̐ɂ菟̏ꍇ
+		vmd.value = mate_in(MAX_PLY);
+		break;
+
+	case REPETITION_LOSE:
+		// A̐ɂ蕉̏ꍇ
+		vmd.value = mated_in(MAX_PLY);
+		break;
+
+	case REPETITION_SUPERIOR:
+		// Dǖʂ̏ꍇ
+		vmd.value = VALUE_SUPERIOR;
+		break;
+
+	case REPETITION_INFERIOR:
+		// 򓙋ǖʂ̏ꍇ
+		vmd.value = -VALUE_SUPERIOR;
+		break;
+
+	default:
+		// ̏ꍇ
+		// ˂牤ł͐ɕʁX̕]ltĂB
+		// ł͊ȒP̂߁A]ltB
+		vmd.value = static_cast<Value>(Options["Contempt"] * Eval::PawnValue / 100);
+		break;
+	}
+	return vmd;
+}
 
-		if (pos.DeclarationWin() != MOVE_NONE) {
-			// 錾łꍇ
-			vmd.value = mate_in(1);
-			vmd.depth = 0;
-			return vmd;
-		}
+// [DŤoH̋ǖʂɖ߂Ƃ̐̎ނԂB
+// oH̋ǖʂ͕K悤APosition::is_repetition()ŌoH̐擪܂őkB
+RepetitionState Tanuki::GetRepetitionOnPath(const Position& pos) {
+	RepetitionState repetition = pos.is_repetition(std::numeric_limits<int>::max());
+	return repetition == REPETITION_NONE ? REPETITION_DRAW : repetition;
+}
 
-		auto repetition_state = pos.is_repetition();
-		switch (repetition_state) {
-		case REPETITION_WIN:
-			// A̐ɂ菟̏ꍇ
-			vmd.value = mate_in(MAX_PLY);
-			vmd.depth = 0;
-			return vmd;
+// Nega-Max@Ŗ[ǖʂ̕]lrootǖʂɌē`
+// ċAĂяopAȉ̎菇ŏB
+// 1. SĂ̋ǖʂɂāAՃf[^x[Xɓo^Ăqǖʂւ̎w񋓂B()
+// 2. ǖʁAĎc̋ǖʂ[DTsAŤoH̋ǖʂɖ߂wƂB
+//    ܂A߂Ăǂ蒅ǖʂoH̋ǖʂɑ΂DǖʁE򓙋ǖʂł΁Aqǖʂ𒲂ׂȂ[ǖʂƂB
+//    ƂȂwƕHȂȂ̂ŁAA肪Ɋeǖʂ̍([ǖʂ܂ł̍Œ̎萔)߂B
+// 3. qǖʂւ̎wȂ0ƂĒՃf[^x[Xɓo^ĂB
+//    4.̓rŎw̔z񂪍ĊmۂȂ悤ɂ邽߁B
+// 4. ̒Ⴂǖʂ珇ɁA̋ǖʂɏAqǖʂ̕]lwɊi[āAǖʂ̕]l߂B
+// ǖʂċAIɏꍇ(test propagateR}h̎QƎ)ƓʂƂȂB
+void Tanuki::PropagateLeafNodeValues(HashedBook& book) {
+	int num_threads = std::max(1, std::min(static_cast<int>(Options[kThreads]), static_cast<int>(Threads.size())));
+	omp_set_num_threads(num_threads);
 
-		case REPETITION_LOSE:
-			// A̐ɂ蕉̏ꍇ
-			vmd.value = mated_in(MAX_PLY);
-			vmd.depth = 0;
-			return vmd;
+	const size_t num_entries = book.NumEntries();
+	std::vector<BookNodeType> node_types(num_entries, BookNodeType::Inner);
 
-		case REPETITION_DRAW:
-			// ̏ꍇ
-			// ˂牤ł͐ɕʁX̕]ltĂB
-			// ł͊ȒP̂߁A]ltB
-			vmd.value = static_cast<Value>(Options["Contempt"] * Eval::PawnValue / 100);
-			vmd.depth = 0;
-			return vmd;
+	// 1. qǖʂւ̎w񋓂B
+	sync_cout << "Enumerating child positions..." << sync_endl;
+	struct ParentAndEdge {
+		uint32_t parent;
+		BookEdge edge;
+	};
+	std::vector<std::vector<ParentAndEdge>> thread_edges(num_threads);
+#pragma omp parallel
+	{
+		int thread_index = ::omp_get_thread_num();
+		Thread& thread = *Threads[thread_index];
+		auto& local_edges = thread_edges[thread_index];
+		StateInfo state_info = {};
+		StateInfo child_state_info = {};
 
-		case REPETITION_SUPERIOR:
-			// Dǖʂ̏ꍇ
-			vmd.value = VALUE_SUPERIOR;
-			vmd.depth = 0;
-			return vmd;
+#pragma omp for schedule(dynamic, 1024)
+		for (int64_t index = 0; index < static_cast<int64_t>(num_entries); ++index) {
+			const auto& entry = book.GetEntry(index);
+			if (!entry.used) {
+				continue;
+			}
 
-		case REPETITION_INFERIOR:
-			// 򓙋ǖʂ̏ꍇ
-			vmd.value = -VALUE_SUPERIOR;
-			vmd.depth = 0;
-			return vmd;
+			Position& pos = thread.rootPos;
+			pos.set_from_packed_sfen(entry.packed_sfen, &state_info, &thread, false, entry.ply);
 
-		default:
-			break;
-		}
+			if (pos.is_mated()) {
+				node_types[index] = BookNodeType::Mated;
+				continue;
+			}
 
-		vmd.value = mated_in(0);
-		vmd.depth = 0;
-		// S@ɂĒׂ
-		for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
-			StateInfo state_info = {};
-			pos.do_move(move, state_info);
-			if (book.get_body()->find(pos.sfen()) != book.get_body()->end()) {
-				// qǖʂ݂ꍇ̂ݏB
-				ValueMoveDepth vmd_child = NegaMax(book, pos, counter);
+			if (pos.DeclarationWin() != MOVE_NONE) {
+				node_types[index] = BookNodeType::DeclarationWin;
+				continue;
+			}
 
-				// wɒŤʂi[B
-				// ԂĂ]l͎̋ǖʂ猩]lȂ̂ŁA𔽓]B
-				// ܂AT[+1B
-				UpsertBookMove(book, sfen, move, vmd_child.move, -vmd_child.value, vmd_child.depth + 1, 1);
+			for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
+				pos.do_move(move, child_state_info);
+				size_t child = book.FindIndex(pos);
+				pos.undo_move(move);
+				if (child != num_entries) {
+					local_edges.push_back({ static_cast<uint32_t>(index),
+						{ static_cast<uint32_t>(child), Move16(move.move), REPETITION_NONE } });
+				}
 			}
-			pos.undo_move(move);
 		}
+	}
 
-		// ǖʂɂāAՃf[^x[XɎqǖʂւ̎w肪o^ꂽB
-		// Ճf[^x[X𒲂ׁA̋ǖʂɂœKȎw𒲂ׂĕԂB
-		auto book_moves = book.get_body()->find(sfen);
-		ASSERT_LV3(book_moves != book.get_body()->end());
-		for (const auto& book_move : *book_moves->second) {
-			if (vmd.value < book_move.value) {
-				vmd.value = static_cast<Value>(book_move.value);
-				vmd.move = pos.to_move(book_move.bestMove);
-				vmd.depth = book_move.depth;
+	// ǖʂƂɎwׂBǖʂƂ̎w̏́Aw萶̏̂܂܂ƂB
+	std::vector<uint64_t> edge_begins(num_entries + 1);
+	for (const auto& local_edges : thread_edges) {
+		for (const auto& parent_and_edge : local_edges) {
+			++edge_begins[parent_and_edge.parent + 1];
+		}
+	}
+	for (size_t index = 0; index < num_entries; ++index) {
+		edge_begins[index + 1] += edge_begins[index];
+	}
+	std::vector<BookEdge> edges(edge_begins[num_entries]);
+	{
+		std::vector<uint64_t> edge_ends(edge_begins.begin(), edge_begins.end() - 1);
+		for (auto& local_edges : thread_edges) {
+			for (const auto& parent_and_edge : local_edges) {
+				edges[edge_ends[parent_and_edge.parent]++] = parent_and_edge.edge;
 			}
+			std::vector<ParentAndEdge>().swap(local_edges);
 		}
-
-		return vmd;
 	}
-}
+	sync_cout << "|edges|=" << edges.size() << sync_endl;
+
+	// 2. [DTŐƂȂwƁADǖʁE򓙋ǖʂ߁Aeǖʂ̍߂B
+	// Position::is_repetition()Ŕ肷邽߁AoHɉċǖʂi߂ĂB
+	// oHȂĂStateInfõAhXςȂ悤Astd::dequeɊmۂB
+	sync_cout << "Searching repetitions..." << sync_endl;
+	enum : uint8_t { kUnvisited, kOnPath, kVisited };
+	std::vector<uint8_t> visit_states(num_entries, kUnvisited);
+	std::vector<uint32_t> heights(num_entries);
+	uint32_t max_height = 0;
+	int num_repetitions = 0;
+	int num_superior_or_inferior_positions = 0;
+	std::vector<BookSearchFrame> path;
+	std::deque<StateInfo> state_infos;
+	Thread& thread = *Threads[0];
+	Position& pos = thread.rootPos;
+	auto visit = [&](uint32_t root) {
+		if (visit_states[root] != kUnvisited) {
+			return;
+		}
 
-// Ճf[^x[X̖[ǖʂ̕]lrootǖʂɌē`
-bool Tanuki::PropagateLeafNodeValuesToRoot() {
-	std::string input_book_file = Options[kBookInputFile];
-	std::string output_book_file = Options[kBookOutputFile];
+		const auto& entry = book.GetEntry(root);
+		state_infos.resize(1);
+		pos.set_from_packed_sfen(entry.packed_sfen, &state_infos.back(), &thread, false, entry.ply);
+		visit_states[root] = kOnPath;
+		path.push_back({ root, edge_begins[root], Move::MOVE_NONE });
+		while (!path.empty()) {
+			BookSearchFrame& frame = path.back();
+			uint32_t node = frame.node;
+			if (node_types[node] == BookNodeType::Inner && frame.edge_index < edge_begins[node + 1]) {
+				BookEdge& edge = edges[frame.edge_index++];
+				if (visit_states[edge.child] == kVisited) {
+					continue;
+				}
 
-	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
-	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+				Move move = pos.to_move(edge.move);
+				state_infos.emplace_back();
+				pos.do_move(move, state_infos.back());
 
-	Search::LimitsType limits;
-	// ̎萔t߂ň̒lԂ̂h1 << 16ɂ
+				if (visit_states[edge.child] == kOnPath) {
+					edge.repetition = GetRepetitionOnPath(pos);
+					++num_repetitions;
+					pos.undo_move(move);
+					state_infos.pop_back();
+					continue;
+				}
+
+				// l݁E錾̔D悵AȊŐǖʂɂėDǖʁE򓙋ǖʂ𔻒肷B
+				if (node_types[edge.child] == BookNodeType::Inner) {
+					RepetitionState repetition = pos.is_repetition();
+					if (repetition == REPETITION_SUPERIOR) {
+						node_types[edge.child] = BookNodeType::RepetitionSuperior;
+						++num_superior_or_inferior_positions;
+					}
+					else if (repetition == REPETITION_INFERIOR) {
+						node_types[edge.child] = BookNodeType::RepetitionInferior;
+						++num_superior_or_inferior_positions;
+					}
+				}
+
+				visit_states[edge.child] = kOnPath;
+				path.push_back({ edge.child, edge_begins[edge.child], move });
+				continue;
+			}
+
+			// SĂ̎qǖʂ𒲂׏ÎŁA߂B
+			uint32_t height = 0;
+			if (node_types[node] == BookNodeType::Inner) {
+				for (uint64_t edge_index = edge_begins[node]; edge_index < edge_begins[node + 1]; ++edge_index) {
+					const BookEdge& edge = edges[edge_index];
+					if (edge.repetition == REPETITION_NONE) {
+						height = std::max(height, heights[edge.child] + 1);
+					}
+				}
+			}
+			heights[node] = height;
+			max_height = std::max(max_height, height);
+			visit_states[node] = kVisited;
+			if (path.size() > 1) {
+				pos.undo_move(frame.move);
+				state_infos.pop_back();
+			}
+			path.pop_back();
+		}
+	};
+
+	// ̋ǖʂ炽ǂǖʂɂď
+	{
+		StateInfo state_info = {};
+		pos.set_hirate(&state_info, &thread);
+		size_t root = book.FindIndex(pos);
+		if (root != num_entries) {
+			visit(static_cast<uint32_t>(root));
+		}
+	}
+
+	// ̋ǖʂHȂǖʂ
+	for (size_t index = 0; index < num_entries; ++index) {
+		if (book.GetEntry(index).used) {
+			visit(static_cast<uint32_t>(index));
+		}
+	}
+	sync_cout << "num_repetitions=" << num_repetitions
+		<< " num_superior_or_inferior_positions=" << num_superior_or_inferior_positions
+		<< " max_height=" << max_height << sync_endl;
+
+	// 3. qǖʂւ̎wo^ĂB
+	for (size_t index = 0; index < num_entries; ++index) {
+		if (!book.GetEntry(index).used || node_types[index] != BookNodeType::Inner) {
+			continue;
+		}
+		for (uint64_t edge_index = edge_begins[index]; edge_index < edge_begins[index + 1]; ++edge_index) {
+			book.Upsert(index, BookPos(edges[edge_index].move, MOVE_NONE, 0, 0, 0), false);
+		}
+	}
+
+	// 4. ̒Ⴂǖʂ珇ɕ]l߂B
+	std::vector<uint64_t> height_begins(max_height + 2);
+	for (size_t index = 0; index < num_entries; ++index) {
+		if (book.GetEntry(index).used) {
+			++height_begins[heights[index] + 1];
+		}
+	}
+	for (uint32_t height = 0; height <= max_height; ++height) {
+		height_begins[height + 1] += height_begins[height];
+	}
+	std::vector<uint32_t> nodes_by_height(height_begins[max_height + 1]);
+	{
+		std::vector<uint64_t> height_ends(height_begins.begin(), height_begins.end() - 1);
+		for (size_t index = 0; index < num_entries; ++index) {
+			if (book.GetEntry(index).used) {
+				nodes_by_height[height_ends[heights[index]]++] = static_cast<uint32_t>(index);
+			}
+		}
+	}
+
+	ValueMoveDepth repetition_values[REPETITION_NB];
+	for (int repetition = 0; repetition < REPETITION_NB; ++repetition) {
+		repetition_values[repetition] = GetRepetitionValue(static_cast<RepetitionState>(repetition));
+	}
+
+	std::vector<ValueMoveDepth> results(num_entries);
+	for (uint32_t height = 0; height <= max_height; ++height) {
+		const int64_t begin = height_begins[height];
+		const int64_t end = height_begins[height + 1];
+		sync_cout << "height=" << height << " |positions|=" << end - begin << sync_endl;
+
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int64_t i = begin; i < end; ++i) {
+			uint32_t node = nodes_by_height[i];
+			ValueMoveDepth& vmd = results[node];
+
+			if (node_types[node] == BookNodeType::Mated) {
+				// lłꍇ
+				vmd.value = mated_in(0);
+				vmd.depth = 0;
+				continue;
+			}
+
+			if (node_types[node] == BookNodeType::DeclarationWin) {
+				// 錾łꍇ
+				vmd.value = mate_in(1);
+				vmd.depth = 0;
+				continue;
+			}
+
+			if (node_types[node] == BookNodeType::RepetitionSuperior) {
+				vmd = repetition_values[REPETITION_SUPERIOR];
+				continue;
+			}
+
+			if (node_types[node] == BookNodeType::RepetitionInferior) {
+				vmd = repetition_values[REPETITION_INFERIOR];
+				continue;
+			}
+
+			// wɎqǖʂ̕]li[B
+			// qǖʂ̕]l͎̋ǖʂ猩]lȂ̂ŁA𔽓]B
+			// ܂AT[+1B
+			auto book_moves = book.GetMoves(node);
+			for (uint64_t edge_index = edge_begins[node]; edge_index < edge_begins[node + 1]; ++edge_index) {
+				const BookEdge& edge = edges[edge_index];
+				const ValueMoveDepth& vmd_child =
+					edge.repetition == REPETITION_NONE ? results[edge.child] : repetition_values[edge.repetition];
+				BookPos book_pos(edge.move, vmd_child.move, -vmd_child.value, vmd_child.depth + 1, 1);
+				auto it = std::find(book_moves.begin(), book_moves.end(), book_pos);
+				ASSERT_LV3(it != book_moves.end());
+				// HashedBook::Upsert()ƓȂ񐔂Zď㏑B
+				book_pos.num += it->num;
+				*it = book_pos;
+			}
+
+			// Ճf[^x[X𒲂ׁA̋ǖʂɂœKȎw𒲂ׂB
+			vmd.value = mated_in(0);
+			vmd.depth = 0;
+			for (const auto& book_move : book_moves) {
+				if (vmd.value < book_move.value) {
+					vmd.value = static_cast<Value>(book_move.value);
+					vmd.move = book_move.bestMove;
+					vmd.depth = book_move.depth;
+				}
+			}
+		}
+	}
+}
+
+// Ճf[^x[X̖[ǖʂ̕]lrootǖʂɌē`
+bool Tanuki::PropagateLeafNodeValuesToRoot() {
+	std::string input_book_file = Options[kBookInputFile];
+	std::string output_book_file = Options[kBookOutputFile];
+
+	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
+	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+
+	Search::LimitsType limits;
+	// ̎萔t߂ň̒lԂ̂h1 << 16ɂ
 	limits.max_game_ply = 1 << 16;
 	limits.depth = MAX_PLY;
 	limits.silent = true;
 	limits.enteringKingRule = EKR_27_POINT;
 	Search::Limits = limits;
 
-	MemoryBook book;
+	HashedBook book;
 	input_book_file = "book/" + input_book_file;
 	sync_cout << "Reading input book file: " << input_book_file << sync_endl;
-	book.read_book(input_book_file);
+	book.Read(input_book_file);
 	sync_cout << "done..." << sync_endl;
-	sync_cout << "|input_book_file|=" << book.get_body()->size() << sync_endl;
+	sync_cout << "|input_book_file|=" << book.Size() << sync_endl;
 
-	// ̋ǖʂ炽ǂǖʂɂď
-	// NÂYȂ
-	memo.clear();
-	auto& pos = Threads[0]->rootPos;
-	StateInfo state_info = {};
-	pos.set_hirate(&state_info, Threads[0]);
-	int counter = 0;
-	NegaMax(book, pos, counter);
-
-	// ̋ǖʂHȂǖʂ
-	for (const auto& book_entry : *book.get_body()) {
-		auto& pos = Threads[0]->rootPos;
-		StateInfo state_info = {};
-		pos.set(book_entry.first, &state_info, Threads[0]);
-		NegaMax(book, pos, counter);
-	}
+	PropagateLeafNodeValues(book);
 
 	WriteBook(book, "book/" + output_book_file);
-	sync_cout << "|output_book|=" << book.get_body()->size() << sync_endl;
+	sync_cout << "|output_book|=" << book.Size() << sync_endl;
 
 	return true;
 }
@@ -755,17 +1633,13 @@ namespace {
 	// ^ꂽǖʂɂA^ꂽw肪Ճf[^x[XɊ܂܂Ă邩ǂԂB
 	// ܂܂Ăꍇ́A̎wւ̃|C^[ԂB
 	// ܂܂ĂȂꍇ́AnullptrԂB
-	BookPos* IsBookMoveExist(BookMoveSelector& book, Position& position, Move move) {
-		auto book_moves = book.get_body().find(position);
-		if (book_moves == nullptr) {
-			return nullptr;
-		}
-
-		auto book_move = std::find_if(book_moves->begin(), book_moves->end(),
+	BookPos* IsBookMoveExist(HashedBook& book, Position& position, Move move) {
+		auto book_moves = book.Find(position);
+		auto book_move = std::find_if(book_moves.begin(), book_moves.end(),
 			[move](auto& m) {
 				return m.bestMove == Move16(move);
 			});
-		if (book_move == book_moves->end()) {
+		if (book_move == book_moves.end()) {
 			// Ճf[^x[XɁA̎w肪o^ĂȂꍇB
 			return nullptr;
 		}
@@ -778,7 +1652,7 @@ namespace {
 	// WJ́A
 	// - Ճf[^x[XɎw肪܂܂ĂA]l臒lȏ
 	// - Ճf[^x[XɎw肪܂܂ĂȂA̋ǖʂ܂܂Ă
-	bool IsTargetMove(BookMoveSelector& book, Position& position, Move move32, int book_eval_black_limit, int book_eval_white_limit) {
+	bool IsTargetMove(HashedBook& book, Position& position, Move move32, int book_eval_black_limit, int book_eval_white_limit) {
 		auto book_pos = IsBookMoveExist(book, position, move32);
 		if (book_pos != nullptr) {
 			// Ճf[^x[XɎw肪܂܂Ă
@@ -788,22 +1662,217 @@ namespace {
 		else {
 			StateInfo state_info = {};
 			position.do_move(move32, state_info);
-			bool exist = book.get_body().get_body()->find(position.sfen()) != book.get_body().get_body()->end();
+			bool exist = book.Contains(position);
 			position.undo_move(move32);
 			return exist;
 		}
 	}
 
 	// ^ꂽǖʂׂǂf
-	bool IsTargetPosition(BookMoveSelector& book, Position& position, int multi_pv) {
-		auto book_moves = book.get_body().find(position);
-		if (book_moves == nullptr) {
-			// Ճf[^x[XɁA̋ǖʂo^ĂȂꍇAB
-			return true;
+	bool IsTargetPosition(HashedBook& book, Position& position, int multi_pv) {
+		// Ճf[^x[XɁA̋ǖʂo^ĂȂꍇA
+		// ܂͓o^Ăw̐AMultiPV菭ȂꍇAB
+		return static_cast<int>(book.Find(position).size()) < multi_pv;
+	}
+
+	// ̃Xbh瓯ɍXVłAǖʂhash key珇ʂւ̎ʑB
+	// hash key̏ʃrbgŃV[hɐU蕪AV[hƂɃbNB
+	class ConcurrentRankMap {
+	public:
+		// ǖʂo^ĂȂAo^Ă鏇ʂrankꍇranko^trueԂB
+		// ȊȌꍇfalseԂB
+		bool InsertMin(Key key, uint64_t rank) {
+			auto& shard = GetShard(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto result = shard.ranks.emplace(key, rank);
+			if (result.second) {
+				return true;
+			}
+			if (rank < result.first->second) {
+				result.first->second = rank;
+				return true;
+			}
+			return false;
+		}
+
+		// o^Ă鏇ʂԂB
+		uint64_t Get(Key key) {
+			auto& shard = GetShard(key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			return shard.ranks.at(key);
+		}
+
+	private:
+		static constexpr int kNumShardBits = 10;
+
+		struct Shard {
+			std::mutex mutex;
+			std::unordered_map<Key, uint64_t> ranks;
+		};
+
+		Shard& GetShard(Key key) {
+			return shards_[static_cast<size_t>(key >> (64 - kNumShardBits))];
+		}
+
+		std::unique_ptr<Shard[]> shards_{ new Shard[1 << kNumShardBits] };
+	};
+
+	// DTŖKꂽǖʁBǖʂ̎w𕜌邽߁Aeǖʂւ̓YƒO̎wێB
+	struct ExploredNode {
+		uint32_t parent;
+		Move16 move;
+	};
+
+	// Ղ̉̑ΏۂƂȂǖʂ𒊏oAǖʂ̎w̗Ƃtarget_positionsɊi[B
+	// ǖʂ[ƂɕDTsA[̋ǖʂSẴXbhŕSēWJB
+	// WJ҂̋ǖʂPackedSfenŕێAǖʂwwɕB
+	// ǖʂ͈xWJȂ̂ŁAŤoHŐ肪邱Ƃ͂ȂB
+	// ̐eǖʂ瓞Błǖʂ́AVOXbhŕDTꍇɍŏɓBeǖʂWĴƂB
+	// ɂAʂ̓Xbhɂ炸AVOXbhŏꍇƓɂȂB
+	void ExtractTargets(HashedBook& book, int multi_pv, int book_eval_black_limit, int book_eval_white_limit,
+		std::vector<std::vector<Move16>>& target_positions) {
+		int num_threads = std::max(1, std::min(static_cast<int>(Options[kThreads]), static_cast<int>(Threads.size())));
+		omp_set_num_threads(num_threads);
+
+		// Tς݂̋ǖʂhash keyƁA̋ǖʂɍŏɓB
+		// ʂ([, eǖʂ̓Y, w̓Y)̎ƂB
+		ConcurrentRankMap explorered;
+		// KꂽSĂ̋ǖʁBY0͕ǖʂƂB
+		std::vector<ExploredNode> nodes;
+		// ݂̐[̋ǖʂƁAnodes̓Y
+		std::vector<PackedSfen> frontier(1);
+		std::vector<uint32_t> frontier_node_indices(1, 0);
+		{
+			Position& position = Threads[0]->rootPos;
+			StateInfo state_info = {};
+			position.set_hirate(&state_info, Threads[0]);
+			explorered.InsertMin(position.key(), 0);
+			position.sfen_pack(frontier[0]);
+			nodes.push_back({ 0, Move16() });
 		}
 
-		// o^Ăw̐AMultiPV菭ȂꍇAB
-		return book_moves->size() < multi_pv;
+		// ̑ΏۂƂȂǖʂnodes̓Y
+		std::vector<uint32_t> target_node_indices;
+
+		// XbhƂ̎̐[̋ǖ
+		struct NextNode {
+			PackedSfen packed_sfen;
+			ExploredNode node;
+			Key key;
+			uint64_t rank;
+		};
+		std::vector<std::vector<NextNode>> thread_next_nodes(num_threads);
+		std::vector<std::vector<uint32_t>> thread_target_node_indices(num_threads);
+
+		for (int depth = 0; !frontier.empty(); ++depth) {
+			sync_cout << "depth=" << depth << " |frontier|=" << frontier.size() << " |explorered|=" << nodes.size() << sync_endl;
+
+			int num_frontier = static_cast<int>(frontier.size());
+			std::atomic_int global_frontier_index;
+			global_frontier_index = 0;
+
+#pragma omp parallel
+			{
+				int thread_index = ::omp_get_thread_num();
+				Thread& thread = *Threads[thread_index];
+				auto& next_nodes = thread_next_nodes[thread_index];
+				auto& local_target_node_indices = thread_target_node_indices[thread_index];
+				StateInfo state_info = {};
+				StateInfo child_state_info = {};
+
+				for (int frontier_index = global_frontier_index++; frontier_index < num_frontier;
+					frontier_index = global_frontier_index++) {
+					Position& position = thread.rootPos;
+					position.set_from_packed_sfen(frontier[frontier_index], &state_info, &thread, false, depth + 1);
+					uint32_t node_index = frontier_node_indices[frontier_index];
+
+					// l݁A錾̋ǖʂ͏Ȃ
+					if (position.is_mated() || position.DeclarationWin() != MOVE_NONE) {
+						continue;
+					}
+
+					if (IsTargetPosition(book, position, multi_pv)) {
+						local_target_node_indices.push_back(node_index);
+					}
+
+					// qǖʂWJ
+					uint64_t move_index = 0;
+					for (const auto& move : MoveList<LEGAL_ALL>(position)) {
+						++move_index;
+						if (!position.pseudo_legal(move) || !position.legal(move)) {
+							// sȎ̏ꍇ͏Ȃ
+							continue;
+						}
+
+						if (!IsTargetMove(book, position, move, book_eval_black_limit, book_eval_white_limit)) {
+							// ̎w̐̋ǖʂ͏ȂB
+							continue;
+						}
+
+						position.do_move(move, child_state_info);
+
+						// undo_move()ĂяoKv̂ŁAcontinuebreak֎~B
+						uint64_t rank = (static_cast<uint64_t>(depth + 1) << 48)
+							| (static_cast<uint64_t>(frontier_index) << 16) | move_index;
+						if (explorered.InsertMin(position.key(), rank)) {
+							NextNode next_node;
+							position.sfen_pack(next_node.packed_sfen);
+							next_node.node = { node_index, Move16(move.move) };
+							next_node.key = position.key();
+							next_node.rank = rank;
+							next_nodes.push_back(next_node);
+						}
+
+						position.undo_move(move);
+					}
+				}
+			}
+
+			// XbhƂ̌ʂ܂Ƃ߁Aŏ̏ʂœo^ꂽ̂̐[̋ǖʂƂB
+			// ʂŃ\[gAVOXbhŏꍇƓɕׂB
+			std::vector<NextNode> next_level;
+			for (auto& next_nodes : thread_next_nodes) {
+				for (const auto& next_node : next_nodes) {
+					if (explorered.Get(next_node.key) == next_node.rank) {
+						next_level.push_back(next_node);
+					}
+				}
+				std::vector<NextNode>().swap(next_nodes);
+			}
+			std::sort(next_level.begin(), next_level.end(),
+				[](const NextNode& lhs, const NextNode& rhs) { return lhs.rank < rhs.rank; });
+
+			frontier.clear();
+			frontier.reserve(next_level.size());
+			frontier_node_indices.clear();
+			frontier_node_indices.reserve(next_level.size());
+			for (const auto& next_node : next_level) {
+				frontier.push_back(next_node.packed_sfen);
+				frontier_node_indices.push_back(static_cast<uint32_t>(nodes.size()));
+				nodes.push_back(next_node.node);
+			}
+
+			size_t level_target_begin = target_node_indices.size();
+			for (auto& local_target_node_indices : thread_target_node_indices) {
+				target_node_indices.insert(target_node_indices.end(),
+					local_target_node_indices.begin(), local_target_node_indices.end());
+				local_target_node_indices.clear();
+			}
+			// [̋ǖʂ̓Y͒TɐUĂ̂ŁAYŃ\[gƒTɂȂB
+			std::sort(target_node_indices.begin() + level_target_begin, target_node_indices.end());
+		}
+
+		// eǖʂǂAǖʂ̎w̗𕜌B
+		// 蓙F邽߁Aǖʂł͂Ȃw̗ƂĊi[B
+		target_positions.reserve(target_positions.size() + target_node_indices.size());
+		for (uint32_t node_index : target_node_indices) {
+			std::vector<Move16> moves;
+			for (; node_index != 0; node_index = nodes[node_index].parent) {
+				moves.push_back(nodes[node_index].move);
+			}
+			std::reverse(moves.begin(), moves.end());
+			target_positions.push_back(std::move(moves));
+		}
 	}
 }
 
@@ -832,90 +1901,191 @@ bool Tanuki::ExtractTargetPositions() {
 	limits.enteringKingRule = EKR_27_POINT;
 	Search::Limits = limits;
 
-	BookMoveSelector book;
+	HashedBook book;
 	input_book_file = "book/" + input_book_file;
 	sync_cout << "Reading input book file: " << input_book_file << sync_endl;
-	book.get_body().read_book(input_book_file);
+	book.Read(input_book_file);
 	sync_cout << "done..." << sync_endl;
-	sync_cout << "|input_book_file|=" << book.get_body().get_body()->size() << sync_endl;
+	sync_cout << "|input_book_file|=" << book.Size() << sync_endl;
 
-	std::set<std::string> explorered;
-	explorered.insert(SFEN_HIRATE);
-	// ̏̂߁Aǖʂ̎wƂĕێ
-	// Move32rbgłƂ
-	std::deque<std::vector<Move>> frontier;
-	frontier.push_back({});
+	std::vector<std::vector<Move16>> target_positions;
+	ExtractTargets(book, multi_pv, book_eval_black_limit, book_eval_white_limit, target_positions);
 
+	// Ώۂ̋ǖʂoB
+	// `moveXy[X؂ŕׂ̂ƂB
+	// ́A蓙F邽߁B
 	std::ofstream ofs(target_sfens_file);
-
-	int counter = 0;
-	std::vector<StateInfo> state_info(1024);
-	while (!frontier.empty()) {
-		if (++counter % 1000 == 0) {
-			sync_cout << counter << sync_endl;
+	for (const auto& moves : target_positions) {
+		for (auto m : moves) {
+			ofs << m << " ";
 		}
+		ofs << std::endl;
+	}
 
-		auto moves = frontier.front();
-		Position& position = Threads[0]->rootPos;
-		position.set_hirate(&state_info[0], Threads[0]);
-		// ǖʂ܂Ŏwi߂
-		for (auto move : moves) {
-			position.do_move(move, state_info[position.game_ply()]);
-		}
-		frontier.pop_front();
-
-		// ̋ǖʂ͏Ȃ
-		auto draw_type = position.is_repetition(MAX_PLY);
-		if (draw_type == REPETITION_DRAW) {
-			continue;
-		}
+	sync_cout << "done..." << sync_endl;
 
-		// l݁A錾̋ǖʂȂ
-		if (position.is_mated() || position.DeclarationWin() != MOVE_NONE) {
-			continue;
-		}
+	return true;
+}
 
-		if (IsTargetPosition(book, position, multi_pv)) {
-			// Ώۂ̋ǖʂoB
-			// `moveXy[X؂ŕׂ̂ƂB
-			// ́A蓙F邽߁B
+namespace {
+	// eǖʂΏۋǖʂ́Atarget_positionsł̃CfbNX܂Ƃ߂́B
+	// ǖʂ̂̂Ώۂ̏ꍇ́AꂾłЂƂ̂܂Ƃ܂ƂB
+	struct TargetPositionGroup {
+		std::vector<int> target_position_indices;
+	};
 
-			for (auto m : moves) {
-				ofs << m << " ";
+	// Ώۂ̋ǖʂeǖʂƂɂ܂Ƃ߂B
+	// eǖʂ̏́A̎qǖʂ̂łOɂ̂̏ƂB
+	std::vector<TargetPositionGroup> GroupTargetPositionsByParent(const std::vector<std::vector<Move16>>& target_positions) {
+		std::vector<TargetPositionGroup> groups;
+		std::unordered_map<Key, int> parent_key_to_group_index;
+		Thread& thread = *Threads[0];
+		Position& pos = thread.rootPos;
+		for (int target_position_index = 0; target_position_index < static_cast<int>(target_positions.size()); ++target_position_index) {
+			const auto& moves = target_positions[target_position_index];
+			if (moves.empty()) {
+				groups.push_back({ { target_position_index } });
+				continue;
 			}
-			ofs << std::endl;
-		}
 
-		// qǖʂWJ
-		for (const auto& move : MoveList<LEGAL_ALL>(position)) {
-			if (!position.pseudo_legal(move) || !position.legal(move)) {
-				// sȎ̏ꍇ͏Ȃ
-				continue;
+			std::vector<StateInfo> state_info(moves.size());
+			pos.set_hirate(&state_info[0], &thread);
+			for (size_t ply = 0; ply + 1 < moves.size(); ++ply) {
+				pos.do_move(pos.to_move(moves[ply]), state_info[ply + 1]);
 			}
 
-			if (!IsTargetMove(book, position, move, book_eval_black_limit, book_eval_white_limit)) {
-				// ̎w̐̋ǖʂ͏ȂB
-				continue;
+			auto it = parent_key_to_group_index.find(pos.key());
+			if (it == parent_key_to_group_index.end()) {
+				it = parent_key_to_group_index.emplace(pos.key(), static_cast<int>(groups.size())).first;
+				groups.push_back({});
 			}
+			groups[it->second].target_position_indices.push_back(target_position_index);
+		}
+		return groups;
+	}
 
-			position.do_move(move, state_info[position.game_ply()]);
+	// Ώۂ̋ǖʂꂼTAMultiPV̊ewupsertɓnB
+	// upsert͕̃Xbh瓯ɌĂяoBpos͎wwŐǖʂłB
+	// save͋ǖʂ܂Ƃ߂ĒT邽тɃ}X^[XbhĂяoB
+	void SearchTargetPositions(const std::vector<std::vector<Move16>>& target_positions,
+		int search_depth, int search_nodes, int multi_pv,
+		const std::function<void(Position& pos, Move best, Move next, int value, int depth)>& upsert,
+		const std::function<void()>& save) {
+		int num_positions = static_cast<int>(target_positions.size());
+		ProgressReport progress_report(num_positions, kShowProgressPerAtMostSec);
+
+		// Zǖʂ𓯂XbhőĒTAXbhƂ̒u\ɎcTʂėpł悤A
+		// eǖʂƂɂ܂Ƃ߂ĊeXbhɊ蓖ĂB
+		auto groups = GroupTargetPositionsByParent(target_positions);
+		int num_groups = static_cast<int>(groups.size());
+		sync_cout << "Number of the parent positions: " << num_groups << sync_endl;
+
+		std::atomic<bool> need_wait = false;
+		std::atomic_int global_group_index;
+		global_group_index = 0;
+		std::atomic_int global_num_processed_positions;
+		global_num_processed_positions = 0;
 
-			// undo_move()ĂяoKv̂ŁAcontinuebreak֎~B
-			if (!explorered.count(position.sfen())) {
-				explorered.insert(position.sfen());
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			WinProcGroup::bindThisThread(thread_index);
+
+			for (int group_index = global_group_index++; group_index < num_groups;
+				group_index = global_group_index++) {
+				const auto& group = groups[group_index];
+				Thread& thread = *Threads[thread_index];
+				std::vector<StateInfo> state_info(1024);
+				Position& pos = thread.rootPos;
+
+				// 蓙𐳂F邽߁AΏۋǖʂƂɎg̎w̗Őeǖʂ܂Ői߂B
+				// eǖʂ܂ł̎w̗񂪒ȎΏۋǖʂƓꍇ́Aǖʂ̂܂܎g񂷁B
+				const std::vector<Move16>* parent_moves = nullptr;
+				for (int target_position_index : group.target_position_indices) {
+					const auto& moves = target_positions[target_position_index];
+					if (parent_moves == nullptr ||
+						!std::equal(moves.begin(), moves.end() - 1, parent_moves->begin(), parent_moves->end() - 1)) {
+						pos.set_hirate(&state_info[0], &thread);
+						for (size_t ply = 0; ply + 1 < moves.size(); ++ply) {
+							Move move = pos.to_move(moves[ply]);
+							pos.do_move(move, state_info[pos.game_ply()]);
+						}
+						parent_moves = &moves;
+					}
 
-				moves.push_back(move);
-				frontier.push_back(moves);
-				moves.pop_back();
-			}
+					Move child_move = Move::MOVE_NONE;
+					if (!moves.empty()) {
+						child_move = pos.to_move(moves.back());
+						pos.do_move(child_move, state_info[pos.game_ply()]);
+					}
 
-			position.undo_move(move);
-		}
-	}
+					if (!pos.is_mated()) {
+						Learner::search(pos, search_depth, multi_pv, search_nodes);
+
+						int num_pv = std::min(multi_pv, static_cast<int>(thread.rootMoves.size()));
+						for (int pv_index = 0; pv_index < num_pv; ++pv_index) {
+							const auto& root_move = thread.rootMoves[pv_index];
+							Move best = Move::MOVE_NONE;
+							if (root_move.pv.size() >= 1) {
+								best = root_move.pv[0];
+							}
+							Move next = Move::MOVE_NONE;
+							if (root_move.pv.size() >= 2) {
+								next = root_move.pv[1];
+							}
+							int value = root_move.score;
+							upsert(pos, best, next, value, thread.completedDepth);
+						}
+					}
 
-	sync_cout << "done..." << sync_endl;
+					++global_num_processed_positions;
 
-	return true;
+					if (child_move != Move::MOVE_NONE) {
+						pos.undo_move(child_move);
+					}
+				}
+
+				int num_processed_positions = global_num_processed_positions;
+				// Ô߁AI/O̓}X^[Xbhł̂ݍs
+#pragma omp master
+				{
+					// i󋵂\
+					progress_report.Show(num_processed_positions);
+
+					// KvɉăW[iՃt@Cɔf
+					save();
+				}
+
+				need_wait = need_wait ||
+					(progress_report.HasDataPerTime() &&
+						progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
+
+				if (need_wait) {
+					// xቺĂĂB
+					// SẴXbhҋ@B
+#pragma omp barrier
+
+					// }X^[Xbhł΂炭ҋ@B
+#pragma omp master
+					{
+						sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
+							progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
+							progress_report.GetMaxDataPerTime() << sync_endl;
+
+						std::this_thread::sleep_for(std::chrono::minutes(10));
+						progress_report.Reset();
+						need_wait = false;
+					}
+
+					// }X^[Xbh̑ҋ@I܂ŁAēxSẴXbhҋ@B
+#pragma omp barrier
+				}
+
+				// u\̐i߂
+				Threads[thread_index]->tt.new_search();
+			}
+		}
+	}
 }
 
 bool Tanuki::AddTargetPositions() {
@@ -953,122 +2123,52 @@ bool Tanuki::AddTargetPositions() {
 	sync_cout << "|input_book|=" << input_book.get_body()->size() << sync_endl;
 
 	MemoryBook output_book;
+	BookJournal output_book_journal;
 	output_book_file = "book/" + output_book_file;
 	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
-	output_book.read_book(output_book_file);
+	output_book_journal.Open(output_book, output_book_file);
 	sync_cout << "done..." << sync_endl;
 	sync_cout << "|output_book|=" << output_book.get_body()->size() << sync_endl;
 
 	// Ώۂ̋ǖʂǂݍ
 	sync_cout << "Reading target positions: target_sfens_file=" << target_sfens_file << sync_endl;
-	std::vector<std::string> lines;
+	std::vector<std::vector<Move16>> target_positions;
 	std::ifstream ifs(target_sfens_file);
 	std::string line;
 	while (std::getline(ifs, line)) {
-		lines.push_back(line);
+		std::istringstream iss(line);
+		std::vector<Move16> moves;
+		std::string move_string;
+		while (iss >> move_string) {
+			moves.push_back(USI::to_move16(move_string));
+		}
+		target_positions.push_back(std::move(moves));
 	}
-	int num_positions = lines.size();
 	sync_cout << "done..." << sync_endl;
-	sync_cout << "|lines|=" << num_positions << sync_endl;
-
-	ProgressReport progress_report(num_positions, kShowProgressPerAtMostSec);
-	time_t last_save_time_sec = std::time(nullptr);
-
-	std::atomic<bool> need_wait = false;
-	std::atomic_int global_pos_index;
-	global_pos_index = 0;
-	std::atomic_int global_num_processed_positions;
-	global_num_processed_positions = 0;
-
-#pragma omp parallel
-	{
-		int thread_index = ::omp_get_thread_num();
-		WinProcGroup::bindThisThread(thread_index);
-
-		for (int position_index = global_pos_index++; position_index < num_positions;
-			position_index = global_pos_index++) {
-			Thread& thread = *Threads[thread_index];
-			std::vector<StateInfo> state_info(1024);
-			Position& pos = thread.rootPos;
-			pos.set_hirate(&state_info[0], &thread);
-
-			std::istringstream iss(lines[position_index]);
-			std::string move_string;
-			while (iss >> move_string) {
-				Move16 move16 = USI::to_move16(move_string);
-				Move move = pos.to_move(move16);
-				pos.do_move(move, state_info[pos.game_ply()]);
-			}
-
-			if (pos.is_mated()) {
-				continue;
-			}
-
-			Learner::search(pos, search_depth, multi_pv, search_nodes);
-
-			int num_pv = std::min(multi_pv, static_cast<int>(thread.rootMoves.size()));
-			for (int pv_index = 0; pv_index < num_pv; ++pv_index) {
-				const auto& root_move = thread.rootMoves[pv_index];
-				Move best = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 1) {
-					best = root_move.pv[0];
-				}
-				Move next = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 2) {
-					next = root_move.pv[1];
-				}
-				int value = root_move.score;
-				UpsertBookMove(output_book, pos.sfen(), best, next, value, thread.completedDepth, 1);
-			}
-
-			int num_processed_positions = ++global_num_processed_positions;
-			// Ô߁AI/O̓}X^[Xbhł̂ݍs
-#pragma omp master
-			{
-				// i󋵂\
-				progress_report.Show(num_processed_positions);
-
-				// 莞ԂƂɕۑ
-				{
-					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-						WriteBook(output_book, output_book_file);
-						last_save_time_sec = std::time(nullptr);
-					}
-				}
-			}
-
-			need_wait = need_wait ||
-				(progress_report.HasDataPerTime() &&
-					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
-
-			if (need_wait) {
-				// xቺĂĂB
-				// SẴXbhҋ@B
-#pragma omp barrier
-
-				// }X^[Xbhł΂炭ҋ@B
-#pragma omp master
-				{
-					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
-						progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
-						progress_report.GetMaxDataPerTime() << sync_endl;
-
-					std::this_thread::sleep_for(std::chrono::minutes(10));
-					progress_report.Reset();
-					need_wait = false;
-				}
-
-				// }X^[Xbh̑ҋ@I܂ŁAēxSẴXbhҋ@B
-#pragma omp barrier
+	sync_cout << "|lines|=" << target_positions.size() << sync_endl;
+
+	SortTargetPositionsByReach(input_book, target_positions);
+
+	// ̃XbhǖʒPʂ̃bNŏ߂悤AV[hՂɈڂB
+	ConcurrentBook concurrent_output_book;
+	concurrent_output_book.MoveFrom(output_book);
+
+	SearchTargetPositions(target_positions, search_depth, search_nodes, multi_pv,
+		[&concurrent_output_book, &output_book_journal](Position& pos, Move best, Move next, int value, int depth) {
+			UpsertBookMove(concurrent_output_book, output_book_journal, pos.sfen(), best, next, value, depth, 1);
+		},
+		[&concurrent_output_book, &output_book_journal]() {
+			if (output_book_journal.NeedsCompaction()) {
+				concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+					output_book_journal.Compact(book);
+				});
 			}
+		});
 
-			// u\̐i߂
-			Threads[thread_index]->tt.new_search();
-		}
-	}
-
-	WriteBook(output_book, output_book_file);
+	concurrent_output_book.Exclusive([&output_book_journal](MemoryBook& book) {
+		output_book_journal.Compact(book);
+	});
+	output_book_journal.Close();
 
 	return true;
 }
@@ -1238,4 +2338,98 @@ bool Tanuki::CreateFromTanukiColiseum()
 	return true;
 }
 
+// ExtractTargetPositions()AAddTargetPositions()APropagateLeafNodeValuesToRoot()𖳌ɌJԂB
+// Ղ͍ŏɈxǂݍ݁AeiKœHashedBookLB
+// AddTargetPositions()̊ԂHashedBookǂݎpƂATʂ̓V[hConcurrentBook
+// ǖʒPʂ̃bNœo^ĂAiK̏IHashedBookɔfB
+// ̂߁AAddTargetPositions()̓rłCompact()AW[iւ̒ǋL݂̂sB
+// ̑ΏۂƂȂǖʂt@CɃ[Ŏ󂯓nB
+// Ճt@Cւ̏óAW[i傫ȂƂCompact()ł̂ݍsB
+// PropagateLeafNodeValuesToRoot()̌ʂ̓W[iɋL^Ȃ߁Ae[v̏߂ɓ`dB
+bool Tanuki::EndlessTeraShock() {
+	int num_threads = (int)Options[kThreads];
+	std::string input_book_file = Options[kBookInputFile];
+	std::string output_book_file = Options[kBookOutputFile];
+	int search_depth = (int)Options[kBookSearchDepth];
+	int search_nodes = (int)Options[kBookSearchNodes];
+	int multi_pv = (int)Options[kMultiPV];
+	int book_eval_black_limit = (int)Options["BookEvalBlackLimit"];
+	int book_eval_white_limit = (int)Options["BookEvalWhiteLimit"];
+
+	omp_set_num_threads(num_threads);
+
+	sync_cout << "info string num_threads=" << num_threads << sync_endl;
+	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
+	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+	sync_cout << "info string search_depth=" << search_depth << sync_endl;
+	sync_cout << "info string search_nodes=" << search_nodes << sync_endl;
+	sync_cout << "info string multi_pv=" << multi_pv << sync_endl;
+	sync_cout << "info string book_eval_black_limit=" << book_eval_black_limit << sync_endl;
+	sync_cout << "info string book_eval_white_limit=" << book_eval_white_limit << sync_endl;
+
+	Search::LimitsType limits;
+	// ̎萔t߂ň̒lԂ̂h1 << 16ɂ
+	limits.max_game_ply = 1 << 16;
+	limits.depth = MAX_PLY;
+	limits.silent = true;
+	limits.enteringKingRule = EKR_27_POINT;
+	Search::Limits = limits;
+
+	input_book_file = "book/" + input_book_file;
+	output_book_file = "book/" + output_book_file;
+
+	// [v̏߂ɏo̓t@C͂Ƃ邽߁A̓t@Co̓t@CɃRs[ĂB
+	// o̓t@C₻̃W[icĂꍇ́AȎĊJ邽߁ARs[ȂB
+	bool has_output_book = Tanuki::IsRegularFile(output_book_file)
+		|| Tanuki::IsRegularFile(GetTemporaryBookFilePath(output_book_file))
+		|| Tanuki::IsRegularFile(output_book_file + ".journal");
+	if (input_book_file != output_book_file && !has_output_book && Tanuki::IsRegularFile(input_book_file)) {
+		Tanuki::CopyFile(input_book_file, output_book_file);
+	}
+
+	HashedBook book;
+	BookJournal book_journal;
+	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
+	book_journal.Open(book, output_book_file);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|output_book|=" << book.Size() << sync_endl;
+
+	for (;;) {
+		sync_cout << "Tanuki::PropagateLeafNodeValuesToRoot();" << sync_endl;
+		PropagateLeafNodeValues(book);
+		sync_cout << sync_endl;
+
+		sync_cout << "Tanuki::ExtractTargetPositions();" << sync_endl;
+		std::vector<std::vector<Move16>> target_positions;
+		ExtractTargets(book, multi_pv, book_eval_black_limit, book_eval_white_limit, target_positions);
+		sync_cout << "|target_positions|=" << target_positions.size() << sync_endl;
+		SortTargetPositionsByReach(book, target_positions);
+		sync_cout << sync_endl;
+
+		sync_cout << "Tanuki::AddTargetPositions();" << sync_endl;
+		ConcurrentBook upserted_book;
+		SearchTargetPositions(target_positions, search_depth, search_nodes, multi_pv,
+			[&upserted_book, &book, &book_journal](Position& pos, Move best, Move next, int value, int depth) {
+				UpsertBookMove(upserted_book, book, book_journal, pos, best, next, value, depth, 1);
+			},
+			[]() {});
+		upserted_book.Exclusive([&book](MemoryBook& upserted_memory_book) {
+			MergeUpsertedMoves(upserted_memory_book, book);
+		});
+		std::vector<std::vector<Move16>>().swap(target_positions);
+		sync_cout << sync_endl;
+
+		// W[i傫ȂĂ΁A`FbN|CgƂĒՃt@CoA^CX^vt̃t@CłcĂB
+		book_journal.Flush();
+		if (book_journal.NeedsCompaction()) {
+			book_journal.Compact(book);
+			Tanuki::CopyFile(output_book_file, output_book_file + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+		}
+
+		TT.new_search();
+	}
+
+	return true;
+}
+
 #endif
@@ -5,9 +5,22 @@
 
 #ifdef EVAL_LEARN
 
+#include "position.h"
 #include "usi.h"
 
 namespace Tanuki {
+	class HashedBook;
+
+	struct ValueMoveDepth {
+		// ]l
+		Value value = VALUE_NONE;
+		// ̋ǖʂɂw
+		// Ղ̎wɑ΂鉞Ճf[^x[Xɓo^邽߁AwԂ悤ɂĂ
+		Move16 move = MOVE_NONE;
+		// T[
+		Depth depth = DEPTH_NONE;
+	};
+
 	bool InitializeBook(USI::OptionsMap& o);
 	bool CreateRawBook();
 	bool CreateScoredBook();
@@ -16,7 +29,15 @@ namespace Tanuki {
 	bool PropagateLeafNodeValuesToRoot();
 	bool ExtractTargetPositions();
 	bool AddTargetPositions();
+	bool EndlessTeraShock();
 	bool CreateFromTanukiColiseum();
+
+	// EDǖʁE򓙋ǖʂ́A̋ǖʂ̎ԑ猩]lԂB
+	ValueMoveDepth GetRepetitionValue(RepetitionState repetition);
+	// [DŤoH̋ǖʂɖ߂Ƃ̐̎ނԂB
+	RepetitionState GetRepetitionOnPath(const Position& pos);
+	// Nega-Max@ŒՃf[^x[X̖[ǖʂ̕]lrootǖʂɌē`B
+	void PropagateLeafNodeValues(HashedBook& book);
 }
 
 #endif
@@ -0,0 +1,134 @@
+#include "tanuki_concurrent_book.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <algorithm>
+
+#include "misc.h"
+
+using Book::BookPos;
+using Book::MemoryBook;
+using Book::PosMoveList;
+
+Tanuki::ConcurrentBook::ConcurrentBook(int num_shards)
+	: num_shards_(num_shards), shards_(new Shard[num_shards]) {}
+
+void Tanuki::ConcurrentBook::MoveFrom(MemoryBook& book) {
+	auto& body = *book.get_body();
+	while (!body.empty()) {
+		auto node = body.extract(body.begin());
+		Shard& shard = GetShard(node.key());
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto result = shard.body.insert(std::move(node));
+		if (result.inserted) {
+			continue;
+		}
+
+		// łɓo^Ăǖʂ̏ꍇ́AwЂƂǉB
+		for (const auto& book_pos : *result.node.mapped()) {
+			auto& move_list = *result.position->second;
+			auto it = std::find(move_list.begin(), move_list.end(), book_pos);
+			if (it == move_list.end()) {
+				move_list.push_back(book_pos);
+			}
+		}
+	}
+}
+
+void Tanuki::ConcurrentBook::Upsert(const std::string& sfen, const BookPos& book_pos, bool overwrite,
+	const std::function<void(const BookPos&)>& on_upserted) {
+	Shard& shard = GetShard(sfen);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto& move_list = shard.body[sfen];
+	if (!move_list) {
+		move_list = std::make_shared<PosMoveList>();
+	}
+
+	// łɊi[Ă邩mȂ̂œw肪Ȃ`FbNāAȂΒǉ
+	auto it = std::find(move_list->begin(), move_list->end(), book_pos);
+	if (it == move_list->end()) {
+		move_list->push_back(book_pos);
+		it = move_list->end() - 1;
+	}
+	else if (overwrite) {
+		// łɑ݂Ă̂ŃGg[uB̑񐔂̓CNg
+		uint64_t num = it->num;
+		*it = book_pos;
+		it->num += num;
+	}
+
+	if (on_upserted) {
+		on_upserted(*it);
+	}
+}
+
+PosMoveList Tanuki::ConcurrentBook::Find(const std::string& sfen) const {
+	const Shard& shard = GetShard(sfen);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.body.find(sfen);
+	if (it == shard.body.end() || !it->second) {
+		return PosMoveList();
+	}
+	return *it->second;
+}
+
+bool Tanuki::ConcurrentBook::Contains(const std::string& sfen) const {
+	const Shard& shard = GetShard(sfen);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.body.count(sfen) > 0;
+}
+
+void Tanuki::ConcurrentBook::Exclusive(const std::function<void(MemoryBook& book)>& func) {
+	std::vector<std::unique_lock<std::mutex>> locks;
+	locks.reserve(num_shards_);
+	for (int shard_index = 0; shard_index < num_shards_; ++shard_index) {
+		locks.emplace_back(shards_[shard_index].mutex);
+	}
+
+	// V[hƂɐU蕪ꂽǖʂЂƂMemoryBookɂ܂Ƃ߂B
+	// ǖʂ͂ꂩЂƂ̃V[hɂ̂ݑ݂̂ŁAmerge()őSĈړB
+	size_t size = 0;
+	for (int shard_index = 0; shard_index < num_shards_; ++shard_index) {
+		size += shards_[shard_index].body.size();
+	}
+
+	MemoryBook book;
+	auto& body = *book.get_body();
+	body.reserve(size);
+	for (int shard_index = 0; shard_index < num_shards_; ++shard_index) {
+		body.merge(shards_[shard_index].body);
+	}
+
+	func(book);
+
+	// ǖʂV[hɐU蕪B
+	// func̒ŋǖʂǉE폜ĂĂ悢B
+	while (!body.empty()) {
+		auto node = body.extract(body.begin());
+		GetShard(node.key()).body.insert(std::move(node));
+	}
+}
+
+size_t Tanuki::ConcurrentBook::Size() const {
+	size_t size = 0;
+	for (int shard_index = 0; shard_index < num_shards_; ++shard_index) {
+		std::lock_guard<std::mutex> lock(shards_[shard_index].mutex);
+		size += shards_[shard_index].body.size();
+	}
+	return size;
+}
+
+Tanuki::ConcurrentBook::Shard& Tanuki::ConcurrentBook::GetShard(const std::string& sfen) {
+	return const_cast<Shard&>(static_cast<const ConcurrentBook*>(this)->GetShard(sfen));
+}
+
+const Tanuki::ConcurrentBook::Shard& Tanuki::ConcurrentBook::GetShard(const std::string& sfen) const {
+	// unordered_map̃oPbg̑IƑւȂ悤AnbVlĂʃrbgpB
+	uint64_t hash = static_cast<uint64_t>(std::hash<std::string>()(sfen)) * UINT64_C(0x9E3779B97F4A7C15);
+	return shards_[mul_hi64(hash, static_cast<uint64_t>(num_shards_))];
+}
+
+#endif
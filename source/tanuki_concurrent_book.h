@@ -0,0 +1,70 @@
+#ifndef _TANUKI_CONCURRENT_BOOK_H_
+#define _TANUKI_CONCURRENT_BOOK_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "extra/book/book.h"
+
+namespace Tanuki {
+	/// <summary>
+	/// ̃Xbh瓯Ɏwo^EQƂłՃf[^x[XB
+	/// Book::MemoryBookstd::unordered_mapЂƂŋǖʂێ邽߁A
+	/// ɏނɂ͑IȃbNKvAXbhƃbN҂rehashڗB
+	/// ̃NXsfeñnbVlŋǖʂV[hɐU蕪AV[hƂɃbNB
+	/// قȂV[hւ݂̏QƂ݂͌ɃubNȂB
+	/// Ճt@C̓ǂݏMemoryBookōsAMoveFrom()Exclusive()Ŏ󂯓nB
+	/// </summary>
+	class ConcurrentBook {
+	public:
+		explicit ConcurrentBook(int num_shards = 1024);
+
+		// MemoryBook̋ǖʂSẴNXɈڂBbook͋ɂȂB
+		// ̃Xbh瑀삳ĂȂԂŌĂяoƁB
+		void MoveFrom(Book::MemoryBook& book);
+
+		// ǖʂɎwo^BMemoryBook::insert()ƓA
+		// overwritetrueŁAw肪łɓo^Ăꍇ́Ȃ񐔂Zď㏑B
+		// on_upsertedɂ͓o^̎w肪nAV[h̃bN܂܌ĂяoB
+		// W[i̋L^̒ʂԍ̎擾ȂǁAǖʂւ̍XV̏mKv鏈ɗpB
+		void Upsert(const std::string& sfen, const Book::BookPos& book_pos, bool overwrite = true,
+			const std::function<void(const Book::BookPos&)>& on_upserted = nullptr);
+
+		// ǖʂ̎w̃Rs[ԂBo^ĂȂꍇ͋̃XgԂB
+		Book::PosMoveList Find(const std::string& sfen) const;
+
+		// ǖʂo^Ă邩ǂԂB
+		bool Contains(const std::string& sfen) const;
+
+		// SẴV[h̃bNASĂ̋ǖʂЂƂMemoryBookɂ܂Ƃ߂ԂfuncĂяoB
+		// func߂Aǖʂ͍ĂуV[hɐU蕪B
+		// Ճt@C̏oȂǂɗpBǖʂ̈ړ̓m[ĥȂւ݂̂ŁARs[͔ȂB
+		void Exclusive(const std::function<void(Book::MemoryBook& book)>& func);
+
+		// o^Ăǖʐ
+		// V[hƂɏɃbN̂ŁÃXbhݒ̏ꍇ͋ߎlƂȂB
+		size_t Size() const;
+
+	private:
+		struct Shard {
+			mutable std::mutex mutex;
+			Book::BookType body;
+		};
+
+		Shard& GetShard(const std::string& sfen);
+		const Shard& GetShard(const std::string& sfen) const;
+
+		const int num_shards_;
+		std::unique_ptr<Shard[]> shards_;
+	};
+}
+
+#endif
+
+#endif
@@ -0,0 +1,377 @@
+#include "tanuki_hashed_book.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <algorithm>
+#include <fstream>
+
+#include "misc.h"
+#include "thread.h"
+#include "usi.h"
+
+using Book::BookPos;
+
+namespace {
+	// nbV\̏Gg[
+	constexpr size_t kInitialNumEntries = 1024;
+	// gp̃Gg[̊𒴂AnbV\2{ɊgB
+	constexpr double kMaxLoadFactor = 0.7;
+
+	// Ճf[^x[X̎w̕16rbg̎wɕϊB
+	// NȂ̂ŕϊɗvI[o[wbh͍ŏ̂ō@̃`FbN͂ȂB
+	Move16 ToMove16(const std::string& move) {
+		if (move == "none" || move == "resign") {
+			return MOVE_NONE;
+		}
+		return USI::to_move16(move);
+	}
+
+	// nbV\̏ʒu߂B
+	size_t ToIndex(const HASH_KEY& key, size_t num_entries) {
+		return static_cast<size_t>(mul_hi64(static_cast<Key>(key), num_entries));
+	}
+}
+
+Tanuki::HashedBook::HashedBook() { Clear(); }
+
+bool Tanuki::HashedBook::Read(const std::string& file_path) {
+	Clear();
+
+	TextFileReader reader;
+	// ReadLine()̎ɍs̖̃Xy[XA^ugBs͎XLbvB
+	reader.SetTrim(true);
+	reader.SkipEmptyLine(true);
+	if (reader.Open(file_path).is_not_ok()) {
+		sync_cout << "info string Failed to open the book file. file_path=" << file_path << sync_endl;
+		return false;
+	}
+
+	Position pos;
+	StateInfo state_info;
+	// ݓǂݍݒ̋ǖʁB萔Ⴂ̏dǖʂǂݔ΂ꍇnullptrƂȂB
+	Entry* entry = nullptr;
+	std::string line;
+	while (reader.ReadLine(line).is_ok()) {
+		// o[WʕƃRgs͓ǂݔ΂B
+		if (line[0] == '#' || line.compare(0, 2, "//") == 0) {
+			continue;
+		}
+
+		if (line.compare(0, 5, "sfen ") == 0) {
+			// ЂƂŐǖʂ̎w̑񐔂Ń\[gȂmvZĂB
+			if (entry) {
+				SortMoves(*entry);
+			}
+
+			pos.set(line.substr(5), &state_info, Threads.main());
+			entry = FindEntry(pos.state()->long_key());
+			if (entry == nullptr) {
+				entry = &FindOrCreateEntry(pos);
+			}
+			else if (pos.game_ply() < entry->ply) {
+				// 萔Ⴂ̏dǖʂ́AMemoryBook::write_book()ƓAႢ萔̂قD悷B
+				entry->move_count = 0;
+				entry->ply = static_cast<uint16_t>(pos.game_ply());
+			}
+			else if (pos.game_ply() > entry->ply) {
+				entry = nullptr;
+			}
+			// 萔̏dǖʂ́AMemoryBook::read_book()ƓA̋ǖʂɎwǉB
+			continue;
+		}
+
+		if (entry == nullptr) {
+			continue;
+		}
+
+		// valueȍ~́Af[^ɌĂ邩ȂB
+		LineScanner scanner(line);
+		Move16 best = ToMove16(scanner.get_text());
+		Move16 next = ToMove16(scanner.get_text());
+		int value = static_cast<int>(scanner.get_number(0));
+		int depth = static_cast<int>(scanner.get_number(0));
+		uint64_t num = static_cast<uint64_t>(scanner.get_number(1));
+
+		BookPos book_pos(best, next, value, depth, num);
+		auto it = std::find(moves_.begin() + entry->move_begin,
+			moves_.begin() + entry->move_begin + entry->move_count, book_pos);
+		if (it != moves_.begin() + entry->move_begin + entry->move_count) {
+			// MemoryBook::insert()ƓȂ񐔂Zď㏑B
+			book_pos.num += it->num;
+			*it = book_pos;
+		}
+		else {
+			AppendMove(*entry, book_pos);
+		}
+	}
+
+	// t@CIƂɂŌ̋ǖʂɑ΂鏈KvB
+	if (entry) {
+		SortMoves(*entry);
+	}
+
+	return true;
+}
+
+bool Tanuki::HashedBook::Write(const std::string& file_path) const {
+	std::ofstream ofs(file_path);
+	if (!ofs) {
+		sync_cout << "info string Failed to open the book file. file_path=" << file_path << sync_endl;
+		return false;
+	}
+
+	// o[Wʗp
+	ofs << "#YANEURAOU-DB2016 1.00\n";
+
+	// MemoryBook::write_book()ƓAsfenŃ\[gĂ珑oB
+	std::vector<std::pair<std::string, const Entry*>> sfen_and_entries;
+	sfen_and_entries.reserve(size_);
+	Position pos;
+	StateInfo state_info;
+	for (const auto& entry : entries_) {
+		// ŵȂۂentry͏oȂB
+		if (!entry.used || entry.move_count == 0) {
+			continue;
+		}
+		pos.set_from_packed_sfen(entry.packed_sfen, &state_info, Threads.main(), false, entry.ply);
+		sfen_and_entries.emplace_back(pos.sfen(), &entry);
+	}
+	std::sort(sfen_and_entries.begin(), sfen_and_entries.end(),
+		[](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+
+	std::vector<BookPos> moves;
+	for (const auto& sfen_and_entry : sfen_and_entries) {
+		const Entry& entry = *sfen_and_entry.second;
+		ofs << "sfen " << sfen_and_entry.first << "\n";
+
+		// ̑񐔂Ń\[gĂB
+		moves.assign(moves_.begin() + entry.move_begin,
+			moves_.begin() + entry.move_begin + entry.move_count);
+		std::stable_sort(moves.begin(), moves.end());
+
+		// wẢÂƂ̕]lAT[Ȃ
+		for (const auto& book_pos : moves) {
+			ofs << book_pos.bestMove << ' ' << book_pos.nextMove << ' ' << book_pos.value << ' '
+				<< book_pos.depth << ' ' << book_pos.num << "\n";
+		}
+	}
+
+	ofs.close();
+	if (ofs.fail()) {
+		sync_cout << "info string Failed to write the book file. file_path=" << file_path << sync_endl;
+		return false;
+	}
+	return true;
+}
+
+bool Tanuki::HashedBook::Contains(const Position& pos) const {
+	return FindEntry(pos.state()->long_key()) != nullptr;
+}
+
+Tanuki::HashedBook::Moves Tanuki::HashedBook::Find(const Position& pos) {
+	Entry* entry = FindEntry(pos.state()->long_key());
+	if (entry == nullptr) {
+		return Moves();
+	}
+	BookPos* begin = moves_.data() + entry->move_begin;
+	return Moves(begin, begin + entry->move_count);
+}
+
+void Tanuki::HashedBook::Upsert(Position& pos, const BookPos& book_pos, bool overwrite) {
+	UpsertMove(FindOrCreateEntry(pos), book_pos, overwrite);
+}
+
+size_t Tanuki::HashedBook::FindIndex(const Position& pos) const {
+	const Entry* entry = FindEntry(pos.state()->long_key());
+	if (entry == nullptr) {
+		return entries_.size();
+	}
+	return entry - entries_.data();
+}
+
+Tanuki::HashedBook::Moves Tanuki::HashedBook::GetMoves(size_t index) {
+	const Entry& entry = entries_[index];
+	BookPos* begin = moves_.data() + entry.move_begin;
+	return Moves(begin, begin + entry.move_count);
+}
+
+void Tanuki::HashedBook::Upsert(size_t index, const BookPos& book_pos, bool overwrite) {
+	UpsertMove(entries_[index], book_pos, overwrite);
+}
+
+void Tanuki::HashedBook::ForEach(const std::function<void(const Entry& entry)>& func) const {
+	for (const auto& entry : entries_) {
+		if (entry.used) {
+			func(entry);
+		}
+	}
+}
+
+void Tanuki::HashedBook::Clear() {
+	entries_.assign(kInitialNumEntries, Entry{});
+	moves_.clear();
+	size_ = 0;
+	num_garbage_moves_ = 0;
+}
+
+const Tanuki::HashedBook::Entry* Tanuki::HashedBook::FindEntry(const HASH_KEY& key) const {
+	// `T@
+	size_t index = ToIndex(key, entries_.size());
+	for (;;) {
+		const Entry& entry = entries_[index];
+		if (!entry.used) {
+			return nullptr;
+		}
+		if (entry.key == key) {
+			return &entry;
+		}
+		if (++index == entries_.size()) {
+			index = 0;
+		}
+	}
+}
+
+Tanuki::HashedBook::Entry* Tanuki::HashedBook::FindEntry(const HASH_KEY& key) {
+	return const_cast<Entry*>(static_cast<const HashedBook*>(this)->FindEntry(key));
+}
+
+Tanuki::HashedBook::Entry& Tanuki::HashedBook::FindOrCreateEntry(Position& pos) {
+	const HASH_KEY key = pos.state()->long_key();
+	uint16_t ply = static_cast<uint16_t>(std::min(pos.game_ply(), static_cast<int>(UINT16_MAX)));
+
+	Entry* found = FindEntry(key);
+	if (found) {
+		// 萔Ⴂ̏dǖʂ́AႢ萔̂قD悷B
+		found->ply = std::min(found->ply, ply);
+		return *found;
+	}
+
+	if (size_ + 1 > entries_.size() * kMaxLoadFactor) {
+		Rehash(entries_.size() * 2);
+	}
+
+	size_t index = ToIndex(key, entries_.size());
+	while (entries_[index].used) {
+		if (++index == entries_.size()) {
+			index = 0;
+		}
+	}
+
+	Entry& entry = entries_[index];
+	entry.key = key;
+	pos.sfen_pack(entry.packed_sfen);
+	entry.move_begin = static_cast<uint32_t>(moves_.size());
+	entry.move_count = 0;
+	entry.move_capacity = 0;
+	entry.ply = ply;
+	entry.used = true;
+	++size_;
+	return entry;
+}
+
+void Tanuki::HashedBook::UpsertMove(Entry& entry, const BookPos& book_pos, bool overwrite) {
+	// łɊi[Ă邩mȂ̂œw肪Ȃ`FbNāAȂΒǉ
+	for (auto it = moves_.begin() + entry.move_begin,
+		end = moves_.begin() + entry.move_begin + entry.move_count; it != end; ++it) {
+		if (!(*it == book_pos)) {
+			continue;
+		}
+
+		if (overwrite) {
+			// łɑ݂Ă̂ŃGg[uB̑񐔂̓CNg
+			uint64_t num = it->num;
+			*it = book_pos;
+			it->num += num;
+		}
+		return;
+	}
+
+	AppendMove(entry, book_pos);
+
+	// ĔzuŎgȂȂw肪ĂlߒB
+	if (num_garbage_moves_ * 2 > moves_.size()) {
+		Compact();
+	}
+}
+
+void Tanuki::HashedBook::Rehash(size_t num_entries) {
+	std::vector<Entry> old_entries(num_entries, Entry{});
+	old_entries.swap(entries_);
+	for (const auto& old_entry : old_entries) {
+		if (!old_entry.used) {
+			continue;
+		}
+
+		size_t index = ToIndex(old_entry.key, entries_.size());
+		while (entries_[index].used) {
+			if (++index == entries_.size()) {
+				index = 0;
+			}
+		}
+		entries_[index] = old_entry;
+	}
+}
+
+void Tanuki::HashedBook::AppendMove(Entry& entry, const BookPos& book_pos) {
+	if (entry.move_count < entry.move_capacity) {
+		moves_[entry.move_begin + entry.move_count++] = book_pos;
+		return;
+	}
+
+	if (entry.move_begin + entry.move_capacity != moves_.size()) {
+		// ̋ǖʂ̎w肪z̖ɂȂ̂ŁAɍĔzuB
+		// push_back()̓rōĊmۂNȂ悤Aɗ̈mۂĂB
+		// KvȕmۂƍĔzûтɔzŜRs[̂ŁAeʂ͔{Xɑ₷B
+		size_t required_capacity = moves_.size() + entry.move_count + 1;
+		if (moves_.capacity() < required_capacity) {
+			moves_.reserve(std::max(moves_.capacity() * 2, required_capacity));
+		}
+		uint32_t move_begin = static_cast<uint32_t>(moves_.size());
+		for (int i = 0; i < entry.move_count; ++i) {
+			moves_.push_back(moves_[entry.move_begin + i]);
+		}
+		num_garbage_moves_ += entry.move_capacity;
+		entry.move_begin = move_begin;
+		entry.move_capacity = entry.move_count;
+	}
+
+	moves_.push_back(book_pos);
+	++entry.move_count;
+	++entry.move_capacity;
+}
+
+void Tanuki::HashedBook::SortMoves(Entry& entry) {
+	auto begin = moves_.begin() + entry.move_begin;
+	auto end = begin + entry.move_count;
+	std::stable_sort(begin, end);
+
+	// o̐K
+	uint64_t num_sum = 0;
+	for (auto it = begin; it != end; ++it) {
+		num_sum += it->num;
+	}
+	num_sum = std::max(num_sum, UINT64_C(1)); // [Z΍
+	for (auto it = begin; it != end; ++it) {
+		it->prob = static_cast<float>(it->num) / num_sum;
+	}
+}
+
+void Tanuki::HashedBook::Compact() {
+	std::vector<BookPos> moves;
+	moves.reserve(moves_.size() - num_garbage_moves_);
+	for (auto& entry : entries_) {
+		if (!entry.used) {
+			continue;
+		}
+		uint32_t move_begin = static_cast<uint32_t>(moves.size());
+		moves.insert(moves.end(), moves_.begin() + entry.move_begin,
+			moves_.begin() + entry.move_begin + entry.move_count);
+		entry.move_begin = move_begin;
+		entry.move_capacity = entry.move_count;
+	}
+	moves_.swap(moves);
+	num_garbage_moves_ = 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _TANUKI_HASHED_BOOK_H_
+#define _TANUKI_HASHED_BOOK_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "extra/book/book.h"
+#include "position.h"
+
+namespace Tanuki {
+	/// <summary>
+	/// ǖʂhash keyL[ƂՃf[^x[XB
+	/// Book::MemoryBooksfenL[Ƃstd::unordered_map̂߁A
+	/// ǖʂƂstd::stringshared_ptr<PosMoveList>q[vɊmۂÂтsfen𐶐ănbVvZB
+	/// ̃NX͋ǖʂopen addressing̃nbV\ɁAwЂƂ̔zɋǖʂƂɘAĊi[B
+	/// sfen̓t@C̓ǂݏ̂Ƃ̂ݗpB
+	/// 萔Ⴂ̓ǖʂ͋ʂAԎႢ萔̋ǖʂƂĈB
+	/// XbhZ[tł͂ȂB
+	/// </summary>
+	class HashedBook {
+	public:
+		struct Entry {
+			HASH_KEY key;
+			PackedSfen packed_sfen;
+			uint32_t move_begin;
+			uint16_t move_count;
+			uint16_t move_capacity;
+			uint16_t ply;
+			bool used;
+		};
+
+		// ǖʂ̎w͈̔
+		// Upsert()ĂяoƖɂȂB
+		class Moves {
+		public:
+			Moves() = default;
+			Moves(Book::BookPos* begin, Book::BookPos* end) : begin_(begin), end_(end) {}
+			Book::BookPos* begin() const { return begin_; }
+			Book::BookPos* end() const { return end_; }
+			size_t size() const { return end_ - begin_; }
+			bool empty() const { return begin_ == end_; }
+			Book::BookPos& operator[](size_t index) const { return begin_[index]; }
+
+		private:
+			Book::BookPos* begin_ = nullptr;
+			Book::BookPos* end_ = nullptr;
+		};
+
+		HashedBook();
+
+		// ˂牤`̒Ճf[^x[XǂݍށB
+		bool Read(const std::string& file_path);
+
+		// ˂牤`̒Ճf[^x[XoBǖʂsfen񏇂Ƀ\[gB
+		bool Write(const std::string& file_path) const;
+
+		// ǖʂo^Ă邩ǂԂB
+		bool Contains(const Position& pos) const;
+
+		// ǖʂ̎wԂBo^ĂȂꍇ͈͋̔͂ԂB
+		Moves Find(const Position& pos);
+
+		// ǖʂɎwo^B
+		// overwritetrueŁAw肪łɓo^Ăꍇ́Ȃ񐔂Zď㏑B
+		void Upsert(Position& pos, const Book::BookPos& book_pos, bool overwrite = true);
+
+		// nbV\̃Gg[BgĂȂGg[܂ށB
+		// ȉ̓Yp֐́Aǖʂ܂Ƃ߂ďۂɁAǖʂƂ̏zŎ߂ɗpB
+		// ǖʂǉȂAGg[̓Y͕ςȂB
+		size_t NumEntries() const { return entries_.size(); }
+		const Entry& GetEntry(size_t index) const { return entries_[index]; }
+
+		// ǖʂ̃Gg[̓YԂBo^ĂȂꍇNumEntries()ԂB
+		size_t FindIndex(const Position& pos) const;
+
+		// Gg[̓YŎw肵ǖʂ̎wԂB
+		Moves GetMoves(size_t index);
+
+		// Gg[̓YŎw肵ǖʂɎwo^B
+		void Upsert(size_t index, const Book::BookPos& book_pos, bool overwrite = true);
+
+		// o^ĂSĂ̋ǖʂɂĊ֐ĂяoB
+		// ֐̒ŋǖʂǉĂ͂ȂȂB
+		void ForEach(const std::function<void(const Entry& entry)>& func) const;
+
+		// o^Ăǖʐ
+		size_t Size() const { return size_; }
+
+		void Clear();
+
+	private:
+		const Entry* FindEntry(const HASH_KEY& key) const;
+		Entry* FindEntry(const HASH_KEY& key);
+		Entry& FindOrCreateEntry(Position& pos);
+		void UpsertMove(Entry& entry, const Book::BookPos& book_pos, bool overwrite);
+		void Rehash(size_t num_entries);
+		void AppendMove(Entry& entry, const Book::BookPos& book_pos);
+		void SortMoves(Entry& entry);
+		void Compact();
+
+		std::vector<Entry> entries_;
+		std::vector<Book::BookPos> moves_;
+		size_t size_ = 0;
+		// w̍ĔzuɂAmoves_̒ŎgȂȂvf
+		size_t num_garbage_moves_ = 0;
+	};
+}
+
+#endif
+
+#endif
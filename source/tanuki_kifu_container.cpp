@@ -0,0 +1,447 @@
+#include "tanuki_kifu_container.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#include "misc.h"
+#include "position.h"
+#include "thread.h"
+
+using Learner::PackedSfenValue;
+using Tanuki::KifuGameSegmentHeader;
+
+namespace {
+	constexpr int kRecordBytes = sizeof(PackedSfenValue);
+	constexpr int kMaskBytes = (kRecordBytes + 7) / 8;
+	constexpr int kBufferSize = 1024 * 1024;
+
+	int SeekFile(FILE* file, int64_t offset) {
+#if defined(_WIN32)
+		return _fseeki64(file, offset, SEEK_SET);
+#else
+		return fseeko(file, offset, SEEK_SET);
+#endif
+	}
+
+	void EncodeXorDelta(const PackedSfenValue* records, size_t num_records, std::vector<uint8_t>& payload) {
+		payload.clear();
+		uint8_t previous[kRecordBytes] = {};
+		for (size_t record_index = 0; record_index < num_records; ++record_index) {
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&records[record_index]);
+			uint8_t mask[kMaskBytes] = {};
+			uint8_t deltas[kRecordBytes];
+			int num_deltas = 0;
+			for (int byte_index = 0; byte_index < kRecordBytes; ++byte_index) {
+				uint8_t delta = bytes[byte_index] ^ previous[byte_index];
+				if (delta) {
+					mask[byte_index / 8] |= 1 << (byte_index % 8);
+					deltas[num_deltas++] = delta;
+				}
+			}
+			payload.insert(payload.end(), mask, mask + kMaskBytes);
+			payload.insert(payload.end(), deltas, deltas + num_deltas);
+			std::memcpy(previous, bytes, kRecordBytes);
+		}
+	}
+
+	bool DecodeXorDelta(const uint8_t* payload, size_t payload_size, size_t num_records, PackedSfenValue* records) {
+		const uint8_t* end = payload + payload_size;
+		uint8_t previous[kRecordBytes] = {};
+		for (size_t record_index = 0; record_index < num_records; ++record_index) {
+			if (end - payload < kMaskBytes) {
+				return false;
+			}
+			const uint8_t* mask = payload;
+			payload += kMaskBytes;
+
+			for (int byte_index = 0; byte_index < kRecordBytes; ++byte_index) {
+				if (mask[byte_index / 8] & (1 << (byte_index % 8))) {
+					if (payload == end) {
+						return false;
+					}
+					previous[byte_index] ^= *payload++;
+				}
+			}
+			std::memcpy(&records[record_index], previous, kRecordBytes);
+		}
+		return payload == end;
+	}
+
+	template <typename T>
+	void Append(std::vector<uint8_t>& payload, const T& value) {
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+		payload.insert(payload.end(), bytes, bytes + sizeof(T));
+	}
+
+	template <typename T>
+	bool Extract(const uint8_t*& payload, const uint8_t* end, T& value) {
+		if (end - payload < static_cast<ptrdiff_t>(sizeof(T))) {
+			return false;
+		}
+		std::memcpy(&value, payload, sizeof(T));
+		payload += sizeof(T);
+		return true;
+	}
+
+	// nextcurrent̋ǖʂ1i߂ǖʂł΁A̎wmoveɊi[trueԂB
+	bool FindPlayedMove(Position& pos, StateInfo* states, Thread* thread, const PackedSfenValue& current,
+		const PackedSfenValue& next, Move16& move) {
+		if (current.last_position || next.gamePly != current.gamePly + 1 ||
+			next.game_result != -current.game_result || next.entering_king != current.entering_king) {
+			return false;
+		}
+
+		if (pos.set_from_packed_sfen(current.sfen, &states[0], thread).is_not_ok()) {
+			return false;
+		}
+
+		auto reaches_next = [&](Move m) {
+			PackedSfen sfen;
+			pos.do_move(m, states[1]);
+			pos.sfen_pack(sfen);
+			pos.undo_move(m);
+			return std::memcmp(&sfen, &next.sfen, sizeof(sfen)) == 0;
+		};
+
+		// ł́APV̏肪̂܂܎wĂB
+		Move pv_move = pos.to_move(Move16(current.move));
+		if (is_ok(pv_move) && pos.pseudo_legal(pv_move) && pos.legal(pv_move) && reaches_next(pv_move)) {
+			move = Move16(pv_move);
+			return true;
+		}
+
+		for (const auto& m : MoveList<LEGAL_ALL>(pos)) {
+			if (m.move != pv_move && reaches_next(m.move)) {
+				move = Move16(m.move);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void EncodeGame(const PackedSfenValue* records, size_t num_records, std::vector<uint8_t>& payload,
+		Thread* thread) {
+		payload.clear();
+		Position pos;
+		StateInfo states[2];
+		std::vector<Move16> played_moves;
+		for (size_t begin = 0; begin < num_records;) {
+			// 1肸i߂ēBł͈͂1ZOgƂB
+			played_moves.clear();
+			size_t end = begin + 1;
+			Move16 move;
+			while (end < num_records && FindPlayedMove(pos, states, thread, records[end - 1], records[end], move)) {
+				played_moves.push_back(move);
+				++end;
+			}
+
+			const auto& first = records[begin];
+			KifuGameSegmentHeader header = {};
+			header.sfen = first.sfen;
+			header.num_records = static_cast<uint32_t>(end - begin);
+			header.game_ply = first.gamePly;
+			header.game_result = first.game_result;
+			header.flags = (first.entering_king ? 1 : 0) | (records[end - 1].last_position ? 2 : 0);
+			Append(payload, header);
+
+			for (size_t record_index = begin; record_index < end; ++record_index) {
+				Append(payload, records[record_index].score);
+				Append(payload, records[record_index].move);
+			}
+
+			std::vector<uint8_t> mask((played_moves.size() + 7) / 8);
+			for (size_t move_index = 0; move_index < played_moves.size(); ++move_index) {
+				if (played_moves[move_index] != Move16(records[begin + move_index].move)) {
+					mask[move_index / 8] |= 1 << (move_index % 8);
+				}
+			}
+			payload.insert(payload.end(), mask.begin(), mask.end());
+
+			for (size_t move_index = 0; move_index < played_moves.size(); ++move_index) {
+				if (mask[move_index / 8] & (1 << (move_index % 8))) {
+					Append(payload, played_moves[move_index].to_u16());
+				}
+			}
+
+			begin = end;
+		}
+	}
+
+	bool DecodeGame(const uint8_t* payload, size_t payload_size, size_t num_records, PackedSfenValue* records,
+		Position& pos, StateInfo* states, Thread* thread) {
+		const uint8_t* end = payload + payload_size;
+		size_t record_index = 0;
+		while (record_index < num_records) {
+			KifuGameSegmentHeader header;
+			if (!Extract(payload, end, header) || header.num_records == 0 ||
+				header.num_records > num_records - record_index) {
+				return false;
+			}
+
+			PackedSfenValue* segment = records + record_index;
+			for (uint32_t index = 0; index < header.num_records; ++index) {
+				auto& record = segment[index];
+				record = {};
+				if (!Extract(payload, end, record.score) || !Extract(payload, end, record.move)) {
+					return false;
+				}
+				record.gamePly = header.game_ply + index;
+				record.game_result = index % 2 ? -header.game_result : header.game_result;
+				record.entering_king = header.flags & 1;
+			}
+			segment[header.num_records - 1].last_position = (header.flags >> 1) & 1;
+
+			size_t num_moves = header.num_records - 1;
+			size_t mask_size = (num_moves + 7) / 8;
+			if (end - payload < static_cast<ptrdiff_t>(mask_size)) {
+				return false;
+			}
+			const uint8_t* mask = payload;
+			payload += mask_size;
+
+			segment[0].sfen = header.sfen;
+			if (pos.set_from_packed_sfen(header.sfen, &states[0], thread).is_not_ok()) {
+				return false;
+			}
+
+			for (size_t move_index = 0; move_index < num_moves; ++move_index) {
+				u16 move16 = segment[move_index].move;
+				if ((mask[move_index / 8] & (1 << (move_index % 8))) && !Extract(payload, end, move16)) {
+					return false;
+				}
+
+				Move m = pos.to_move(Move16(move16));
+				if (!is_ok(m) || !pos.pseudo_legal(m) || !pos.legal(m)) {
+					return false;
+				}
+				// StateInfo͒Őǖʂ̂̂QƂȂ߁A2݂ɗpB
+				pos.do_move(m, states[(move_index + 1) % 2]);
+				pos.sfen_pack(segment[move_index + 1].sfen);
+			}
+
+			record_index += header.num_records;
+		}
+		return payload == end;
+	}
+}
+
+bool Tanuki::WriteKifuContainerHeader(FILE* file) {
+	KifuContainerHeader header = {};
+	std::memcpy(header.magic, kKifuContainerMagic, sizeof(header.magic));
+	header.version = kKifuContainerVersion;
+	return std::fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+bool Tanuki::WriteKifuBlock(FILE* file, const PackedSfenValue* records, size_t num_records,
+	uint32_t block_type, Thread* thread) {
+	std::vector<uint8_t> payload;
+	if (block_type == kKifuBlockTypeGame) {
+		ASSERT_LV3(thread != nullptr);
+		EncodeGame(records, num_records, payload, thread);
+	}
+	else {
+		EncodeXorDelta(records, num_records, payload);
+	}
+
+	KifuBlockHeader header = {};
+	header.type = block_type;
+	header.num_records = static_cast<uint32_t>(num_records);
+	header.payload_size = static_cast<uint32_t>(payload.size());
+	return std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+		std::fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+}
+
+Tanuki::KifuFileReader::KifuFileReader() = default;
+
+Tanuki::KifuFileReader::~KifuFileReader() { Close(); }
+
+bool Tanuki::KifuFileReader::Open(const std::string& file_path) {
+	Close();
+
+	file_path_ = file_path;
+	file_ = std::fopen(file_path.c_str(), "rb");
+	if (file_ == nullptr) {
+		return false;
+	}
+	std::setvbuf(file_, nullptr, _IOFBF, kBufferSize);
+
+	std::error_code error_code;
+	file_size_ = static_cast<int64_t>(std::filesystem::file_size(file_path, error_code));
+
+	KifuContainerHeader header = {};
+	is_container_ = std::fread(&header, sizeof(header), 1, file_) == 1 &&
+		std::memcmp(header.magic, kKifuContainerMagic, sizeof(header.magic)) == 0;
+	if (is_container_ && header.version != kKifuContainerVersion) {
+		sync_cout << "info string Unsupported kifu container version: file_path=" << file_path
+			<< " version=" << header.version << sync_endl;
+		Close();
+		return false;
+	}
+
+	data_offset_ = is_container_ ? sizeof(header) : 0;
+	if (SeekFile(file_, data_offset_)) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void Tanuki::KifuFileReader::Close() {
+	if (file_ != nullptr) {
+		std::fclose(file_);
+		file_ = nullptr;
+	}
+	is_container_ = false;
+	block_.clear();
+	block_position_ = 0;
+	block_offsets_.clear();
+	num_records_ = 0;
+	block_index_built_ = false;
+}
+
+size_t Tanuki::KifuFileReader::Read(PackedSfenValue* records, size_t num_records) {
+	size_t num_read_records = 0;
+	while (num_read_records < num_records) {
+		if (block_position_ == block_.size()) {
+			block_position_ = 0;
+			if (!ReadNextBlock(block_)) {
+				block_.clear();
+				break;
+			}
+		}
+
+		size_t n = std::min(num_records - num_read_records, block_.size() - block_position_);
+		std::memcpy(records + num_read_records, block_.data() + block_position_, n * kRecordBytes);
+		block_position_ += n;
+		num_read_records += n;
+	}
+	return num_read_records;
+}
+
+bool Tanuki::KifuFileReader::Read(PackedSfenValue& record) {
+	return Read(&record, 1) == 1;
+}
+
+size_t Tanuki::KifuFileReader::NumBlocks() {
+	if (!BuildBlockIndex()) {
+		return 0;
+	}
+	return block_offsets_.size();
+}
+
+int64_t Tanuki::KifuFileReader::NumRecords() {
+	if (!BuildBlockIndex()) {
+		return 0;
+	}
+	return num_records_;
+}
+
+// w肵ubNǂݍށBȍ~Read()́AubNǂݍށB
+bool Tanuki::KifuFileReader::ReadBlock(size_t block_index, std::vector<PackedSfenValue>& records) {
+	if (!BuildBlockIndex() || block_index >= block_offsets_.size()) {
+		return false;
+	}
+
+	block_.clear();
+	block_position_ = 0;
+	if (SeekFile(file_, block_offsets_[block_index])) {
+		return false;
+	}
+	return ReadNextBlock(records);
+}
+
+bool Tanuki::KifuFileReader::ReadNextBlock(std::vector<PackedSfenValue>& records) {
+	if (file_ == nullptr) {
+		return false;
+	}
+
+	if (!is_container_) {
+		records.resize(kKifuContainerBlockRecords);
+		records.resize(std::fread(records.data(), kRecordBytes, records.size(), file_));
+		return !records.empty();
+	}
+
+	KifuBlockHeader header = {};
+	if (std::fread(&header, sizeof(header), 1, file_) != 1) {
+		return false;
+	}
+
+	if (header.type != kKifuBlockTypeXorDelta && header.type != kKifuBlockTypeGame) {
+		sync_cout << "info string Unknown kifu block type: file_path=" << file_path_
+			<< " type=" << header.type << sync_endl;
+		return false;
+	}
+
+	if (header.type == kKifuBlockTypeGame && !decoder_thread_) {
+		decoder_thread_ = std::make_unique<Thread>(Threads.size());
+	}
+
+	payload_.resize(header.payload_size);
+	records.resize(header.num_records);
+	if (std::fread(payload_.data(), 1, payload_.size(), file_) != payload_.size() ||
+		!(header.type == kKifuBlockTypeGame
+			? DecodeGame(payload_.data(), payload_.size(), records.size(), records.data(), position_, states_,
+				decoder_thread_.get())
+			: DecodeXorDelta(payload_.data(), payload_.size(), records.size(), records.data()))) {
+		sync_cout << "info string Broken kifu block: file_path=" << file_path_ << sync_endl;
+		records.clear();
+		return false;
+	}
+
+	return true;
+}
+
+// ubNwb_[ɂǂAeubN̈ʒu߂B
+bool Tanuki::KifuFileReader::BuildBlockIndex() {
+	if (file_ == nullptr) {
+		return false;
+	}
+
+	if (block_index_built_) {
+		return true;
+	}
+
+	block_offsets_.clear();
+	num_records_ = 0;
+	if (!is_container_) {
+		int64_t block_bytes = static_cast<int64_t>(kKifuContainerBlockRecords) * kRecordBytes;
+		for (int64_t offset = 0; offset + kRecordBytes <= file_size_; offset += block_bytes) {
+			block_offsets_.push_back(offset);
+		}
+		num_records_ = file_size_ / kRecordBytes;
+	}
+	else {
+		// ݓrœr؂ꂽ̃ubN͊܂߂ȂB
+		int64_t offset = data_offset_;
+		KifuBlockHeader header = {};
+		while (offset + static_cast<int64_t>(sizeof(header)) <= file_size_) {
+			if (SeekFile(file_, offset) || std::fread(&header, sizeof(header), 1, file_) != 1) {
+				return false;
+			}
+			int64_t next_offset = offset + sizeof(header) + header.payload_size;
+			if (next_offset > file_size_) {
+				break;
+			}
+			block_offsets_.push_back(offset);
+			num_records_ += header.num_records;
+			offset = next_offset;
+		}
+	}
+
+	// ǂݍ݈ʒu擪ɖ߂B
+	block_.clear();
+	block_position_ = 0;
+	if (SeekFile(file_, data_offset_)) {
+		return false;
+	}
+
+	block_index_built_ = true;
+	return true;
+}
+
+#endif
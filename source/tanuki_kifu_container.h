@@ -0,0 +1,129 @@
+#ifndef _TANUKI_KIFU_CONTAINER_H_
+#define _TANUKI_KIFU_CONTAINER_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "learn/learn.h"
+#include "position.h"
+
+namespace Tanuki {
+	// kRei
+	// 擪Ƀt@Cwb_[Aȍ~̓ubNwb_[ƃubN{̂̕тƂB
+	// ubN݂͌ɓƗĕł邽߁AubNPʂœǂݔ΂ACӂ̃ubNǂݍ񂾂łB
+	//
+	// kKifuBlockTypeXorDelta:
+	//   eǖʂ𒼑Őǖ(ubN擪ł͑S0)ƂXORŕ\A
+	//   0łȂoCg̈ʒu\5oCg̃rbg}XNƁA0łȂoCg̕тŊi[B
+	//   ΋ǂ̘Aǖʂ́AՖʂ̂wŕω}XȊÕrbg񂪈v邽߁A唼̃oCg0ɂȂB
+	//
+	// kKifuBlockTypeGame:
+	//   ΋ǂ̘AǖʂA擪ǖʂƎw̗ŕ\B
+	//   ubN̓ZOg̕тƂAeZOgKifuGameSegmentHeaderɑāA
+	//   ǖʂƂ̕]lPV̏Awꂽ肪PV̏ƈقȂǖʂ̃rbg}XNA
+	//   قȂꍇ̎wꂽ̕тi[B
+	//   萔EsEʃtO͐擪ǖʂ瓱Aǖʂ͓ǂݍݎɎwĐĕB
+	//   ̋ǖʂ1œBłȂꍇ́AVZOgn߂B
+	constexpr char kKifuContainerMagic[4] = { 'T', 'K', 'C', 'Z' };
+	constexpr uint32_t kKifuContainerVersion = 1;
+	constexpr uint32_t kKifuBlockTypeXorDelta = 1;
+	constexpr uint32_t kKifuBlockTypeGame = 2;
+	// kReiɏoۂ1ubN̋ǖʐ
+	constexpr int kKifuContainerBlockRecords = 16 * 1024;
+
+	struct KifuContainerHeader {
+		char magic[4];
+		uint32_t version;
+	};
+
+	struct KifuBlockHeader {
+		uint32_t type;
+		uint32_t num_records;
+		uint32_t payload_size;
+	};
+
+	struct KifuGameSegmentHeader {
+		PackedSfen sfen;
+		uint32_t num_records;
+		uint16_t game_ply;
+		int8_t game_result;
+		// bit0: entering_king bit1: ZOg̍Ō̋ǖʂlast_position
+		uint8_t flags;
+	};
+
+	// t@C̏o`
+	enum class KifuFormat {
+		// ̊t@C
+		Raw,
+		// kRei(kKifuBlockTypeXorDelta)
+		XorDelta,
+		// kRei(kKifuBlockTypeGame)
+		Game,
+	};
+
+	// t@Cwb_[oB
+	bool WriteKifuContainerHeader(FILE* file);
+
+	// ǖʂ̕т1ubNƂĈkAubNwb_[ƂƂɏoB
+	// block_typeɂkKifuBlockTypeXorDeltakKifuBlockTypeGamew肷B
+	// kKifuBlockTypeGamȅꍇ́Aǖʂi߂ۂPosition::do_move()m[h𐔂XbhthreadɎw肷B
+	bool WriteKifuBlock(FILE* file, const Learner::PackedSfenValue* records, size_t num_records,
+		uint32_t block_type = kKifuBlockTypeXorDelta, Thread* thread = nullptr);
+
+	// ̊t@CƈkReîǂǂݍ߂郊[_[B
+	// t@C̐擪Reĩ}WbNƈv邩ǂŌ`𔻕ʂB
+	class KifuFileReader {
+	public:
+		KifuFileReader();
+		~KifuFileReader();
+		bool Open(const std::string& file_path);
+		bool IsOpen() const { return file_ != nullptr; }
+		void Close();
+
+		// őnum_recordsǖʂǂݍ݁Aǂݍ񂾋ǖʐԂBt@C̏IɒBꍇ0ԂB
+		size_t Read(Learner::PackedSfenValue* records, size_t num_records);
+		bool Read(Learner::PackedSfenValue& record);
+
+		// ubNPʂ̃_ANZX
+		// ̊t@C̏ꍇ́AkKifuContainerBlockRecordsǖʂ1ubNƂ݂ȂB
+		// NumBlocks()/ReadBlock()/NumRecords()͓ǂݍ݈ʒut@C̐擪ɖ߂B
+		// ReadBlock()̌Read()́Aǂݍ񂾃ubNɑubNǂݍށB
+		size_t NumBlocks();
+		bool ReadBlock(size_t block_index, std::vector<Learner::PackedSfenValue>& records);
+		// ǖʐBReȉꍇ̓ubNwb_[̋ǖʐ̍vÅt@C̏ꍇ̓t@CTCY狁߂B
+		int64_t NumRecords();
+
+	private:
+		bool ReadNextBlock(std::vector<Learner::PackedSfenValue>& records);
+		bool BuildBlockIndex();
+
+		std::string file_path_;
+		FILE* file_ = nullptr;
+		bool is_container_ = false;
+		int64_t data_offset_ = 0;
+		int64_t file_size_ = 0;
+		std::vector<Learner::PackedSfenValue> block_;
+		size_t block_position_ = 0;
+		std::vector<uint8_t> payload_;
+		// kKifuBlockTypeGame̋ǖʂ̕ɗp
+		// Xbh͒TXbhƂ͕ʂɁAŏkKifuBlockTypeGamẽubNǂݍ񂾂ƂɐB
+		Position position_;
+		StateInfo states_[2];
+		std::unique_ptr<Thread> decoder_thread_;
+		// Reȉꍇ̊eubNwb_[̈ʒu
+		std::vector<int64_t> block_offsets_;
+		int64_t num_records_ = 0;
+		bool block_index_built_ = false;
+	};
+}
+
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+#include "tanuki_kifu_deduplicator.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+
+#include "misc.h"
+#include "tanuki_kifu_reader.h"
+#include "tanuki_kifu_writer.h"
+
+using Learner::PackedSfenValue;
+using USI::Option;
+
+namespace {
+	static const constexpr char* kDeduplicatedKifuDir = "DeduplicatedKifuDir";
+	// o񐔂̌vɗp郁 (MB)
+	// قȂǖʂ̐ɑ΂ďƁAdĂȂǖʂ菜₷ȂB
+	// قȂǖ132oCgx΁AĎ菜ǖʂ0.1%ƂȂB
+	static const constexpr char* kDeduplicateKifuMemoryMb = "DeduplicateKifuMemoryMB";
+	// ǖʂcő̉
+	static const constexpr char* kDeduplicateKifuMaxOccurrences = "DeduplicateKifuMaxOccurrences";
+
+	uint64_t Mix(uint64_t x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	uint64_t Hash(const PackedSfen& sfen) {
+		uint64_t words[sizeof(sfen) / sizeof(uint64_t)];
+		std::memcpy(words, &sfen, sizeof(words));
+		uint64_t hash = 0;
+		for (auto word : words) {
+			hash = Mix(hash ^ word);
+		}
+		return hash;
+	}
+}
+
+Tanuki::KifuDeduplicator::KifuDeduplicator(int64_t memory_bytes, int max_occurrences)
+	: max_occurrences_(std::clamp(max_occurrences, 1, UINT8_MAX - 1)),
+	blocks_(std::max<int64_t>(1, memory_bytes / static_cast<int64_t>(sizeof(Block)))),
+	mutexes_(std::make_unique<std::mutex[]>(kNumLockStripes)) {}
+
+bool Tanuki::KifuDeduplicator::Add(const PackedSfen& sfen) {
+	uint64_t hash = Hash(sfen);
+	size_t block_index = hash % blocks_.size();
+	// ubÑJE^[̈ʒúAubN̑IƂ͕ʂɝanbVl猈߂B
+	uint64_t counter_hash = Mix(hash ^ 0x9e3779b97f4a7c15ULL);
+	int counter_indices[kNumCountersPerKey];
+	for (int i = 0; i < kNumCountersPerKey; ++i) {
+		counter_indices[i] = (counter_hash >> (i * 6)) % kNumCountersPerBlock;
+	}
+
+	auto& counters = blocks_[block_index].counters;
+	std::lock_guard<std::mutex> lock(mutexes_[block_index % kNumLockStripes]);
+	int count = UINT8_MAX;
+	for (int counter_index : counter_indices) {
+		count = std::min<int>(count, counters[counter_index]);
+	}
+
+	if (count >= max_occurrences_) {
+		return false;
+	}
+
+	// ŏl̃JE^[݂̂𑝂₵A̋ǖʂ̏o񐔂ւ̉e}B
+	for (int counter_index : counter_indices) {
+		if (counters[counter_index] == count) {
+			++counters[counter_index];
+		}
+	}
+	return true;
+}
+
+void Tanuki::InitializeDeduplicator(USI::OptionsMap& o) {
+	o[kDeduplicatedKifuDir] << Option("kifu_deduplicated");
+	o[kDeduplicateKifuMemoryMb] << Option(1024, 1, INT_MAX);
+	o[kDeduplicateKifuMaxOccurrences] << Option(1, 1, UINT8_MAX - 1);
+}
+
+std::unique_ptr<Tanuki::KifuDeduplicator> Tanuki::CreateKifuDeduplicator() {
+	int64_t memory_bytes = static_cast<int64_t>(Options[kDeduplicateKifuMemoryMb]) * 1024 * 1024;
+	int max_occurrences = Options[kDeduplicateKifuMaxOccurrences];
+	return std::make_unique<KifuDeduplicator>(memory_bytes, max_occurrences);
+}
+
+void Tanuki::DeduplicateKifu() {
+	std::string kifu_dir = Options["KifuDir"];
+	std::string deduplicated_kifu_dir = Options[kDeduplicatedKifuDir];
+
+	sync_cout << "info string kifu_dir=" << kifu_dir << sync_endl;
+	sync_cout << "info string deduplicated_kifu_dir=" << deduplicated_kifu_dir << sync_endl;
+	sync_cout << "info string memory_mb=" << static_cast<int>(Options[kDeduplicateKifuMemoryMb]) << sync_endl;
+	sync_cout << "info string max_occurrences=" << static_cast<int>(Options[kDeduplicateKifuMaxOccurrences])
+		<< sync_endl;
+
+	std::error_code error_code;
+	std::filesystem::create_directories(deduplicated_kifu_dir, error_code);
+
+	auto deduplicator = CreateKifuDeduplicator();
+	// 菜ǖʂlast_position𓯂΋ǂ̋ǖʂɈp߁Aet@C̋ǖʂ΋ǂ̏ɕԂ悤A
+	// ǂݍ݃Xbh1ƂB
+	KifuReader reader(kifu_dir, 1, 1);
+	KifuWriter writer(deduplicated_kifu_dir + "/deduplicated.bin");
+	int64_t num_records = 0;
+	int64_t num_written_records = 0;
+	// cǖʂ̂A܂oĂȂŌ̋ǖ
+	// ΋ǂ̈ȍ~̋ǖʂSĎ菜ꂽꍇɁA΋ǂ̍Ō̋ǖʂƂ邽߁A̋ǖʂc܂ŏoȂB
+	Learner::PackedSfenValue pending_record = {};
+	bool has_pending_record = false;
+	KifuReader::Batch batch;
+	while (reader.Read(batch)) {
+		for (const auto& record : batch) {
+			if (deduplicator->Add(record.sfen)) {
+				if (has_pending_record && !writer.Write(pending_record)) {
+					sync_cout << "info string Failed to write a record to a kifu file. " << sync_endl;
+					return;
+				}
+				pending_record = record;
+				has_pending_record = true;
+				++num_written_records;
+			}
+			else if (record.last_position && has_pending_record) {
+				// ΋ǂ̍Ō̋ǖʂ菜ꂽꍇ́AcŌ̋ǖʂ΋ǂ̍ŌƂB
+				// ɑ΋ǂ̍Ō̋ǖʂƂȂĂꍇ́AȎ΋ǂ̋ǖʂȂ̂ŕύXȂB
+				pending_record.last_position = true;
+			}
+
+			if (++num_records % 10000000 == 0) {
+				sync_cout << "info string " << num_records << " num_written_records=" << num_written_records
+					<< " records_per_second=" << reader.GetRecordsPerSecond() << sync_endl;
+			}
+		}
+	}
+
+	if ((has_pending_record && !writer.Write(pending_record)) || !writer.Close()) {
+		sync_cout << "info string Failed to write a record to a kifu file. " << sync_endl;
+		return;
+	}
+
+	sync_cout << "info string num_records=" << num_records << " num_written_records=" << num_written_records
+		<< sync_endl;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _TANUKI_KIFU_DEDUPLICATOR_H_
+#define _TANUKI_KIFU_DEDUPLICATOR_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "position.h"
+#include "usi.h"
+
+namespace Tanuki {
+	// ǖʂƂ̏o񐔂𐔂A𒴂ǖʂ菜B
+	// o񐔂PackedSfeñnbVlL[ƂubNJEeBOBloomtB^[ŋߎB
+	// 1ǖʂ̃JE^[1LbVCɎ܂ubÑ̕JE^[ƂA̍ŏlo񐔂Ƃ݂ȂB
+	// o񐔂͑߂Ɍς邱Ƃ͂ĂȂς邱Ƃ͂Ȃ߁A
+	// ȉ̋ǖʂ菜邱Ƃ͋Hɂ邪A𒴂ǖʂc邱Ƃ͂ȂB
+	// ̃Xbh瓯ɌĂяoB
+	class KifuDeduplicator {
+	public:
+		KifuDeduplicator(int64_t memory_bytes, int max_occurrences);
+		// ǖʂ𐔂Ao񐔂max_occurrencesȉłtrueԂB
+		bool Add(const PackedSfen& sfen);
+
+	private:
+		static constexpr int kNumCountersPerBlock = 64;
+		static constexpr int kNumCountersPerKey = 4;
+		static constexpr int kNumLockStripes = 4096;
+
+		struct alignas(64) Block {
+			uint8_t counters[kNumCountersPerBlock];
+		};
+
+		const int max_occurrences_;
+		std::vector<Block> blocks_;
+		std::unique_ptr<std::mutex[]> mutexes_;
+	};
+
+	void InitializeDeduplicator(USI::OptionsMap& o);
+	// KifuDir̊dǖʂ菜ADeduplicatedKifuDirɏoB
+	void DeduplicateKifu();
+	// DeduplicateKifuMemoryMBDeduplicateKifuMaxOccurrencesɏ]KifuDeduplicatorB
+	std::unique_ptr<KifuDeduplicator> CreateKifuDeduplicator();
+}
+
+#endif
+
+#endif
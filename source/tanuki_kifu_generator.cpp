@@ -5,10 +5,12 @@
 
 #include <direct.h>
 #include <omp.h>
+#include <algorithm>
 #include <atomic>
 #include <cmath>
 #include <cstdlib>
 #include <ctime>
+#include <filesystem>
 #include <fstream>
 #include <memory>
 #include <random>
@@ -16,7 +18,10 @@
 
 #include "misc.h"
 #include "search.h"
+#include "tanuki_kifu_container.h"
+#include "tanuki_kifu_deduplicator.h"
 #include "tanuki_kifu_writer.h"
+#include "tanuki_progress.h"
 #include "tanuki_progress_report.h"
 #include "thread.h"
 #include "learn/learn.h"
@@ -33,6 +38,11 @@ namespace {
 	constexpr int kMaxGamePlay = 400;
 	constexpr int kMaxSwapTrials = 10;
 	constexpr int kMaxTrialsToSelectSquares = 100;
+	constexpr int kNodeBudgetReportIntervalSec = 10 * 60;
+	// ConvertSfenToLearningData()ŊeXbhxɓǂݍsfen̍s
+	constexpr int kSfenBlockLines = 256;
+	// ConvertSfenToLearningData()ŊeXbh݂܂Ƃ߂ǖʐ
+	constexpr int kOutputBatchRecords = 16 * 1024;
 
 	enum GameResult {
 		GameResultWin = 1,
@@ -49,6 +59,14 @@ namespace {
 	constexpr char* kOptionGeneratorOptimumNodesSearched = "GeneratorOptimumNodesSearched";
 	constexpr char* kOptionGeneratorMeasureDepth = "GeneratorMeasureDepth";
 	constexpr char* kOptionGeneratorStartPositionMaxPlay = "GeneratorStartPositionMaxPlay";
+	constexpr char* kOptionGeneratorFsyncIntervalSec = "GeneratorFsyncIntervalSec";
+	constexpr char* kOptionGeneratorKifuFormat = "GeneratorKifuFormat";
+	constexpr char* kOptionGeneratorCheckpointIntervalSec = "GeneratorCheckpointIntervalSec";
+	constexpr char* kOptionGeneratorResumeStartTime = "GeneratorResumeStartTime";
+	constexpr char* kOptionGeneratorNodeBudgetMode = "GeneratorNodeBudgetMode";
+	constexpr char* kOptionGeneratorTargetPositionsPerSec = "GeneratorTargetPositionsPerSec";
+	constexpr char* kOptionGeneratorTargetDepth = "GeneratorTargetDepth";
+	constexpr char* kOptionGeneratorDeduplicate = "GeneratorDeduplicate";
 	constexpr char* kOptionConvertSfenToLearningDataInputSfenFileName =
 		"ConvertSfenToLearningDataInputSfenFileName";
 	constexpr char* kOptionConvertSfenToLearningDataSearchDepth =
@@ -123,6 +141,249 @@ namespace {
 		}
 		return value;
 	}
+
+	enum class NodeBudgetMode {
+		Fixed,
+		PositionsPerSec,
+		Depth,
+	};
+
+	// XbhƂɁA1ǖʂ̒Tm[h߂B
+	// m[hAPositionsPerSecł͌vNPSADepthł͊T[Ƃ̍璲A
+	// isx̐lꍇ͒Ղ̋ǖʂقǑzB
+	class NodeBudgetScheduler {
+	public:
+		NodeBudgetScheduler(NodeBudgetMode mode, uint64_t initial_nodes, double target_seconds_per_position,
+			int target_depth, Tanuki::Progress* progress)
+			: mode_(mode), fixed_nodes_(initial_nodes),
+			base_nodes_(initial_nodes ? static_cast<double>(initial_nodes) : kDefaultNodes),
+			target_seconds_per_position_(target_seconds_per_position), target_depth_(target_depth),
+			progress_(progress), average_depth_(target_depth) {}
+
+		// Tm[h̏ԂB0̏ꍇ͏ȂB
+		uint64_t GetNodes(const Position& pos) {
+			if (mode_ == NodeBudgetMode::Fixed) {
+				return fixed_nodes_;
+			}
+
+			double phase_weight = 1.0;
+			if (progress_) {
+				// ՂƏIՂ0.25{AՂő1.25{ƂB
+				double p = progress_->Estimate(pos);
+				phase_weight = 0.25 + 4.0 * p * (1.0 - p);
+			}
+			// z̕ςm[hƈv悤Ad݂̕ςŊB
+			average_phase_weight_ += (phase_weight - average_phase_weight_) * kAverageRate;
+			double nodes = base_nodes_ * phase_weight / average_phase_weight_;
+			return static_cast<uint64_t>(std::clamp(nodes, kMinNodes, kMaxNodes));
+		}
+
+		// Tʂ𔽉fBelapsed͒Tɂ(~b)B
+		void Update(uint64_t nodes, TimePoint elapsed, int completed_depth) {
+			average_depth_ += (completed_depth - average_depth_) * kAverageRate;
+
+			if (mode_ == NodeBudgetMode::Depth) {
+				base_nodes_ *= std::exp(kDepthGain * (target_depth_ - average_depth_));
+				base_nodes_ = std::clamp(base_nodes_, kMinNodes, kMaxNodes);
+				return;
+			}
+
+			// 1̒T͐~bŏI邱Ƃ邽߁A1bȏ㗭܂ĂNPSXVB
+			window_nodes_ += nodes;
+			window_elapsed_ += elapsed;
+			if (window_elapsed_ < 1000) {
+				return;
+			}
+
+			double nps = window_nodes_ * 1000.0 / window_elapsed_;
+			nps_ = nps_ ? nps_ + (nps - nps_) * kNpsAverageRate : nps;
+			window_nodes_ = 0;
+			window_elapsed_ = 0;
+
+			if (mode_ == NodeBudgetMode::PositionsPerSec) {
+				base_nodes_ = std::clamp(nps_ * target_seconds_per_position_, kMinNodes, kMaxNodes);
+			}
+		}
+
+		double GetBaseNodes() const { return base_nodes_; }
+		double GetNps() const { return nps_; }
+		double GetAverageDepth() const { return average_depth_; }
+
+	private:
+		static constexpr double kDefaultNodes = 100000.0;
+		static constexpr double kMinNodes = 1000.0;
+		static constexpr double kMaxNodes = 1e9;
+		static constexpr double kAverageRate = 0.01;
+		static constexpr double kNpsAverageRate = 0.1;
+		// ϒT[ڕW1ĂƂɁA1ǖʂɊm[hω銄(ΐ)
+		static constexpr double kDepthGain = 0.002;
+
+		const NodeBudgetMode mode_;
+		const uint64_t fixed_nodes_;
+		double base_nodes_;
+		const double target_seconds_per_position_;
+		const int target_depth_;
+		Tanuki::Progress* const progress_;
+		double average_phase_weight_ = 1.0;
+		double average_depth_;
+		double nps_ = 0.0;
+		uint64_t window_nodes_ = 0;
+		TimePoint window_elapsed_ = 0;
+	};
+
+	// t@C̍s𐔂BJȂꍇ-1ԂB
+	int64_t CountLines(const std::string& file_path) {
+		FILE* file = std::fopen(file_path.c_str(), "rb");
+		if (file == nullptr) {
+			return -1;
+		}
+
+		std::vector<char> buffer(1024 * 1024);
+		int64_t num_lines = 0;
+		char last_char = '\n';
+		size_t size;
+		while ((size = std::fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+			num_lines += std::count(buffer.data(), buffer.data() + size, '\n');
+			last_char = buffer[size - 1];
+		}
+		std::fclose(file);
+
+		// Ō̍ssŏIĂȂꍇ1sƐB
+		return num_lines + (last_char != '\n');
+	}
+
+	// ̃XbhAeLXgt@C𐔕Ss܂Ƃ߂ēǂݍށB
+	class SfenBlockReader {
+	public:
+		explicit SfenBlockReader(const std::string& file_path) : buffer_(1024 * 1024) {
+			ifs_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+			ifs_.open(file_path);
+		}
+
+		bool IsOpen() const { return ifs_.is_open(); }
+
+		// őnum_linessǂݍށBǂݍލsȂꍇfalseԂB
+		bool Read(int num_lines, std::vector<std::string>& lines) {
+			lines.clear();
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::string line;
+			while (static_cast<int>(lines.size()) < num_lines && std::getline(ifs_, line)) {
+				lines.push_back(std::move(line));
+			}
+			return !lines.empty();
+		}
+
+	private:
+		std::vector<char> buffer_;
+		std::ifstream ifs_;
+		std::mutex mutex_;
+	};
+
+	// XbhƂ̍ĊJp̏
+	// t@Cfile_size܂ŏoI_̋ǖʐƗ̏ԂێB
+	struct GeneratorCheckpoint {
+		int64_t num_records = 0;
+		int64_t file_size = 0;
+		std::string kifu_format;
+		std::string random_state;
+	};
+
+	std::string GetOutputFilePath(const std::string& kifu_directory, const std::string& output_file_name_tag,
+		int search_depth, int64_t num_positions, time_t start_time, int thread_index) {
+		char output_file_path[1024];
+		std::sprintf(output_file_path,
+			"%s/kifu.tag=%s.depth=%d.num_positions=%I64d.start_time=%I64d.thread_index=%03d.bin",
+			kifu_directory.c_str(), output_file_name_tag.c_str(), search_depth, num_positions,
+			static_cast<int64_t>(start_time), thread_index);
+		return output_file_path;
+	}
+
+	std::string GetCheckpointFilePath(const std::string& output_file_path) {
+		return output_file_path + ".checkpoint";
+	}
+
+	bool ReadCheckpoint(const std::string& output_file_path, GeneratorCheckpoint& checkpoint) {
+		std::ifstream ifs(GetCheckpointFilePath(output_file_path));
+		if (!ifs.is_open()) {
+			return false;
+		}
+
+		std::string line;
+		while (std::getline(ifs, line)) {
+			auto separator = line.find('=');
+			if (separator == std::string::npos) {
+				continue;
+			}
+			std::string key = line.substr(0, separator);
+			std::string value = line.substr(separator + 1);
+			if (key == "num_records") {
+				checkpoint.num_records = std::atoll(value.c_str());
+			}
+			else if (key == "file_size") {
+				checkpoint.file_size = std::atoll(value.c_str());
+			}
+			else if (key == "kifu_format") {
+				checkpoint.kifu_format = value;
+			}
+			else if (key == "random_state") {
+				checkpoint.random_state = value;
+			}
+		}
+		return !checkpoint.random_state.empty();
+	}
+
+	// orŋIĂÕ`FbN|CgȂ悤Aꎞt@CɏoĂuB
+	bool WriteCheckpoint(const std::string& output_file_path, const GeneratorCheckpoint& checkpoint) {
+		std::string checkpoint_file_path = GetCheckpointFilePath(output_file_path);
+		std::string temporary_file_path = checkpoint_file_path + ".tmp";
+		{
+			std::ofstream ofs(temporary_file_path);
+			ofs << "num_records=" << checkpoint.num_records << std::endl;
+			ofs << "file_size=" << checkpoint.file_size << std::endl;
+			ofs << "kifu_format=" << checkpoint.kifu_format << std::endl;
+			ofs << "random_state=" << checkpoint.random_state << std::endl;
+			if (!ofs) {
+				return false;
+			}
+		}
+
+		std::error_code error_code;
+		std::filesystem::rename(temporary_file_path, checkpoint_file_path, error_code);
+		return !error_code;
+	}
+
+	// `FbN|Cgǂݍ݁At@C`FbN|Cg_̃TCYɐ؂l߂B
+	// `FbN|Cgȍ~ɏoꂽǖʂ́AĊJɓ񂩂琶B
+	bool ResumeFromCheckpoint(const std::string& output_file_path, const std::string& kifu_format,
+		GeneratorCheckpoint& checkpoint) {
+		if (!ReadCheckpoint(output_file_path, checkpoint)) {
+			return false;
+		}
+
+		if (checkpoint.kifu_format != kifu_format) {
+			sync_cout << "info string The kifu format does not match the checkpoint. Exitting...: output_file_path="
+				<< output_file_path << " kifu_format=" << checkpoint.kifu_format << sync_endl;
+			std::exit(1);
+		}
+
+		std::error_code error_code;
+		int64_t file_size = static_cast<int64_t>(std::filesystem::file_size(output_file_path, error_code));
+		if (error_code || file_size < checkpoint.file_size) {
+			sync_cout << "info string The kifu file is shorter than the checkpoint. Exitting...: output_file_path="
+				<< output_file_path << " file_size=" << file_size << " checkpoint.file_size="
+				<< checkpoint.file_size << sync_endl;
+			std::exit(1);
+		}
+
+		std::filesystem::resize_file(output_file_path, checkpoint.file_size, error_code);
+		if (error_code) {
+			sync_cout << "info string Failed to truncate the kifu file. Exitting...: output_file_path="
+				<< output_file_path << sync_endl;
+			std::exit(1);
+		}
+
+		return true;
+	}
 }
 
 void Tanuki::InitializeGenerator(USI::OptionsMap& o) {
@@ -135,6 +396,26 @@ void Tanuki::InitializeGenerator(USI::OptionsMap& o) {
 	o[kOptionGeneratorOptimumNodesSearched] << Option("0");
 	o[kOptionGeneratorMeasureDepth] << Option(false);
 	o[kOptionGeneratorStartPositionMaxPlay] << Option(320, 1, 320);
+	// 0̏ꍇAt@C𖾎IɃfBXNɓȂ
+	o[kOptionGeneratorFsyncIntervalSec] << Option(0, 0, 24 * 60 * 60);
+	// raw: ̊t@C delta: kRei(XOR) game: kRei(擪ǖʂƎw̗)
+	std::vector<std::string> kifu_format_list = { "raw", "delta", "game" };
+	o[kOptionGeneratorKifuFormat] << Option(kifu_format_list, kifu_format_list[0]);
+	// 0̏ꍇA`FbN|CgoȂ
+	o[kOptionGeneratorCheckpointIntervalSec] << Option(10 * 60, 0, 24 * 60 * 60);
+	// 0ȊȌꍇAstart_timeŎn߂`FbN|CgĊJ
+	o[kOptionGeneratorResumeStartTime] << Option("0");
+	// fixed: SĂ̋ǖʂGeneratorOptimumNodesSearchedŒT
+	// positions_per_sec: xGeneratorTargetPositionsPerSecɂȂ悤Tm[h𒲐
+	// depth: ϒT[GeneratorTargetDepthɂȂ悤Tm[h𒲐
+	// ̏ꍇGeneratorSearchDepthT[̏ƂB
+	std::vector<std::string> node_budget_mode_list = { "fixed", "positions_per_sec", "depth" };
+	o[kOptionGeneratorNodeBudgetMode] << Option(node_budget_mode_list, node_budget_mode_list[0]);
+	// SXbhv1b̐ǖʐ
+	o[kOptionGeneratorTargetPositionsPerSec] << Option(1000, 1, INT_MAX);
+	o[kOptionGeneratorTargetDepth] << Option(8, 1, MAX_PLY);
+	// truȅꍇADeduplicateKifuMaxOccurrences𒴂ďoǖʂoȂ
+	o[kOptionGeneratorDeduplicate] << Option(false);
 	o[kOptionConvertSfenToLearningDataInputSfenFileName] << Option("nyugyoku_win.sfen");
 	o[kOptionConvertSfenToLearningDataSearchDepth] << Option(12, 1, MAX_PLY);
 	o[kOptionConvertSfenToLearningDataOutputFileName] << Option("nyugyoku_win.bin");
@@ -193,20 +474,49 @@ void Tanuki::GenerateKifu() {
 	std::string kifu_directory = (std::string)Options["KifuDir"];
 	_mkdir(kifu_directory.c_str());
 
-	int search_depth = Options[kOptionGeneratorSearchDepth];
 	int64_t num_positions = ParseOptionOrDie<int64_t>(kOptionGeneratorNumPositions);
-	int value_threshold = Options[kOptionGeneratorValueThreshold];
+	int search_depth = Options[kOptionGeneratorSearchDepth];
 	std::string output_file_name_tag = Options[kOptionGeneratorKifuTag];
+	int value_threshold = Options[kOptionGeneratorValueThreshold];
 	uint64_t optimum_nodes_searched =
 		ParseOptionOrDie<uint64_t>(kOptionGeneratorOptimumNodesSearched);
 	bool measure_depth = Options[kOptionGeneratorMeasureDepth];
+	int fsync_interval_sec = Options[kOptionGeneratorFsyncIntervalSec];
+	std::string kifu_format_name = Options[kOptionGeneratorKifuFormat];
+	KifuFormat kifu_format = kifu_format_name == "game" ? KifuFormat::Game
+		: kifu_format_name == "delta" ? KifuFormat::XorDelta : KifuFormat::Raw;
+	int checkpoint_interval_sec = Options[kOptionGeneratorCheckpointIntervalSec];
+	int64_t resume_start_time = ParseOptionOrDie<int64_t>(kOptionGeneratorResumeStartTime);
+	std::string node_budget_mode_name = Options[kOptionGeneratorNodeBudgetMode];
+	NodeBudgetMode node_budget_mode = node_budget_mode_name == "positions_per_sec" ? NodeBudgetMode::PositionsPerSec
+		: node_budget_mode_name == "depth" ? NodeBudgetMode::Depth : NodeBudgetMode::Fixed;
+	int target_positions_per_sec = Options[kOptionGeneratorTargetPositionsPerSec];
+	int target_depth = Options[kOptionGeneratorTargetDepth];
+	bool deduplicate = Options[kOptionGeneratorDeduplicate];
 
-	std::cout << "search_depth=" << search_depth << std::endl;
 	std::cout << "num_positions=" << num_positions << std::endl;
-	std::cout << "value_threshold=" << value_threshold << std::endl;
+	std::cout << "search_depth=" << search_depth << std::endl;
 	std::cout << "output_file_name_tag=" << output_file_name_tag << std::endl;
+	std::cout << "value_threshold=" << value_threshold << std::endl;
 	std::cout << "optimum_nodes_searched=" << optimum_nodes_searched << std::endl;
 	std::cout << "measure_depth=" << measure_depth << std::endl;
+	std::cout << "fsync_interval_sec=" << fsync_interval_sec << std::endl;
+	std::cout << "kifu_format=" << kifu_format_name << std::endl;
+	std::cout << "checkpoint_interval_sec=" << checkpoint_interval_sec << std::endl;
+	std::cout << "resume_start_time=" << resume_start_time << std::endl;
+	std::cout << "node_budget_mode=" << node_budget_mode_name << std::endl;
+	std::cout << "target_positions_per_sec=" << target_positions_per_sec << std::endl;
+	std::cout << "target_depth=" << target_depth << std::endl;
+	std::cout << "deduplicate=" << deduplicate << std::endl;
+
+	// isxɉTm[h̔zɗpBǂݍ߂Ȃꍇ͑SĂ̋ǖʂ𓯂d݂ƂB
+	std::unique_ptr<Progress> progress;
+	if (node_budget_mode != NodeBudgetMode::Fixed) {
+		progress = std::make_unique<Progress>();
+		if (!progress->Load()) {
+			progress.reset();
+		}
+	}
 
 	Search::LimitsType limits;
 	// ̎萔t߂ň̒lԂ̂h1 << 16ɂ
@@ -221,11 +531,45 @@ void Tanuki::GenerateKifu() {
 
 	time_t start_time;
 	std::time(&start_time);
+	if (resume_start_time) {
+		// o̓t@CƗ̎ĊJƑ
+		start_time = static_cast<time_t>(resume_start_time);
+	}
 	ASSERT_LV3(start_positions.size());
 	std::uniform_int_distribution<> start_positions_index(0, static_cast<int>(start_positions.size() - 1));
 	// XbhԂŋL
 	std::atomic_int64_t global_position_index;
 	global_position_index = 0;
+
+	// eXbhn߂OɁASXbh̍ĊJʒu߂ĂB
+	std::vector<GeneratorCheckpoint> checkpoints(num_threads);
+	std::vector<bool> resumed(num_threads);
+	// SXbhŋL
+	std::unique_ptr<KifuDeduplicator> deduplicator;
+	if (deduplicate) {
+		deduplicator = CreateKifuDeduplicator();
+	}
+	if (resume_start_time) {
+		for (int thread_index = 0; thread_index < num_threads; ++thread_index) {
+			std::string output_file_path = GetOutputFilePath(kifu_directory, output_file_name_tag,
+				search_depth, num_positions, start_time, thread_index);
+			resumed[thread_index] =
+				ResumeFromCheckpoint(output_file_path, kifu_format_name, checkpoints[thread_index]);
+			if (resumed[thread_index]) {
+				global_position_index += checkpoints[thread_index].num_records;
+			}
+
+			// oς݂̋ǖʂ𐔂AĊJɏdďoȂ悤ɂB
+			KifuFileReader file;
+			Learner::PackedSfenValue record;
+			if (deduplicator && resumed[thread_index] && file.Open(output_file_path)) {
+				while (file.Read(record)) {
+					deduplicator->Add(record.sfen);
+				}
+			}
+		}
+		sync_cout << "info string Resumed from checkpoints: num_positions=" << global_position_index << sync_endl;
+	}
 	ProgressReport progress_report(num_positions, 60 * 60);
 	std::mutex mutex_game_play_to_depths;
 	std::atomic<bool> need_wait = false;
@@ -234,15 +578,40 @@ void Tanuki::GenerateKifu() {
 	{
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
-		char output_file_path[1024];
-		std::sprintf(output_file_path,
-			"%s/kifu.tag=%s.depth=%d.num_positions=%I64d.start_time=%I64d.thread_index=%03d.bin",
-			kifu_directory.c_str(), output_file_name_tag.c_str(), search_depth, num_positions,
-			start_time, thread_index);
+		std::string output_file_path = GetOutputFilePath(kifu_directory, output_file_name_tag, search_depth,
+			num_positions, start_time, thread_index);
 		// eXbhɎ
-		std::unique_ptr<KifuWriter> kifu_writer =
-			std::make_unique<KifuWriter>(output_file_path);
+		// ĊJꍇ́A`FbN|Cg_܂Ő؂l߂t@CɒǋLB
+		std::unique_ptr<KifuWriter> kifu_writer = std::make_unique<KifuWriter>(
+			output_file_path, fsync_interval_sec, kifu_format, resumed[thread_index]);
+		// ̎start_timeƃXbhԍ猈߂B
+		// ĊJꍇ́A`FbN|Cg_̏Ԃ瑱邱ƂŁA΋ǂ𐶐Ȃ悤ɂB
 		std::mt19937_64 mt19937_64(start_time + thread_index);
+		GeneratorCheckpoint& checkpoint = checkpoints[thread_index];
+		if (resumed[thread_index]) {
+			std::istringstream iss(checkpoint.random_state);
+			iss >> mt19937_64;
+		}
+		checkpoint.kifu_format = kifu_format_name;
+		time_t last_checkpoint_time = std::time(nullptr);
+		// eXbhxŐƉ肵A1Xbh1ǖʂ̒TԂ̖ڕW߂B
+		NodeBudgetScheduler node_budget_scheduler(node_budget_mode, optimum_nodes_searched,
+			static_cast<double>(num_threads) / target_positions_per_sec, target_depth, progress.get());
+		time_t last_node_budget_report_time = std::time(nullptr);
+
+		// oǖʐƗ̏Ԃ`FbN|CgƂďoB
+		auto save_checkpoint = [&]() {
+			std::ostringstream oss;
+			oss << mt19937_64;
+			checkpoint.random_state = oss.str();
+			if (!kifu_writer->Checkpoint(checkpoint.file_size) ||
+				!WriteCheckpoint(output_file_path, checkpoint)) {
+				sync_cout << "info string Failed to write a checkpoint: output_file_path=" << output_file_path
+					<< sync_endl;
+				std::exit(1);
+			}
+			last_checkpoint_time = std::time(nullptr);
+		};
 
 		while (global_position_index < num_positions) {
 			Thread& thread = *Threads[thread_index];
@@ -257,7 +626,10 @@ void Tanuki::GenerateKifu() {
 			Value last_value;
 			while (pos.game_ply() < kMaxGamePlay && !pos.is_mated() &&
 				pos.DeclarationWin() == MOVE_NONE) {
-				Learner::search(pos, search_depth, 1, optimum_nodes_searched);
+				TimePoint search_start_time = now();
+				Learner::search(pos, search_depth, 1, node_budget_scheduler.GetNodes(pos));
+				node_budget_scheduler.Update(thread.nodes.load(std::memory_order_relaxed),
+					now() - search_start_time, thread.completedDepth);
 
 				const auto& root_moves = pos.this_thread()->rootMoves;
 				const auto& root_move = root_moves[0];
@@ -344,15 +716,37 @@ void Tanuki::GenerateKifu() {
 				records.back().last_position = true;
 			}
 
-			for (const auto& record : records) {
-				if (!kifu_writer->Write(record)) {
-					sync_cout << "info string Failed to write a record." << sync_endl;
-					std::exit(1);
+			if (deduplicator) {
+				records.erase(std::remove_if(records.begin(), records.end(),
+					[&](const Learner::PackedSfenValue& record) { return !deduplicator->Add(record.sfen); }),
+					records.end());
+				// ΋ǂ̍Ō̋ǖʂ菜ꂽꍇ́AcŌ̋ǖʂ΋ǂ̍ŌƂB
+				if (!records.empty()) {
+					records.back().last_position = true;
 				}
 			}
 
+			if (!kifu_writer->Write(records)) {
+				sync_cout << "info string Failed to write a record." << sync_endl;
+				std::exit(1);
+			}
+
+			checkpoint.num_records += records.size();
+
+			if (node_budget_mode != NodeBudgetMode::Fixed && thread_index == 0 &&
+				last_node_budget_report_time + kNodeBudgetReportIntervalSec <= std::time(nullptr)) {
+				sync_cout << "info string base_nodes=" << node_budget_scheduler.GetBaseNodes()
+					<< " nps=" << node_budget_scheduler.GetNps()
+					<< " average_depth=" << node_budget_scheduler.GetAverageDepth() << sync_endl;
+				last_node_budget_report_time = std::time(nullptr);
+			}
 			progress_report.Show(global_position_index += records.size());
 
+			if (checkpoint_interval_sec > 0 &&
+				last_checkpoint_time + checkpoint_interval_sec <= std::time(nullptr)) {
+				save_checkpoint();
+			}
+
 			need_wait = need_wait ||
 				(progress_report.HasDataPerTime() &&
 					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
@@ -382,6 +776,10 @@ void Tanuki::GenerateKifu() {
 		// KvǖʐSXbh̒T~
 		// ȂƑʓ@̑ǖʂŎ~܂܂łɎԂ
 		Threads.stop = true;
+
+		if (checkpoint_interval_sec > 0) {
+			save_checkpoint();
+		}
 	}
 
 	if (measure_depth) {
@@ -416,7 +814,8 @@ void Tanuki::GenerateKifu() {
 void Tanuki::ConvertSfenToLearningData() {
 	//Eval::load_eval();
 
-	omp_set_num_threads((int)Options["Threads"]);
+	int num_threads = (int)Options["Threads"];
+	omp_set_num_threads(num_threads);
 
 	Search::LimitsType limits;
 	// ̎萔t߂ň̒lԂ̂h1 << 16ɂ
@@ -435,22 +834,21 @@ void Tanuki::ConvertSfenToLearningData() {
 	std::cout << "search_depth=" << search_depth << std::endl;
 	std::cout << "output_file_name=" << output_file_name << std::endl;
 
-	time_t start_time;
-	std::time(&start_time);
-
-	std::vector<std::string> sfens;
-	{
-		std::ifstream ifs(input_sfen_file_name);
-		std::string sfen;
-		while (std::getline(ifs, sfen)) {
-			sfens.push_back(sfen);
-		}
+	// i̕\̂߁AɍsĂB
+	int64_t num_sfens = CountLines(input_sfen_file_name);
+	SfenBlockReader sfen_reader(input_sfen_file_name);
+	if (num_sfens < 0 || !sfen_reader.IsOpen()) {
+		sync_cout << "info string Failed to open the input sfen file: input_sfen_file_name="
+			<< input_sfen_file_name << sync_endl;
+		return;
 	}
+	std::cout << "num_sfens=" << num_sfens << std::endl;
 
 	// XbhԂŋL
 	std::atomic_int64_t global_sfen_index;
 	global_sfen_index = 0;
-	int64_t num_sfens = sfens.size();
+	std::atomic_int64_t num_declaration_wins;
+	num_declaration_wins = 0;
 	ProgressReport progress_report(num_sfens, 60);
 	std::unique_ptr<KifuWriter> kifu_writer =
 		std::make_unique<KifuWriter>(output_file_name);
@@ -459,77 +857,93 @@ void Tanuki::ConvertSfenToLearningData() {
 	{
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
+		Thread& thread = *Threads[thread_index];
+		// StateInfo͑傫߁AsfenƂɊmہEAXbhƂɎg񂷁B
+		std::vector<StateInfo> state_infos(4096);
+		StateInfo* state = state_infos.data() + 8;
+		std::vector<std::string> sfens;
+		// oǖʂXbhƂɗ߂ĂA܂Ƃ߂ďށB
+		std::vector<Learner::PackedSfenValue> output_records;
+
+		auto flush_output_records = [&]() {
+			std::lock_guard<std::mutex> lock_gurad(mutex);
+			if (!kifu_writer->Write(output_records)) {
+				sync_cout << "info string Failed to write a record." << sync_endl;
+				std::exit(1);
+			}
+			output_records.clear();
+		};
+
+		// 󂢂Xbhsfen̂܂Ƃ܂ǂݍŏB
+		while (sfen_reader.Read(kSfenBlockLines, sfens)) {
+			for (const std::string& sfen : sfens) {
+				Position& pos = thread.rootPos;
+				pos.set_hirate(state, &thread);
+
+				std::istringstream iss(sfen);
+				// startpos moves 7g7f 3c3d 2g2f
+				std::vector<Learner::PackedSfenValue> records;
+				std::string token;
+				Color win = COLOR_NB;
+				while (iss >> token) {
+					if (token == "startpos" || token == "moves") {
+						continue;
+					}
 
-		for (int64_t sfen_index = global_sfen_index++; sfen_index < num_sfens;
-			sfen_index = global_sfen_index++) {
-			const std::string& sfen = sfens[sfen_index];
-			Thread& thread = *Threads[thread_index];
-			StateInfo state_infos[4096] = {};
-			StateInfo* state = state_infos + 8;
-			Position& pos = thread.rootPos;
-			pos.set_hirate(state, &thread);
-
-			std::istringstream iss(sfen);
-			// startpos moves 7g7f 3c3d 2g2f
-			std::vector<Learner::PackedSfenValue> records;
-			std::string token;
-			Color win = COLOR_NB;
-			while (iss >> token) {
-				if (token == "startpos" || token == "moves") {
-					continue;
-				}
+					Move m = USI::to_move(pos, token);
+					if (!is_ok(m) || !pos.legal(m)) {
+						break;
+					}
 
-				Move m = USI::to_move(pos, token);
-				if (!is_ok(m) || !pos.legal(m)) {
-					break;
-				}
+					pos.do_move(m, state[pos.game_ply()]);
 
-				pos.do_move(m, state[pos.game_ply()]);
+					Learner::search(pos, search_depth);
+					const auto& root_moves = pos.this_thread()->rootMoves;
+					const auto& root_move = root_moves[0];
 
-				Learner::search(pos, search_depth);
-				const auto& root_moves = pos.this_thread()->rootMoves;
-				const auto& root_move = root_moves[0];
+					Learner::PackedSfenValue record = {};
+					pos.sfen_pack(record.sfen);
+					record.score = root_move.score;
+					record.gamePly = pos.game_ply();
+					records.push_back(record);
 
-				Learner::PackedSfenValue record = {};
-				pos.sfen_pack(record.sfen);
-				record.score = root_move.score;
-				record.gamePly = pos.game_ply();
-				records.push_back(record);
-
-				if (pos.DeclarationWin()) {
-					win = pos.side_to_move();
-					break;
+					if (pos.DeclarationWin()) {
+						win = pos.side_to_move();
+						break;
+					}
 				}
-			}
 
-			// sync_cout << pos << sync_endl;
-			// pos.DeclarationWin();
+				progress_report.Show(++global_sfen_index);
 
-			if (win == COLOR_NB) {
-				sync_cout << "Skipped..." << sync_endl;
-				continue;
-			}
-			sync_cout << "DeclarationWin..." << sync_endl;
+				// ʐ錾ɎȂ͏oȂB
+				if (win == COLOR_NB) {
+					continue;
+				}
+				++num_declaration_wins;
 
-			int game_result = GameResultWin;
-			for (int i = static_cast<int>(records.size()) - 1; i >= 0; --i) {
-				records[i].game_result = game_result;
-				game_result = -game_result;
-			}
+				int game_result = GameResultWin;
+				for (int i = static_cast<int>(records.size()) - 1; i >= 0; --i) {
+					records[i].game_result = game_result;
+					game_result = -game_result;
+				}
 
-			std::lock_guard<std::mutex> lock_gurad(mutex);
-			{
-				for (const auto& record : records) {
-					if (!kifu_writer->Write(record)) {
-						sync_cout << "info string Failed to write a record." << sync_endl;
-						std::exit(1);
-					}
+				output_records.insert(output_records.end(), records.begin(), records.end());
+				if (static_cast<int>(output_records.size()) >= kOutputBatchRecords) {
+					flush_output_records();
 				}
 			}
-
-			progress_report.Show(global_sfen_index);
 		}
+
+		flush_output_records();
+	}
+
+	if (!kifu_writer->Close()) {
+		sync_cout << "info string Failed to write a record." << sync_endl;
+		std::exit(1);
 	}
+
+	sync_cout << "info string num_sfens=" << global_sfen_index << " num_declaration_wins="
+		<< num_declaration_wins << sync_endl;
 }
 
 #endif
@@ -3,13 +3,12 @@
 
 #ifdef EVAL_LEARN
 
+#include <algorithm>
+#include <filesystem>
 #include <numeric>
 #include <sstream>
-#define NOMINMAX
-#include <Windows.h>
-#undef NOMINMAX
 
-#include "misc.h"
+#include "tanuki_kifu_container.h"
 #include "usi.h"
 
 using USI::Option;
@@ -17,11 +16,15 @@ using USI::OptionsMap;
 using Learner::PackedSfenValue;
 
 namespace {
-	constexpr int kBufferSize = 1024 * 1024;
+	// 1̓ǂݍ݂ł܂Ƃ߂ēǂݍދǖʐ
+	constexpr int kBlockRecords = 64 * 1024;
+	// ǂݍ݃XbhƂɐǂ݂ĂubN
+	constexpr int kNumPrefetchBlocksPerThread = 4;
 }
 
-Tanuki::KifuReader::KifuReader(const std::string& folder_name, int num_loops)
-	: folder_name_(folder_name), num_loops_(num_loops) {}
+Tanuki::KifuReader::KifuReader(const std::string& folder_name, int num_loops, int num_threads)
+	: folder_name_(folder_name), num_loops_(num_loops), num_threads_(std::max(1, num_threads)),
+	next_file_sequence_index_(0) {}
 
 Tanuki::KifuReader::~KifuReader() { Close(); }
 
@@ -36,108 +39,152 @@ bool Tanuki::KifuReader::Read(int num_records, std::vector<PackedSfenValue>& rec
 }
 
 bool Tanuki::KifuReader::Read(PackedSfenValue& record) {
-	// t@CXg擾At@CJԂɂ
-	if (!EnsureOpen()) {
+	if (current_index_ == current_block_.size() && !NextBlock()) {
 		return false;
 	}
 
-	// [vI͈ȉ̒ʂƂ
-	if (file_index_ == static_cast<int>(file_paths_.size()) && loop_ == num_loops_) {
-		return false;
-	}
+	record = current_block_[current_index_++];
+	++num_read_records_;
+	return true;
+}
 
-	// 1ǖʓǂݍ
-	if (std::fread(&record, sizeof(record), 1, file_) == 1) {
-		return true;
+bool Tanuki::KifuReader::Read(Batch& batch) {
+	if (current_index_ == current_block_.size() && !NextBlock()) {
+		return false;
 	}
 
-	++file_index_;
-	if (file_index_ == static_cast<int>(file_paths_.size())) {
-		++loop_;
-		if (loop_ == num_loops_) {
-			return false;
-		}
+	batch = Batch(current_block_.data() + current_index_, current_block_.data() + current_block_.size());
+	num_read_records_ += current_block_.size() - current_index_;
+	current_index_ = current_block_.size();
+	return true;
+}
 
-		file_index_ = 0;
+bool Tanuki::KifuReader::Close() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closing_ = true;
 	}
+	condition_variable_.notify_all();
 
-	if (std::fclose(file_)) {
-		sync_cout << "info string Failed to close a kifu file." << sync_endl;
-		return false;
+	for (auto& thread : threads_) {
+		thread.join();
 	}
+	threads_.clear();
+	blocks_.clear();
+	return true;
+}
 
-	file_ = std::fopen(file_paths_[file_index_].c_str(), "rb");
-	if (file_ == nullptr) {
-		// t@CĴɎs
-		// ǂݍ݂I
-		sync_cout << "into string Failed to open a kifu file: " << file_paths_[file_index_]
-			<< sync_endl;
-		return false;
+double Tanuki::KifuReader::GetRecordsPerSecond() const {
+	if (start_time_ == 0) {
+		return 0.0;
 	}
+	TimePoint elapsed = std::max<TimePoint>(1, now() - start_time_);
+	return num_read_records_ * 1000.0 / elapsed;
+}
 
-	if (std::setvbuf(file_, nullptr, _IOFBF, kBufferSize)) {
-		sync_cout << "into string Failed to set a file buffer: " << file_paths_[file_index_]
-			<< sync_endl;
+// ǂݍ݃Xbhǂݍ񂾎̃ubNoB
+bool Tanuki::KifuReader::NextBlock() {
+	if (!EnsureOpen()) {
+		return false;
 	}
 
-	if (std::fread(&record, sizeof(record), 1, file_) != 1) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	condition_variable_.wait(lock, [this]() { return !blocks_.empty() || num_running_threads_ == 0; });
+	if (blocks_.empty()) {
 		return false;
 	}
 
+	current_block_.swap(blocks_.front());
+	blocks_.pop_front();
+	current_index_ = 0;
+	lock.unlock();
+	condition_variable_.notify_all();
 	return true;
 }
 
-bool Tanuki::KifuReader::Close() {
-	if (fclose(file_)) {
-		return false;
-	}
-	file_ = nullptr;
-	return true;
-}
+void Tanuki::KifuReader::Run() {
+	int64_t num_file_sequences = static_cast<int64_t>(file_paths_.size()) * num_loops_;
+	for (int64_t file_sequence_index = next_file_sequence_index_++; file_sequence_index < num_file_sequences;
+		file_sequence_index = next_file_sequence_index_++) {
+		const auto& file_path = file_paths_[file_sequence_index % file_paths_.size()];
+		KifuFileReader file;
+		if (!file.Open(file_path)) {
+			// t@CĴɎs
+			// ǂݍ݂I
+			sync_cout << "into string Failed to open a kifu file: " << file_path << sync_endl;
+			break;
+		}
 
-bool Tanuki::KifuReader::EnsureOpen() {
-	if (!file_paths_.empty()) {
-		return true;
-	}
+		bool closing = false;
+		for (;;) {
+			std::vector<PackedSfenValue> block(kBlockRecords);
+			size_t num_records = file.Read(block.data(), block.size());
+			if (num_records == 0) {
+				break;
+			}
+			block.resize(num_records);
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			condition_variable_.wait(lock, [this]() {
+				return closing_ || static_cast<int>(blocks_.size()) < num_threads_ * kNumPrefetchBlocksPerThread;
+			});
+			if (closing_) {
+				closing = true;
+				break;
+			}
+			blocks_.push_back(std::move(block));
+			lock.unlock();
+			condition_variable_.notify_all();
+		}
 
-	// http://qiita.com/tkymx/items/f9190c16be84d4a48f8a
-	HANDLE find = nullptr;
-	WIN32_FIND_DATAA find_data = {};
+		file.Close();
 
-	std::string search_name = folder_name_ + "/*.*";
-	find = FindFirstFileA(search_name.c_str(), &find_data);
+		if (closing) {
+			break;
+		}
+	}
 
-	if (find == INVALID_HANDLE_VALUE) {
-		sync_cout << "Failed to find kifu files." << sync_endl;
-		sync_cout << "search_name=" << search_name << sync_endl;
-		return false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		--num_running_threads_;
+	}
+	condition_variable_.notify_all();
+}
+
+// t@CXg擾Aǂݍ݃XbhJnB
+bool Tanuki::KifuReader::EnsureOpen() {
+	if (opened_) {
+		return !file_paths_.empty();
 	}
+	opened_ = true;
 
-	do {
-		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+	std::error_code error_code;
+	for (const auto& entry : std::filesystem::directory_iterator(folder_name_, error_code)) {
+		if (!entry.is_regular_file(error_code)) {
 			continue;
 		}
 
-		std::string file_path = folder_name_ + "/" + find_data.cFileName;
-		file_paths_.push_back(file_path);
-	} while (FindNextFileA(find, &find_data));
-
-	FindClose(find);
-	find = nullptr;
+		file_paths_.push_back(folder_name_ + "/" + entry.path().filename().string());
+	}
 
-	if (file_paths_.empty()) {
+	if (error_code) {
+		sync_cout << "Failed to find kifu files." << sync_endl;
+		sync_cout << "folder_name=" << folder_name_ << sync_endl;
+		file_paths_.clear();
 		return false;
 	}
 
-	file_ = std::fopen(file_paths_[0].c_str(), "rb");
+	// ǂݍޏɂĕςȂ悤At@CɕׂĂB
+	std::sort(file_paths_.begin(), file_paths_.end());
 
-	if (!file_) {
-		sync_cout << "into string Failed to open a kifu file: " << file_paths_[0] << sync_endl;
+	if (file_paths_.empty()) {
 		return false;
 	}
 
-	if (std::setvbuf(file_, nullptr, _IOFBF, kBufferSize)) {
-		sync_cout << "into string Failed to set a file buffer: " << file_paths_[0] << sync_endl;
+	start_time_ = now();
+	num_running_threads_ = num_threads_;
+	for (int thread_index = 0; thread_index < num_threads_; ++thread_index) {
+		threads_.emplace_back([this]() { Run(); });
 	}
 
 	return true;
@@ -5,31 +5,82 @@
 
 #ifdef EVAL_LEARN
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "learn/learn.h"
+#include "misc.h"
 
 namespace Tanuki {
+	// tH_[̊t@CAǂݍ݃XbhŐǂ݂ȂǂݍށB
+	// ǂݍ݃Xbh͂ꂼʂ̃t@C傫ȃubNPʂœǂݍ݁A
+	// ǂݍ񂾏ɃubNԂB̂߁Aǂݍ݃Xbh2ȏ̏ꍇ́A
+	// ̃t@C̋ǖʂubNPʂōĕԂB
+	// ǂݍ݃Xbh1̏ꍇ́At@Cɐ擪珇ɕԂB
+	// ̊t@CƈkReîǂǂݍ߂B
 	class KifuReader {
 	public:
-		KifuReader(const std::string& folder_name, int num_loops);
+		// ǂݍ񂾋ǖʂ̕сBRs[ɓ̃obt@wB
+		// Read()Ăяo܂ŗLB
+		class Batch {
+		public:
+			Batch() = default;
+			Batch(const Learner::PackedSfenValue* begin, const Learner::PackedSfenValue* end) : begin_(begin), end_(end) {}
+			const Learner::PackedSfenValue* begin() const { return begin_; }
+			const Learner::PackedSfenValue* end() const { return end_; }
+			size_t size() const { return end_ - begin_; }
+			bool empty() const { return begin_ == end_; }
+			const Learner::PackedSfenValue& operator[](size_t index) const { return begin_[index]; }
+
+		private:
+			const Learner::PackedSfenValue* begin_ = nullptr;
+			const Learner::PackedSfenValue* end_ = nullptr;
+		};
+
+		KifuReader(const std::string& folder_name, int num_loops, int num_threads = 1);
 		virtual ~KifuReader();
 		bool Read(Learner::PackedSfenValue& record);
 		bool Read(int num_records, std::vector<Learner::PackedSfenValue>& records);
+		// ǂݍς݂̋ǖʂ܂Ƃ߂ĕԂBSēǂݏIꍇfalseԂB
+		bool Read(Batch& batch);
 		bool Close();
 
+		// ǂݍ񂾋ǖʐƁAǂݍ݊Jn1b̋ǖʐ
+		int64_t GetNumReadRecords() const { return num_read_records_; }
+		double GetRecordsPerSecond() const;
+
 	private:
 		bool EnsureOpen();
+		bool NextBlock();
+		void Run();
 
 		const std::string folder_name_;
 		const int num_loops_;
+		const int num_threads_;
 		std::vector<std::string> file_paths_;
-		FILE* file_;
-		int loop_ = 0;
-		int file_index_ = 0;
+		bool opened_ = false;
+
+		// Ăяoǂݍݒ̃ubN
+		std::vector<Learner::PackedSfenValue> current_block_;
+		size_t current_index_ = 0;
+		int64_t num_read_records_ = 0;
+		TimePoint start_time_ = 0;
+
+		// ǂݍ݃Xbhǂݍ񂾃ubN
+		std::deque<std::vector<Learner::PackedSfenValue>> blocks_;
+		// ɓǂݍރt@C̒ʂԍBt@C̃Xgnum_loops_JԂ̂̓YB
+		std::atomic<int64_t> next_file_sequence_index_;
+		int num_running_threads_ = 0;
+		bool closing_ = false;
+		std::mutex mutex_;
+		std::condition_variable condition_variable_;
+		std::vector<std::thread> threads_;
 	};
 }
 
@@ -3,98 +3,200 @@
 
 #ifdef EVAL_LEARN
 
-#include <direct.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
 #include <cstdio>
-#include <random>
 #include <ctime>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <omp.h>
 
-#include "tanuki_kifu_reader.h"
-#include "tanuki_kifu_writer.h"
+#include "tanuki_kifu_container.h"
 #include "misc.h"
 
 using Learner::PackedSfenValue;
+using USI::Option;
 
 namespace {
 	static const constexpr char* kShuffledKifuDir = "ShuffledKifuDir";
-	// Vbt̃t@C
-	// Windowsł͈x512܂ł̃t@CJȂ
-	// 256ɐĂ
-	static const constexpr int kNumShuffledKifuFiles = 256;
-	static const constexpr int kMaxPackedSfenValues = 1024 * 1024;
-}
+	// Vbtɗp郁̏ (MB)
+	// Vbt̃t@ĆAeXbh1t@CŃVbtł悤A̒l猈߂B
+	static const constexpr char* kShuffleKifuMemoryMb = "ShuffleKifuMemoryMB";
+	// U蕪̊et@C̏݃obt@̏
+	static const constexpr int64_t kMaxWriteBufferBytes = 64 * 1024 * 1024;
 
-void Tanuki::InitializeShuffler(USI::OptionsMap& o) {
-	o[kShuffledKifuDir] << USI::Option("kifu_shuffled");
-}
+	// et@C֐U蕪ǖʂt@CƂɃobt@ɗ߂ĂA
+	// obt@tɂȂ珑݃XbhɓnĂ܂Ƃ߂ĒǋLB
+	// ݒǂݍ݂ƐU蕪𑱂悤A݂͕ʃXbhōsB
+	// t@C͒ǋL̂тɊJ߁AɊJt@C͎̏󂯂ȂB
+	class BucketWriter {
+	public:
+		BucketWriter(const std::vector<std::string>& file_paths, int64_t buffer_records, int64_t max_pending_bytes)
+			: file_paths_(file_paths), buffers_(file_paths.size()), buffer_records_(buffer_records),
+			max_pending_bytes_(max_pending_bytes), thread_([this]() { Run(); }) {}
 
-void Tanuki::ShuffleKifu() {
-	// ͂Ãt@CɃ_ɒǉĂ
-	sync_cout << "info string Reading and dividing kifu files..." << sync_endl;
+		~BucketWriter() { Close(); }
 
-	std::string kifu_dir = Options["KifuDir"];
-	std::string shuffled_kifu_dir = Options[kShuffledKifuDir];
+		void Write(int bucket_index, const PackedSfenValue& record) {
+			auto& buffer = buffers_[bucket_index];
+			if (buffer.empty()) {
+				buffer.reserve(buffer_records_);
+			}
+			buffer.push_back(record);
+			if (static_cast<int64_t>(buffer.size()) >= buffer_records_) {
+				Submit(bucket_index);
+			}
+		}
 
-	auto reader = std::make_unique<KifuReader>(kifu_dir, 1);
-	_mkdir(shuffled_kifu_dir.c_str());
+		// c̃obt@oA݃XbhIB
+		bool Close() {
+			if (!thread_.joinable()) {
+				return !failed_;
+			}
 
-	std::vector<std::string> file_paths;
-	for (int file_index = 0; file_index < kNumShuffledKifuFiles; ++file_index) {
-		char file_path[_MAX_PATH];
-		sprintf(file_path, "%s/shuffled.%03d.bin", shuffled_kifu_dir.c_str(), file_index);
-		file_paths.push_back(file_path);
-	}
+			for (int bucket_index = 0; bucket_index < static_cast<int>(buffers_.size()); ++bucket_index) {
+				if (!buffers_[bucket_index].empty()) {
+					Submit(bucket_index);
+				}
+			}
 
-	std::vector<std::shared_ptr<KifuWriter> > writers;
-	for (const auto& file_path : file_paths) {
-		writers.push_back(std::make_shared<KifuWriter>(file_path));
-	}
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				closed_ = true;
+			}
+			condition_variable_.notify_all();
+			thread_.join();
+			return !failed_;
+		}
 
-	std::mt19937_64 mt(std::time(nullptr));
-	std::uniform_int_distribution<> dist(0, kNumShuffledKifuFiles - 1);
-	int64_t num_records = 0;
-	for (;;) {
-		std::vector<PackedSfenValue> records;
-		PackedSfenValue record;
-		while (reader->Read(record)) {
-			records.push_back(record);
-			if (record.last_position || static_cast<int>(records.size()) > kMaxPackedSfenValues) {
-				break;
+	private:
+		struct Chunk {
+			int bucket_index;
+			std::vector<PackedSfenValue> records;
+		};
+
+		void Submit(int bucket_index) {
+			int64_t bytes = buffers_[bucket_index].size() * sizeof(PackedSfenValue);
+			std::unique_lock<std::mutex> lock(mutex_);
+			// ݂ǂȂꍇ́AgȂ悤҂B
+			condition_variable_.wait(lock, [this, bytes]() {
+				return failed_ || pending_.empty() || pending_bytes_ + bytes <= max_pending_bytes_;
+			});
+			pending_.push_back({ bucket_index, std::move(buffers_[bucket_index]) });
+			pending_bytes_ += bytes;
+			buffers_[bucket_index] = std::vector<PackedSfenValue>();
+			lock.unlock();
+			condition_variable_.notify_all();
+		}
+
+		void Run() {
+			for (;;) {
+				Chunk chunk;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					condition_variable_.wait(lock, [this]() { return closed_ || !pending_.empty(); });
+					if (pending_.empty()) {
+						return;
+					}
+					chunk = std::move(pending_.front());
+					pending_.pop_front();
+				}
+
+				const auto& file_path = file_paths_[chunk.bucket_index];
+				FILE* file = std::fopen(file_path.c_str(), "ab");
+				if (file == nullptr ||
+					std::fwrite(chunk.records.data(), sizeof(PackedSfenValue), chunk.records.size(), file) != chunk.records.size() ||
+					std::fclose(file) != 0) {
+					sync_cout << "info string Failed to write records to a kifu file. " << file_path << sync_endl;
+					failed_ = true;
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					pending_bytes_ -= chunk.records.size() * sizeof(PackedSfenValue);
+				}
+				condition_variable_.notify_all();
 			}
 		}
 
-		if (records.empty()) {
-			break;
+		const std::vector<std::string>& file_paths_;
+		std::vector<std::vector<PackedSfenValue>> buffers_;
+		const int64_t buffer_records_;
+		const int64_t max_pending_bytes_;
+
+		std::mutex mutex_;
+		std::condition_variable condition_variable_;
+		std::deque<Chunk> pending_;
+		int64_t pending_bytes_ = 0;
+		bool closed_ = false;
+		std::atomic<bool> failed_ = false;
+		std::thread thread_;
+	};
+
+	struct KifuBlock {
+		int file_index;
+		size_t block_index;
+	};
+
+	// ͊̃t@CƃubN񋓂AǖʐԂB
+	// ǖʐ́AkReȉꍇ̓ubNwb_[狁߂B
+	int64_t ListKifuBlocks(const std::string& kifu_dir, std::vector<std::string>& file_paths,
+		std::vector<KifuBlock>& blocks) {
+		std::error_code error_code;
+		for (const auto& entry : std::filesystem::directory_iterator(kifu_dir, error_code)) {
+			if (entry.is_regular_file(error_code)) {
+				file_paths.push_back(kifu_dir + "/" + entry.path().filename().string());
+			}
 		}
+		std::sort(file_paths.begin(), file_paths.end());
 
-		for (const auto& record : records) {
-			if (!writers[dist(mt)]->Write(record)) {
-				sync_cout << "info string Failed to write a record to a kifu file. " << sync_endl;
+		int64_t num_records = 0;
+		for (int file_index = 0; file_index < static_cast<int>(file_paths.size()); ++file_index) {
+			Tanuki::KifuFileReader file;
+			if (!file.Open(file_paths[file_index])) {
+				sync_cout << "info string Failed to open a kifu file. " << file_paths[file_index] << sync_endl;
+				continue;
 			}
-			++num_records;
-			if (num_records % 10000000 == 0) {
-				sync_cout << "info string " << num_records << sync_endl;
+			size_t num_blocks = file.NumBlocks();
+			for (size_t block_index = 0; block_index < num_blocks; ++block_index) {
+				blocks.push_back({ file_index, block_index });
 			}
+			num_records += file.NumRecords();
 		}
-	}
-	for (auto& writer : writers) {
-		writer->Close();
+		return num_records;
 	}
 
-	// et@CVbt
-	for (const auto& file_path : file_paths) {
-		sync_cout << "info string " << file_path << sync_endl;
+	// t@CŜǂݍŃVbtA㏑ď߂B
+	bool ShuffleFile(const std::string& file_path, std::mt19937_64& mt) {
+		std::error_code error_code;
+		auto size = std::filesystem::file_size(file_path, error_code);
+		if (error_code) {
+			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
+			return false;
+		}
+
+		std::vector<PackedSfenValue> records(size / sizeof(PackedSfenValue));
+		if (records.empty()) {
+			return true;
+		}
 
 		// t@CŜǂݍ
 		FILE* file = std::fopen(file_path.c_str(), "rb");
 		if (file == nullptr) {
 			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
-			return;
+			return false;
+		}
+		if (std::fread(records.data(), sizeof(PackedSfenValue), records.size(), file) != records.size()) {
+			sync_cout << "info string Failed to read records from a kifu file. " << file_path << sync_endl;
+			std::fclose(file);
+			return false;
 		}
-		_fseeki64(file, 0, SEEK_END);
-		int64_t size = _ftelli64(file);
-		_fseeki64(file, 0, SEEK_SET);
-		std::vector<PackedSfenValue> records(size / sizeof(PackedSfenValue));
-		std::fread(&records[0], sizeof(PackedSfenValue), size / sizeof(PackedSfenValue), file);
 		std::fclose(file);
 		file = nullptr;
 
@@ -105,16 +207,179 @@ void Tanuki::ShuffleKifu() {
 		file = std::fopen(file_path.c_str(), "wb");
 		if (file == nullptr) {
 			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
+			return false;
 		}
-		if (std::fwrite(&records[0], sizeof(PackedSfenValue), records.size(), file) !=
+		if (std::fwrite(records.data(), sizeof(PackedSfenValue), records.size(), file) !=
 			records.size()) {
 			sync_cout << "info string Failed to write records to a kifu file. " << file_path
 				<< sync_endl;
-			return;
+			std::fclose(file);
+			return false;
 		}
 		std::fclose(file);
 		file = nullptr;
+
+		return true;
+	}
+}
+
+void Tanuki::InitializeShuffler(USI::OptionsMap& o) {
+	o[kShuffledKifuDir] << Option("kifu_shuffled");
+	o[kShuffleKifuMemoryMb] << Option(4096, 1, INT_MAX);
+}
+
+// OŃVbtB
+// 1pXڂŊeǖʂ_ɑI񂾃t@CɐU蕪A2pXڂŊet@CŃVbtB
+// et@C̑傫̏XbhŊlɎ܂悤At@C߂B
+void Tanuki::ShuffleKifu() {
+	std::string kifu_dir = Options["KifuDir"];
+	std::string shuffled_kifu_dir = Options[kShuffledKifuDir];
+	int num_threads = std::max(1, static_cast<int>(Options["Threads"]));
+	int64_t memory_bytes = static_cast<int64_t>(Options[kShuffleKifuMemoryMb]) * 1024 * 1024;
+
+	std::vector<std::string> input_file_paths;
+	std::vector<KifuBlock> input_blocks;
+	int64_t num_input_records = ListKifuBlocks(kifu_dir, input_file_paths, input_blocks);
+	// U蕪̕΂lA1x̗]TB
+	int64_t max_bucket_bytes = std::max<int64_t>(memory_bytes / num_threads * 9 / 10, sizeof(PackedSfenValue));
+	int64_t num_input_bytes = num_input_records * static_cast<int64_t>(sizeof(PackedSfenValue));
+	int num_shuffled_kifu_files = static_cast<int>(std::max<int64_t>(1, (num_input_bytes + max_bucket_bytes - 1) / max_bucket_bytes));
+
+	// U蕪́Ȁ̔t@CƂ̏݃obt@ɁAcݑ҂̃obt@ɗpB
+	int64_t buffer_bytes = std::min(kMaxWriteBufferBytes, memory_bytes / 2 / num_shuffled_kifu_files);
+	int64_t buffer_records = std::max<int64_t>(1, buffer_bytes / sizeof(PackedSfenValue));
+
+	sync_cout << "info string num_threads=" << num_threads << sync_endl;
+	sync_cout << "info string memory_bytes=" << memory_bytes << sync_endl;
+	sync_cout << "info string num_input_blocks=" << input_blocks.size() << sync_endl;
+	sync_cout << "info string num_input_records=" << num_input_records << sync_endl;
+	sync_cout << "info string num_shuffled_kifu_files=" << num_shuffled_kifu_files << sync_endl;
+	sync_cout << "info string buffer_records=" << buffer_records << sync_endl;
+
+	// ͂Ãt@CɃ_ɒǉĂ
+	sync_cout << "info string Reading and dividing kifu files..." << sync_endl;
+
+	std::error_code error_code;
+	std::filesystem::create_directories(shuffled_kifu_dir, error_code);
+
+	std::vector<std::string> file_paths;
+	for (int file_index = 0; file_index < num_shuffled_kifu_files; ++file_index) {
+		char file_name[64];
+		std::snprintf(file_name, sizeof(file_name), "shuffled.%03d.bin", file_index);
+		std::string file_path = shuffled_kifu_dir + "/" + file_name;
+
+		// ǋLŏނ߁AȑO̓eĂB
+		FILE* file = std::fopen(file_path.c_str(), "wb");
+		if (file == nullptr) {
+			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
+			return;
+		}
+		std::fclose(file);
+
+		file_paths.push_back(file_path);
+	}
+
+	// eXbhubNPʂœǂݍ݁EWJĂU蕪B
+	// ǖʂ͌ŃVbt邽߁Aǂݍޏ͖ȂB
+	// ubN̓t@Cɕł邽߁AeXbht@CJ񐔂͏ȂB
+	std::mt19937_64 mt(std::time(nullptr));
+	std::seed_seq divide_seed_seq{ mt(), mt(), mt(), mt() };
+	std::vector<uint64_t> divide_seeds(num_threads);
+	divide_seed_seq.generate(divide_seeds.begin(), divide_seeds.end());
+
+	int64_t num_records = 0;
+	{
+		BucketWriter writer(file_paths, buffer_records, memory_bytes / 2);
+		std::mutex writer_mutex;
+		std::atomic<int64_t> global_block_index;
+		global_block_index = 0;
+		std::atomic<bool> failed = false;
+		TimePoint start_time = now();
+		omp_set_num_threads(num_threads);
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			std::mt19937_64 thread_mt(divide_seeds[thread_index]);
+			std::uniform_int_distribution<> dist(0, num_shuffled_kifu_files - 1);
+			KifuFileReader file;
+			int file_index = -1;
+			std::vector<PackedSfenValue> records;
+			std::vector<int> bucket_indices;
+			for (int64_t block_index = global_block_index++;
+				block_index < static_cast<int64_t>(input_blocks.size()) && !failed;
+				block_index = global_block_index++) {
+				const auto& block = input_blocks[block_index];
+				if (file_index != block.file_index) {
+					file_index = block.file_index;
+					if (!file.Open(input_file_paths[file_index])) {
+						sync_cout << "info string Failed to open a kifu file. " << input_file_paths[file_index] << sync_endl;
+						failed = true;
+						break;
+					}
+				}
+
+				if (!file.ReadBlock(block.block_index, records)) {
+					sync_cout << "info string Failed to read records from a kifu file. "
+						<< input_file_paths[file_index] << sync_endl;
+					failed = true;
+					break;
+				}
+
+				bucket_indices.resize(records.size());
+				for (auto& bucket_index : bucket_indices) {
+					bucket_index = dist(thread_mt);
+				}
+
+				std::lock_guard<std::mutex> lock(writer_mutex);
+				for (size_t record_index = 0; record_index < records.size(); ++record_index) {
+					writer.Write(bucket_indices[record_index], records[record_index]);
+				}
+
+				int64_t previous_num_records = num_records;
+				num_records += records.size();
+				if (previous_num_records / 10000000 != num_records / 10000000) {
+					TimePoint elapsed = std::max<TimePoint>(1, now() - start_time);
+					sync_cout << "info string " << num_records << " records_per_second="
+						<< num_records * 1000.0 / elapsed << sync_endl;
+				}
+			}
+		}
+
+		if (!writer.Close() || failed) {
+			sync_cout << "info string Failed to write a record to a kifu file. " << sync_endl;
+			return;
+		}
+	}
+	sync_cout << "info string num_records=" << num_records << sync_endl;
+
+	// et@CɃVbt
+	sync_cout << "info string Shuffling kifu files..." << sync_endl;
+	std::seed_seq seed_seq{ mt(), mt(), mt(), mt() };
+	std::vector<uint64_t> seeds(num_shuffled_kifu_files);
+	seed_seq.generate(seeds.begin(), seeds.end());
+
+	std::atomic_int global_file_index;
+	global_file_index = 0;
+	std::atomic<bool> failed = false;
+	omp_set_num_threads(num_threads);
+#pragma omp parallel
+	{
+		for (int file_index = global_file_index++; file_index < num_shuffled_kifu_files && !failed;
+			file_index = global_file_index++) {
+			std::mt19937_64 file_mt(seeds[file_index]);
+			if (!ShuffleFile(file_paths[file_index], file_mt)) {
+				failed = true;
+				break;
+			}
+			sync_cout << "info string " << file_paths[file_index] << sync_endl;
+		}
 	}
+
+	if (failed) {
+		return;
+	}
+
+	sync_cout << "info string Shuffled kifu files." << sync_endl;
 }
 
 #endif
@@ -3,14 +3,27 @@
 
 #ifdef EVAL_LEARN
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <filesystem>
+
 #include "misc.h"
+#include "thread.h"
 
 namespace {
-	constexpr int kBufferSize = 1024 * 1024;
+	// 1݂̏ł܂Ƃ߂ďoǖʐ
+	// XbhƂɃobt@2߁A傫Ȃ悤ɂB
+	constexpr int kBufferRecords = 128 * 1024;
 }
 
-Tanuki::KifuWriter::KifuWriter(const std::string& output_file_path)
-	: output_file_path_(output_file_path) {}
+Tanuki::KifuWriter::KifuWriter(const std::string& output_file_path, int fsync_interval_sec, KifuFormat format,
+	bool append)
+	: output_file_path_(output_file_path), fsync_interval_sec_(fsync_interval_sec), format_(format),
+	append_(append) {}
 
 Tanuki::KifuWriter::~KifuWriter() { Close(); }
 
@@ -19,19 +32,59 @@ bool Tanuki::KifuWriter::Write(const Learner::PackedSfenValue& record) {
 		return false;
 	}
 
-	if (std::fwrite(&record, sizeof(record), 1, file_) != 1) {
-		return false;
+	front_buffer_.push_back(record);
+	if (static_cast<int>(front_buffer_.size()) >= kBufferRecords) {
+		return Submit();
 	}
 
+	return !failed_;
+}
+
+bool Tanuki::KifuWriter::Write(const std::vector<Learner::PackedSfenValue>& records) {
+	for (const auto& record : records) {
+		if (!Write(record)) {
+			return false;
+		}
+	}
 	return true;
 }
 
+bool Tanuki::KifuWriter::Flush() {
+	if (!file_) {
+		return true;
+	}
+
+	if (!front_buffer_.empty() && !Submit()) {
+		return false;
+	}
+
+	// ݃XbhI܂ő҂
+	std::unique_lock<std::mutex> lock(mutex_);
+	condition_variable_.wait(lock, [this]() { return !back_buffer_ready_; });
+	return !failed_;
+}
+
 bool Tanuki::KifuWriter::Close() {
 	if (!file_) {
 		return true;
 	}
 
 	bool result = true;
+	if (thread_.joinable()) {
+		result = Flush();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			closing_ = true;
+		}
+		condition_variable_.notify_all();
+		thread_.join();
+	}
+
+	if (fsync_interval_sec_ > 0 && !Sync()) {
+		result = false;
+	}
+
 	if (std::fclose(file_) != 0) {
 		sync_cout << "info string Failed to close the output kifu file: output_file_path="
 			<< output_file_path_ << sync_endl;
@@ -41,23 +94,140 @@ bool Tanuki::KifuWriter::Close() {
 	return result;
 }
 
+bool Tanuki::KifuWriter::Checkpoint(int64_t& file_size) {
+	if (!EnsureOpen() || !Flush() || !Sync()) {
+		return false;
+	}
+
+	std::error_code error_code;
+	file_size = static_cast<int64_t>(std::filesystem::file_size(output_file_path_, error_code));
+	return !error_code;
+}
+
 bool Tanuki::KifuWriter::EnsureOpen() {
 	if (file_) {
 		return true;
 	}
-	file_ = std::fopen(output_file_path_.c_str(), "wb");
+
+	// ǋLꍇAɃt@Cwb_[oĂΏoȂB
+	std::error_code error_code;
+	bool write_header = format_ != KifuFormat::Raw &&
+		(!append_ || std::filesystem::file_size(output_file_path_, error_code) == 0 || error_code);
+
+	file_ = std::fopen(output_file_path_.c_str(), append_ ? "ab" : "wb");
 	if (!file_) {
 		sync_cout << "info string Failed to open the output kifu file: output_file_path_="
 			<< output_file_path_ << sync_endl;
 		return false;
 	}
 
-	if (std::setvbuf(file_, nullptr, _IOFBF, kBufferSize)) {
+	// ܂Ƃ߂ďo߁Astdiõobt@͗pȂB
+	if (std::setvbuf(file_, nullptr, _IONBF, 0)) {
 		sync_cout << "info string Failed to set the output buffer: output_file_path_="
 			<< output_file_path_ << sync_endl;
 		return false;
 	}
 
+	if (write_header && !WriteKifuContainerHeader(file_)) {
+		sync_cout << "info string Failed to write the kifu container header: output_file_path_="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+
+	front_buffer_.reserve(kBufferRecords);
+	back_buffer_.reserve(kBufferRecords);
+	last_fsync_time_sec_ = std::time(nullptr);
+	closing_ = false;
+	thread_ = std::thread([this]() { Run(); });
+
+	return true;
+}
+
+// ߂obt@݃XbhɓnB
+// Onobt@݃XbhIĂȂꍇ͑҂B
+bool Tanuki::KifuWriter::Submit() {
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		condition_variable_.wait(lock, [this]() { return !back_buffer_ready_; });
+		front_buffer_.swap(back_buffer_);
+		back_buffer_ready_ = true;
+	}
+	condition_variable_.notify_all();
+	front_buffer_.clear();
+	return !failed_;
+}
+
+void Tanuki::KifuWriter::Run() {
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			condition_variable_.wait(lock, [this]() { return back_buffer_ready_ || closing_; });
+			if (!back_buffer_ready_) {
+				return;
+			}
+		}
+
+		// back_buffer_back_buffer_ready_true̊Ԃ͏݃Xbĥ݂GB
+		if (!failed_ && !WriteRecords()) {
+			sync_cout << "info string Failed to write records to the output kifu file: output_file_path="
+				<< output_file_path_ << sync_endl;
+			failed_ = true;
+		}
+
+		if (!failed_ && fsync_interval_sec_ > 0 &&
+			last_fsync_time_sec_ + fsync_interval_sec_ <= std::time(nullptr)) {
+			if (!Sync()) {
+				failed_ = true;
+			}
+			last_fsync_time_sec_ = std::time(nullptr);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			back_buffer_.clear();
+			back_buffer_ready_ = false;
+		}
+		condition_variable_.notify_all();
+	}
+}
+
+bool Tanuki::KifuWriter::WriteRecords() {
+	if (format_ == KifuFormat::Raw) {
+		return std::fwrite(back_buffer_.data(), sizeof(Learner::PackedSfenValue),
+			back_buffer_.size(), file_) == back_buffer_.size();
+	}
+
+	uint32_t block_type = format_ == KifuFormat::Game ? kKifuBlockTypeGame : kKifuBlockTypeXorDelta;
+	if (block_type == kKifuBlockTypeGame && !encoder_thread_) {
+		encoder_thread_ = std::make_unique<Thread>(Threads.size());
+	}
+	for (size_t offset = 0; offset < back_buffer_.size(); offset += kKifuContainerBlockRecords) {
+		size_t num_records = std::min<size_t>(kKifuContainerBlockRecords, back_buffer_.size() - offset);
+		if (!WriteKifuBlock(file_, back_buffer_.data() + offset, num_records, block_type,
+			encoder_thread_.get())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// oefBXNɓB
+bool Tanuki::KifuWriter::Sync() {
+	if (std::fflush(file_) != 0) {
+		return false;
+	}
+
+#if defined(_WIN32)
+	int result = _commit(_fileno(file_));
+#else
+	int result = fsync(fileno(file_));
+#endif
+	if (result != 0) {
+		sync_cout << "info string Failed to sync the output kifu file: output_file_path="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+
 	return true;
 }
 
@@ -5,22 +5,65 @@
 
 #ifdef EVAL_LEARN
 
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "learn/learn.h"
 #include "position.h"
+#include "tanuki_kifu_container.h"
 
 namespace Tanuki {
+	// obt@ɗ߂ĂAobt@tɂȂ珑݃Xbhł܂Ƃ߂ďoB
+	// ݒ́Ãobt@ɗ߂ĂB
+	// ݂Ɏsꍇ́ǍWrite()/Flush()/Close()falseԂB
 	class KifuWriter {
 	public:
-		KifuWriter(const std::string& output_file_path);
+		// fsync_interval_secɐ̒lw肷ƁA̕bƂɏoefBXNɓB
+		// formatɏo`w肷B
+		// appendtruȅꍇÃt@C̖ɒǋLB
+		KifuWriter(const std::string& output_file_path, int fsync_interval_sec = 0, KifuFormat format = KifuFormat::Raw,
+			bool append = false);
 		virtual ~KifuWriter();
 		bool Write(const Learner::PackedSfenValue& record);
+		bool Write(const std::vector<Learner::PackedSfenValue>& records);
+		// obt@ɗ܂ĂoA݃XbhI܂ő҂B
+		bool Flush();
 		bool Close();
+		// oefBXNɓAς݂̃t@CTCYfile_sizeɊi[B
+		// `FbN|CgĊJۂ́At@C̃TCYɐ؂l߂ĒǋLB
+		bool Checkpoint(int64_t& file_size);
 
 	private:
+		bool EnsureOpen();
+		bool Submit();
+		void Run();
+		bool WriteRecords();
+		bool Sync();
+
 		const std::string output_file_path_;
+		const int fsync_interval_sec_;
+		const KifuFormat format_;
+		const bool append_;
 		FILE* file_ = nullptr;
+		time_t last_fsync_time_sec_ = 0;
 
-		bool EnsureOpen();
+		// Write()ŗ߂Ăobt@
+		std::vector<Learner::PackedSfenValue> front_buffer_;
+		// ݃Xbhoobt@
+		std::vector<Learner::PackedSfenValue> back_buffer_;
+		bool back_buffer_ready_ = false;
+		bool closing_ = false;
+		std::atomic<bool> failed_ = false;
+		std::mutex mutex_;
+		std::condition_variable condition_variable_;
+		std::thread thread_;
+		// KifuFormat::Gameŏoۂɋǖʂi߂邽߂̃XbhBŏɏoƂɐB
+		std::unique_ptr<Thread> encoder_thread_;
 	};
 }
 
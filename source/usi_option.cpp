@@ -4,6 +4,7 @@
 #include "misc.h"
 
 #include "tanuki_book.h"
+#include "tanuki_kifu_deduplicator.h"
 #include "tanuki_kifu_generator.h"
 #include "tanuki_kifu_shuffler.h"
 #include "tanuki_lazy_cluster.h"
@@ -184,6 +185,7 @@ namespace USI {
 		Tanuki::InitializeBook(o);
 		Tanuki::InitializeGenerator(o);
 		Tanuki::InitializeShuffler(o);
+		Tanuki::InitializeDeduplicator(o);
 		Tanuki::Progress::Initialize(o);
 #endif
 		// カレントフォルダに"engine_options.txt"があればそれをオプションとしてOptions[]の値をオーバーライドする機能。